@@ -0,0 +1,77 @@
+/* ahead of time translated code, see aot.py.
+   this file is included by cpu65.c when CPU_AOT is defined, the blocks
+   in aotblk.h are included by exec.c.
+
+   the blocks only run while the memory they were translated from holds
+   the image. each page of it is compared with the image the first time a
+   block in it is entered after the page was written, or remapped by
+   cpu65_map() or a HuC6280 MPR change, and blocks in pages that differ
+   are left to the interpreter. without CPU_MEMMAP the pages are read with
+   CPU_READ_N for that, which must not have side effects for them, and
+   the host needs to call cpu65_aot_invalidate() when it changes what
+   CPU_READ_N returns for them.
+*/
+#include "aotimg.h"
+
+#ifdef CPU65_ALL_TYPES
+#error CPU_AOT only supports a single cpu type
+#elif AOT_TYPE != CPU_TYPE
+#error aotimg.h was written for another cpu type than the one passed to gen.py
+#endif
+
+#define AOT_UNKNOWN 0 /* not compared since it last changed */
+#define AOT_SAME 1
+#define AOT_DIFF 2
+
+struct cpu65_aot {
+	u8 page[256]; /* AOT_* per page */
+};
+
+/* enable running the translated code for this cpu instance. like the
+   decode cache, stores through CPU_WRITE_N and to zeropage/stack are
+   tracked, other changes to memory need cpu65_aot_invalidate().
+   returns 0 on success, -1 if out of memory. */
+int cpu65_aot_init(struct cpu65 *cpu) {
+	if(!cpu->aot) cpu->aot = calloc(1, sizeof *cpu->aot);
+	return cpu->aot ? 0 : -1;
+}
+
+void cpu65_aot_free(struct cpu65 *cpu) {
+	free(cpu->aot);
+	cpu->aot = 0;
+}
+
+void cpu65_aot_invalidate(struct cpu65 *cpu, u16 addr, unsigned len) {
+	unsigned p;
+	if(!cpu->aot || !len) return;
+	if(len > 0x10000) len = 0x10000;
+	for(p = addr >> 8; p <= (addr + len - 1u) >> 8; ++p)
+		cpu->aot->page[p & 0xff] = AOT_UNKNOWN;
+}
+
+#define AOT_INVAL(ADDR) do { if(cpu->aot) cpu->aot->page[(u16)(ADDR) >> 8] = AOT_UNKNOWN; } while(0)
+
+/* whether the part of page p covered by the image holds it */
+static int aot_compare(struct cpu65 *cpu, unsigned p) {
+	unsigned lo = p << 8, hi = lo + 256;
+	if(lo < AOT_ORG) lo = AOT_ORG;
+	if(hi > AOT_ORG + AOT_LEN) hi = AOT_ORG + AOT_LEN;
+	if(lo >= hi) return 0;
+#ifdef CPU_MEMMAP
+	if(!cpu->rmap[p]) return 0;
+	return !memcmp(cpu->rmap[p] + (lo & 0xff), aot_image + (lo - AOT_ORG), hi - lo);
+#else
+	{
+		u8 buf[256];
+		CPU_READ_N(buf, lo, hi - lo);
+		return !memcmp(buf, aot_image + (lo - AOT_ORG), hi - lo);
+	}
+#endif
+}
+
+/* whether the blocks in page p may run */
+static inline int aot_same(struct cpu65 *cpu, unsigned p) {
+	u8 *s = &cpu->aot->page[p];
+	if(*s == AOT_UNKNOWN) *s = aot_compare(cpu, p) ? AOT_SAME : AOT_DIFF;
+	return *s == AOT_SAME;
+}
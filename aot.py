@@ -0,0 +1,231 @@
+import sys, os
+import gen
+from gen import tmap, pcbytes, idle_ops, rw_ops, idle_branches
+
+# ahead of time translation of a ROM image to C, see CPU_AOT in exec.c.
+# the image is loaded at org, by default so that it ends at 0xffff, and
+# walked from the interrupt vectors it holds and the addresses given with
+# -e. every run of instructions found that way becomes a block, a function
+# made of the same code as the handlers gen.py writes, with the opcode and
+# operand bytes as constants. blocks start at entries, at the targets of
+# branches, jumps and calls, and after branches and calls, and end with
+# control flow. indirect jumps, returns and anything not found by the walk
+# are left to the interpreter, as is the image where memory doesn't match
+# it at runtime.
+# with -c, a coverage map saved by cpu65_cov_save() (see CPU_COVERAGE in
+# cpu65.c) adds the instructions it saw executed that the walk didn't
+# find, reached through indirect jumps and returns, as entries, and the
+# code it saw written is left to the interpreter.
+# writes aotimg.h with the image and aotblk.h with the blocks. run gen.py
+# with the same type and NOUNDOC setting.
+
+def usage():
+	sys.stderr.write('usage: %s [-o org] [-e addr]... [-c map] type image\n'%sys.argv[0])
+	sys.stderr.write('chip type: ')
+	for k in sorted(tmap.keys()):
+		sys.stderr.write('%d: %s, '%(k, tmap[k]))
+	sys.stderr.write('\n')
+	sys.stderr.write('-o: address the image is loaded at, in hex\n')
+	sys.stderr.write('-e: further entry point, in hex, may be repeated\n')
+	sys.stderr.write('-c: coverage map of a run of the image\n')
+	sys.exit(1)
+
+# the attributes of a coverage map used here, CPU65_COV_* in cpu65.c
+COV_EXEC = 1
+COV_WRITE = 8
+
+# reads the coverage map saved to fn, see cpu65_cov_save()
+def load_cover(fn):
+	data = open(fn, 'rb').read()
+	if len(data) < 10 or data[:4] != b'C65C' or data[4] != 1:
+		sys.stderr.write('error: %s is not a coverage map\n'%fn)
+		sys.exit(1)
+	if data[5] != gen.cpu:
+		sys.stderr.write('error: %s is not a map of a %s\n'%(fn, tmap[gen.cpu]))
+		sys.exit(1)
+	# those of the HuC6280 are by physical address
+	if int.from_bytes(data[6:10], 'little') != 0x10000:
+		sys.stderr.write('error: %s is not a 64K map\n'%fn)
+		sys.exit(1)
+	cov = bytearray()
+	i = 10
+	while i < len(data) and len(cov) < 0x10000:
+		tag = data[i]
+		i += 1
+		if tag < 0x80:
+			cov += data[i:i + tag + 1]
+			i += tag + 1
+			continue
+		n = s = 0
+		while i < len(data):
+			n |= (data[i] & 0x7f) << s
+			s += 7
+			i += 1
+			if data[i - 1] < 0x80: break
+		cov += bytes([tag & 0x7f]) * (n + 1)
+	if len(cov) != 0x10000:
+		sys.stderr.write('error: %s is cut short\n'%fn)
+		sys.exit(1)
+	return cov
+
+# the vectors read at reset and interrupts, see int_service() in exec.c
+def vectors(cpu):
+	if cpu == 4: return (0xfff6, 0xfff8, 0xfffa, 0xfffc, 0xfffe)
+	return (0xfffa, 0xfffc, 0xfffe)
+
+# instructions after which the block ends. wai and stp end the slice or
+# the run, the rest set pc.
+ends = dict(idle_branches, bsr=1, jmp=1, jsr=1, rts=1, rti=1, brk=1, wai=1, stp=1)
+
+# instructions which may write memory, or change the mapping, so the code
+# of the block may have changed. everything but register-only ones.
+def writes(opname, mode):
+	return opname not in idle_ops or (opname in rw_ops and mode != 'acc')
+
+# walks the code from entries, up to code in written. returns per address
+# found the opcode, and the addresses blocks start at.
+def walk(img, org, entries, optarget, written):
+	end = org + len(img)
+	insns = {}
+	leaders = set()
+	todo = [a for a in entries if org <= a < end]
+	leaders.update(todo)
+	while todo:
+		pc = todo.pop()
+		while not pc in insns:
+			x = img[pc - org]
+			opname, mode = optarget[x].rsplit('_', 1)
+			n = pcbytes[mode]
+			# jams, or no such opcode and most likely data
+			if optarget[x] == 'kil_imp1': break
+			if pc + n > end: break
+			if written.intersection(range(pc, pc + n)): break
+			insns[pc] = x
+			ob = img[pc - org + 1:pc - org + n]
+			succ = []
+			if opname in idle_branches or opname == 'bsr':
+				succ.append((pc + n + (ob[-1] ^ 0x80) - 0x80) & 0xffff)
+			elif opname in ('jmp', 'jsr') and mode == 'abs':
+				succ.append(ob[0] | ob[1] << 8)
+			for a in succ:
+				if org <= a < end:
+					leaders.add(a)
+					todo.append(a)
+			if opname in ends:
+				if opname in ('jmp', 'bra', 'rts', 'rti', 'brk', 'stp'): break
+				leaders.add(pc + n)
+			pc += n
+			if pc >= end: break
+	return insns, leaders
+
+# the instructions executed according to the coverage map cov that insns
+# doesn't have, and which the one executed before doesn't fall through to
+def cover_entries(img, org, optarget, insns, cov):
+	res = []
+	fall = None
+	for pc in range(org, org + len(img)):
+		if not cov[pc] & COV_EXEC: continue
+		if pc not in insns and pc != fall: res.append(pc)
+		opname, mode = optarget[img[pc - org]].rsplit('_', 1)
+		fall = None if opname in ('jmp', 'bra', 'rts', 'rti', 'brk', 'stp') else pc + pcbytes[mode]
+	return res
+
+# the blocks, as lists of instruction addresses. a block doesn't span
+# more than two pages, so AOT_ENTER only needs to check these.
+def blocks(insns, leaders, optarget):
+	res = []
+	for start in sorted(leaders):
+		if not start in insns: continue
+		pc = start
+		blk = []
+		while pc in insns:
+			opname, mode = optarget[insns[pc]].rsplit('_', 1)
+			n = pcbytes[mode]
+			if ((pc + n - 1) >> 8) - (start >> 8) > 1: break
+			blk.append(pc)
+			pc += n
+			if opname in ends or pc in leaders: break
+		if blk: res.append(blk)
+	return res
+
+def main(fn, org, entries, cover):
+	opmap, addrmode, optarget = gen.optables()
+	img = bytearray(open(fn, 'rb').read())
+	if org is None: org = 0x10000 - len(img)
+	if not img or org < 0 or org + len(img) > 0x10000:
+		sys.stderr.write('error: %s does not fit at 0x%04x\n'%(fn, org & 0xffff))
+		sys.exit(1)
+	for v in vectors(gen.cpu):
+		if org <= v and v + 2 <= org + len(img):
+			entries.append(img[v - org] | img[v - org + 1] << 8)
+	written = set()
+	if cover:
+		cov = load_cover(cover)
+		written = set(a for a in range(org, org + len(img)) if cov[a] & COV_WRITE)
+	insns, leaders = walk(img, org, entries, optarget, written)
+	if cover:
+		more = cover_entries(img, org, optarget, insns, cov)
+		insns, leaders = walk(img, org, entries + more, optarget, written)
+
+	out = open('aotimg.h', 'w')
+	out.write('/* written by aot.py from %s */\n'%os.path.basename(fn))
+	out.write('#define AOT_TYPE CPU_TYPE_%s\n'%tmap[gen.cpu])
+	out.write('#define AOT_ORG 0x%04x\n'%org)
+	out.write('#define AOT_LEN 0x%x\n'%len(img))
+	out.write('static const u8 aot_image[] = {')
+	for i, b in enumerate(img):
+		out.write('%s0x%02x,'%('\n\t' if i % 12 == 0 else ' ', b))
+	out.write('\n};\n')
+	out.close()
+
+	out = open('aotblk.h', 'w')
+	pages = {}
+	ninsns = 0
+	for blk in blocks(insns, leaders, optarget):
+		start = blk[0]
+		last = blk[-1] + pcbytes[optarget[insns[blk[-1]]].rsplit('_', 1)[1]] - 1
+		pg = '0x%02x, 0x%02x'%(start >> 8, last >> 8)
+		out.write('/* 0x%04x-0x%04x */\n'%(start, last))
+		out.write('static int aot_%04x(struct cpu65 *cpu, struct exec_st *st) { AOT_ENTER(%s);\n'%(start, pg))
+		for pc in blk:
+			x = insns[pc]
+			opname, mode = optarget[x].rsplit('_', 1)
+			defs, code = gen.handler(x, opmap, addrmode, optarget)
+			ob = list(img[pc - org:pc - org + 7])
+			ob += [0] * (7 - len(ob))
+			out.write('%s\t{ AOT_OB(%s); %s }\n'%(defs, ', '.join('0x%02x'%b for b in ob), code))
+			if writes(opname, mode) and pc != blk[-1]: out.write('\tAOT_CHECK(%s);\n'%pg)
+		out.write('\tAOT_NEXT();\n}\n')
+		pages.setdefault(start >> 8, []).append(start)
+		ninsns += len(blk)
+	for p in sorted(pages):
+		out.write('static int (*const aot_p%02x[256])(struct cpu65 *, struct exec_st *) = {\n'%p)
+		for a in pages[p]: out.write('\t[0x%02x] = aot_%04x,\n'%(a & 0xff, a))
+		out.write('};\n')
+	out.write('/* the blocks starting in each page, by the low byte of their address */\n')
+	out.write('static int (*const *const aot_pages[256])(struct cpu65 *, struct exec_st *) = {\n')
+	for p in sorted(pages): out.write('\t[0x%02x] = aot_p%02x,\n'%(p, p))
+	out.write('};\n')
+	out.close()
+	sys.stdout.write('%d blocks, %d instructions\n'%(sum(len(v) for v in pages.values()), ninsns))
+
+if __name__ == '__main__':
+	args = sys.argv[1:]
+	org = None
+	entries = []
+	cover = None
+	while args and args[0] in ('-o', '-e', '-c'):
+		o = args.pop(0)
+		if not args: usage()
+		if o == '-c':
+			cover = args.pop(0)
+			continue
+		try: a = int(args.pop(0), 16)
+		except ValueError: usage()
+		if a < 0 or a > 0xffff: usage()
+		if o == '-o': org = a
+		else: entries.append(a)
+	if len(args) != 2 or not args[0].isdigit() or int(args[0]) not in tmap: usage()
+	gen.cpu = int(args[0])
+	gen.no_undocumented = gen.get_no_undocumented(gen.cpu)
+	main(args[1], org, entries, cover)
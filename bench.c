@@ -0,0 +1,261 @@
+/* benchmark driver, built and run by bench.py for each type and dispatch
+   backend. the workloads come from benchwl.h, which bench.py assembles
+   for the type the tables were generated for.
+   each workload is run from reset on flat 64K memory until it reaches
+   its done loop, again and again until the cycles given as argument, in
+   millions, are used up, but at least once. per workload a line
+   name runs cycles seconds checksum [instructions cycles]
+   is printed, the checksum covers registers and memory after the last
+   run. with CPU_PROFILE, the instructions and cycles up to the done loop
+   follow, as counted by the profiler, and the opcode pairs of all
+   workloads are written to the file given as second argument, if any,
+   for FUSE in gen.py. with CPU_LANES, every lane runs the workload, on
+   memory of its own, in lockstep by cpu65_lanes_exec(), and runs and
+   cycles are those of all lanes together. the checksum is replaced by
+   "lanes" if any lane ends up different from the first. with BENCH_BUS,
+   memory is accessed through a handler per page, see below. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* 16 spare bytes for fetches running past 0xffff */
+static uint8_t mem[65536 + 16];
+
+#if defined(CPU_LANES) && !defined(CPU_MEMMAP)
+/* the memory of each lane is in cpu->user, see setup() */
+#define CPU_READ_N(DEST, ADDR, N) memcpy(DEST, (uint8_t *) cpu->user + (ADDR), N)
+#define CPU_WRITE_N(SRC, ADDR, N) memcpy((uint8_t *) cpu->user + (ADDR), SRC, N)
+#elif defined(BENCH_BUS)
+/* the bus of a typical emulator instead of flat memory: every byte goes
+   through the handler of its 256 byte page, called through a table. they
+   all end up in mem, but each fetch costs a call per byte. */
+static uint8_t (*bus_rd[256])(unsigned);
+static void (*bus_wr[256])(unsigned, uint8_t);
+static uint8_t ram_rd(unsigned a) { return mem[a]; }
+static void ram_wr(unsigned a, uint8_t v) { mem[a] = v; }
+static void bus_read(void *dest, unsigned a, unsigned n) {
+	uint8_t *d = dest;
+	for(; n; --n, ++a) *d++ = bus_rd[(a >> 8) & 0xff](a);
+}
+static void bus_write(const void *src, unsigned a, unsigned n) {
+	const uint8_t *s = src;
+	for(; n; --n, ++a) bus_wr[(a >> 8) & 0xff](a, *s++);
+}
+#define CPU_READ_N(DEST, ADDR, N) bus_read(DEST, ADDR, N)
+#define CPU_WRITE_N(SRC, ADDR, N) bus_write(SRC, ADDR, N)
+#elif !defined(CPU_MEMMAP)
+#define CPU_READ_N(DEST, ADDR, N) memcpy(DEST, mem + (ADDR), N)
+#define CPU_WRITE_N(SRC, ADDR, N) memcpy(mem + (ADDR), SRC, N)
+#endif
+
+#include "cpu65.c"
+
+#ifdef CPU65_ALL_TYPES
+#error bench.c is for a single type, run gen.py with the type to measure
+#endif
+#ifdef CPU_NO_COUNT_CYCLES
+#error bench.c needs cpu65_exec() to return after the cycles it asks for
+#endif
+
+struct workload {
+	const char *name;
+	u16 org, done;
+	const u8 *code;
+	unsigned len;
+};
+
+#include "benchwl.h"
+
+#ifdef CPU_LANES
+#define NCPU CPU65_LANES
+/* the memory of the lanes after the first, which has mem */
+static uint8_t lmem[NCPU - 1][sizeof mem];
+static struct cpu65_lanes lanes;
+#else
+#define NCPU 1
+#endif
+static struct cpu65 cpus[NCPU];
+
+static uint8_t *lane_mem(unsigned k) {
+#ifdef CPU_LANES
+	if(k) return lmem[k - 1];
+#else
+	(void) k;
+#endif
+	return mem;
+}
+
+/* a run not done after this many cycles is stuck */
+#define RUN_MAX_CYCLES 1000000000ULL
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t fnv(uint32_t h, const u8 *p, size_t n) {
+	while(n--) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static uint32_t checksum(struct cpu65 *cpu) {
+	u8 r[5] = { cpu->a, cpu->x, cpu->y, cpu->s, pack_flags(cpu) };
+	uint32_t h = fnv(2166136261u, r, sizeof r);
+	h = fnv(h, cpu->mpr, sizeof cpu->mpr);
+	return fnv(h, cpu->user, 65536);
+}
+
+static int at_done(const struct workload *w) {
+	unsigned k;
+	for(k = 0; k < NCPU; ++k) if(cpus[k].pc != w->done) return 0;
+	return 1;
+}
+
+/* runs w once from reset on every cpu, returns the cycles taken */
+static uint64_t run(const struct workload *w, double *t) {
+	uint64_t done = 0;
+	unsigned i, k;
+	for(k = 0; k < NCPU; ++k) {
+		struct cpu65 *cpu = &cpus[k];
+		uint8_t *m = lane_mem(k);
+		for(i = 0; i < sizeof mem; ++i) m[i] = i * 7 + (i >> 8);
+		memcpy(m + w->org, w->code, w->len);
+#ifdef CPU_DECODE_CACHE
+		cpu65_dcache_invalidate(cpu, 0, 0x10000);
+#endif
+#ifdef CPU_JIT
+		cpu65_jit_invalidate(cpu, 0, 0x10000);
+#endif
+#ifdef CPU_AOT
+		cpu65_aot_invalidate(cpu, 0, 0x10000);
+#endif
+		cpu65_reset(cpu, w->org);
+	}
+#ifdef CPU_PROFILE
+	cpu65_prof_free(cpus);
+	if(cpu65_prof_init(cpus)) return 0;
+#endif
+	*t -= now();
+	/* slices of about a 60 Hz frame at 1.79 MHz */
+	do {
+#ifdef CPU_LANES
+		cpu65_lanes_exec(&lanes, 29830);
+		for(k = 0; k < NCPU; ++k) done += lanes.cyc[k];
+#else
+		done += cpu65_exec(cpus, 29830);
+#endif
+	} while(!at_done(w) && done < RUN_MAX_CYCLES * NCPU);
+	*t += now();
+	return done;
+}
+
+/* sets up cpu with m as its memory */
+static void setup(struct cpu65 *cpu, uint8_t *m) {
+	cpu65_init(cpu, m + ZP_BASE);
+	cpu->user = m;
+#if defined(BENCH_BUS) && !defined(CPU_LANES) && !defined(CPU_MEMMAP)
+	{
+		unsigned p;
+		for(p = 0; p < 256; ++p) {
+			bus_rd[p] = ram_rd;
+			bus_wr[p] = ram_wr;
+		}
+	}
+#endif
+#ifdef CPU_MEMMAP
+# if HAS_HUC
+	unsigned b;
+	for(b = 0; b < 8; ++b)
+		cpu65_map_bank(cpu, b, m + b * 0x2000, CPU65_MAP_READ | CPU65_MAP_WRITE);
+# else
+	cpu65_map(cpu, 0, 0x10000, m, CPU65_MAP_READ | CPU65_MAP_WRITE);
+# endif
+#endif
+}
+
+int main(int argc, char **argv) {
+	struct cpu65 *cpu = cpus;
+	uint64_t cycles, limit = (argc > 1 ? strtoull(argv[1], 0, 10) : 100) * 1000000;
+	unsigned i, k, runs;
+	double t;
+	int same;
+#ifdef CPU_PROFILE
+	FILE *pairs = argc > 2 ? fopen(argv[2], "w") : 0;
+	if(argc > 2 && !pairs) return 1;
+#endif
+	for(i = 0; i < sizeof workloads / sizeof *workloads; ++i) {
+		const struct workload *w = &workloads[i];
+		for(k = 0; k < NCPU; ++k) {
+			setup(&cpus[k], lane_mem(k));
+#ifdef CPU_DECODE_CACHE
+			if(cpu65_dcache_init(&cpus[k])) return 1;
+#endif
+#ifdef CPU_JIT
+			if(cpu65_jit_init(&cpus[k])) return 1;
+#endif
+#ifdef CPU_AOT
+			if(cpu65_aot_init(&cpus[k])) return 1;
+#endif
+#ifdef CPU_IDLE_SKIP
+			cpus[k].idle_skip = 1;
+#endif
+		}
+#ifdef CPU_LANES
+		{
+			struct cpu65 *cp[NCPU];
+			for(k = 0; k < NCPU; ++k) cp[k] = &cpus[k];
+			cpu65_lanes_init(&lanes, cp, NCPU);
+		}
+#endif
+		cycles = 0;
+		runs = 0;
+		t = 0;
+		do {
+			cycles += run(w, &t);
+			runs += NCPU;
+		} while(cycles < limit * NCPU);
+		for(same = 1, k = 1; k < NCPU; ++k)
+			same &= checksum(&cpus[k]) == checksum(cpu) && cpus[k].cycles == cpu->cycles;
+		printf("%s %u %llu %f ", w->name, runs, (unsigned long long) cycles, t);
+		if(same) printf("%08x", (unsigned) checksum(cpu));
+		else printf("lanes");
+#ifdef CPU_PROFILE
+		{
+			struct cpu65_prof *p = cpu->prof;
+			uint64_t n = 0, c = p->int_cycles + p->wait_cycles;
+			unsigned op;
+			for(op = 0; op < 256; ++op) {
+				n += p->op_count[op];
+				c += p->op_cycles[op];
+			}
+			printf(" %llu %llu", (unsigned long long) (n - p->pc_count[w->done]),
+				(unsigned long long) (c - p->pc_cycles[w->done]));
+		}
+		if(pairs) cpu65_prof_pairs(cpu, pairs);
+		cpu65_prof_free(cpu);
+#endif
+		printf("\n");
+		for(k = 0; k < NCPU; ++k) {
+#ifdef CPU_AOT
+			cpu65_aot_free(&cpus[k]);
+#endif
+#ifdef CPU_JIT
+			cpu65_jit_free(&cpus[k]);
+#endif
+#ifdef CPU_DECODE_CACHE
+			cpu65_dcache_free(&cpus[k]);
+#endif
+		}
+	}
+#ifdef CPU_PROFILE
+	if(pairs && fclose(pairs)) return 1;
+#endif
+	return 0;
+}
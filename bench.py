@@ -0,0 +1,572 @@
+import sys, os, re, shutil, subprocess, tempfile, json
+from tracedec import tmap, optable
+
+# benchmark and conformance suite. the workloads below are assembled for
+# each chip type, run by bench.c to completion, and the final registers
+# and memory are checked against bench.golden, together with the cycles
+# and instructions they take as counted by the plain interpreter, and
+# the cycles of a run, slices included. every build has to take exactly
+# those per run, so options running more than one instruction at once,
+# like the JIT, are held to the same slice ends.
+# speed is measured once per dispatch backend, so the backend to pass to
+# gen.py can be picked per compiler from data. everything is built in a
+# scratch directory, the tables in this one are left alone. the compiler
+# is taken from CC, extra arguments are passed to it, e.g. to measure
+# with the decode cache: python3 bench.py -t 2 -O3 -DCPU_DECODE_CACHE
+# each build is followed by one of check.c with the same options, which
+# checks what the workloads don't get to, and per type it's built once
+# more with the debugging features it checks, check_cflags.
+# the exit status is 1 if any result differs from bench.golden, or any
+# check fails.
+# -p writes the opcode pairs the workloads run, -f has the goto backend
+# built with the pairs fused from such a file, which needs the decode
+# cache: python3 bench.py -t 2 -p pairs; python3 bench.py -t 2 -f pairs
+# -d goto -O2 -DCPU_DECODE_CACHE
+# -a builds once per workload, with it translated by aot.py, see CPU_AOT.
+# -l adds a column for CPU_LANES, the goto backend built with it, whose
+# MHz are those of all lanes together: python3 bench.py -t 2 -l -O2 -mavx2
+# -b has the memory accessed through a call per byte, like the bus of a
+# typical emulator, see BENCH_BUS in bench.c. that's where the decode
+# cache saves the most: python3 bench.py -t 1 -b -O2 -DCPU_DECODE_CACHE
+
+backends = ('goto', 'switch', 'fnptr', 'musttail')
+check_cflags = ['-O2', '-DCPU_MEMMAP', '-DCPU_REPLAY', '-DCPU_REWIND', '-DCPU_BREAK', '-DCPU_TRACE', '-DCPU_COVERAGE']
+
+def usage():
+	sys.stderr.write('usage: %s [-t type] [-d backend] [-m mcycles] [-r runs] [-j] [-g] [-p file] [-f file] [-a] [-l] [-b] [cflags...]\n'%sys.argv[0])
+	sys.stderr.write('-t: chip type, may be repeated, default all of them: ')
+	for k in sorted(tmap.keys()):
+		sys.stderr.write('%d: %s, '%(k, tmap[k]))
+	sys.stderr.write('\n')
+	sys.stderr.write('-d: dispatch backend, may be repeated, default all of them: %s\n'%', '.join(backends))
+	sys.stderr.write('-m: million cycles per workload and run (default 100)\n')
+	sys.stderr.write('-r: runs per backend, the best one counts (default 3)\n')
+	sys.stderr.write('-j: write json lines instead of a table\n')
+	sys.stderr.write('-g: write bench.golden from the results instead of checking them\n')
+	sys.stderr.write('-p: write the opcode pairs of the workloads to file, for one type\n')
+	sys.stderr.write('-f: fuse the pairs from file in the goto backend, see FUSE in gen.py\n')
+	sys.stderr.write('-a: run each workload translated by aot.py, from a build of its own\n')
+	sys.stderr.write('-l: also run the goto backend with CPU_LANES, all lanes counted\n')
+	sys.stderr.write('-b: access memory through a call per byte, see BENCH_BUS in bench.c\n')
+	sys.stderr.write('cflags default to -O2\n')
+	sys.exit(1)
+
+# the workloads. code is assembled at org and ends in a jmp to itself at
+# the label done. zeropage is 0x00-0x3f, data at 0x4000-0x7fff, which
+# bench.c fills with a fixed pattern. all but the first few bytes of
+# 0x2000-0x21ff are left alone, as that's zeropage and stack on HuC6280.
+workloads = [
+	('loop', (0, 1, 2, 3, 4), 0x0200, '''
+	lda #8
+	sta $00
+	ldx #0
+	ldy #0
+l:	dex
+	bne l
+	dey
+	bne l
+	dec $00
+	bne l
+done:	jmp done
+'''),
+	('copy', (0, 1, 2, 3, 4), 0x0200, '''
+	lda #40
+	sta $00
+rep:	lda #$00
+	sta $10
+	sta $12
+	lda #$40
+	sta $11
+	lda #$60
+	sta $13
+	ldx #16
+page:	ldy #0
+byte:	lda ($10), y
+	sta ($12), y
+	iny
+	lda ($10), y
+	sta ($12), y
+	iny
+	bne byte
+	inc $11
+	inc $13
+	dex
+	bne page
+	dec $00
+	bne rep
+done:	jmp done
+'''),
+	('bcd', (0, 1, 2, 3, 4), 0x0200, '''
+	lda #0
+	ldx #5
+clr:	sta $20, x
+	dex
+	bpl clr
+	ldy #160
+	sed
+l:	clc
+	lda $20
+	adc #$37
+	sta $20
+	lda $21
+	adc #$19
+	sta $21
+	lda $22
+	adc #0
+	sta $22
+	lda $23
+	adc #0
+	sta $23
+	sec
+	lda $24
+	sbc #$13
+	sta $24
+	lda $25
+	sbc #0
+	sta $25
+	php
+	pla
+	eor $26
+	sta $26
+	dex
+	bne l
+	dey
+	bne l
+	cld
+done:	jmp done
+'''),
+	('recurse', (0, 1, 2, 3, 4), 0x0200, '''
+	lda #0
+	sta $00
+	sta $01
+	sta $02
+	lda #4
+	sta $03
+rep:	ldx #80
+	jsr rec
+	dec $00
+	bne rep
+	dec $03
+	bne rep
+done:	jmp done
+rec:	dex
+	beq leaf
+	txa
+	pha
+	jsr rec
+	pla
+	adc $01
+	sta $01
+	rts
+leaf:	inc $02
+	rts
+'''),
+	('walk', (0, 1, 2, 3, 4), 0x0200, '''
+	lda #0
+	sta $02
+	sta $03
+	sta $04
+	sta $10
+	sta $14
+	lda #$40
+	sta $11
+	lda #$50
+	sta $15
+	ldx #0
+rep:	ldy #0
+step:	lda ($10), y
+	tay
+	eor $02
+	rol a
+	sta $02
+	lda ($14), y
+	adc $03
+	sta $03
+	dex
+	bne step
+	lda $11
+	adc #1
+	and #$0f
+	ora #$40
+	sta $11
+	dec $04
+	bne rep
+done:	jmp done
+'''),
+	('selfmod', (0, 1, 2, 3, 4), 0x0200, '''
+	lda #0
+	sta $00
+	lda #$70
+	sta st + 2
+rep:	ldx #0
+inner:	txa
+imm:	adc #$00
+st:	sta $7000, x
+	inc imm + 1
+	inx
+	bne inner
+	lda st + 2
+	adc #1
+	and #$0f
+	ora #$70
+	sta st + 2
+	dec $00
+	bne rep
+done:	jmp done
+'''),
+	('cmos', (2, 3, 4), 0x0200, '''
+	stz $00
+	stz $10
+	lda #$48
+	sta $11
+rep:	ldx #0
+l:	phx
+	txa
+	inc a
+	sta ($10)
+	tsb $30
+	trb $31
+	bit #$40
+	ply
+	lda ($10)
+	adc $4000, y
+	sta $32
+	inx
+	bne l
+	inc $10
+	dec $00
+	bne rep
+	bra done
+	nop
+done:	jmp done
+'''),
+	('bits', (3, 4), 0x0200, '''
+	stz $00
+rep:	ldx #0
+l:	smb3 $30
+	bbs3 $30, s1
+	inc $31
+s1:	rmb3 $30
+	bbr3 $30, s2
+	inc $32
+s2:	lda $4000, x
+	sta $33
+	bbr0 $33, s3
+	inc $34
+s3:	bbs7 $33, s4
+	inc $35
+s4:	inx
+	bne l
+	dec $00
+	bne rep
+done:	jmp done
+'''),
+	('huc', (4,), 0x0200, '''
+	lda #64
+	sta $00
+rep:	tii $4000, $6000, $0400
+	tdd $47ff, $67ff, $0200
+	tia $5000, $6400, $0100
+	tin $5100, $6600, $0100
+	tai $5200, $6800, $0100
+	ldx #0
+l:	lda $6000, x
+	ldy $6100, x
+	sax
+	say
+	sxy
+	tst #$81, $6200, x
+	bne n
+	cla
+	cly
+n:	bsr sub
+	inx
+	bne l
+	dec $00
+	bne rep
+done:	jmp done
+sub:	tst #$10, $30
+	beq z
+	clx
+	ldx $30
+z:	inc $30
+	rts
+'''),
+]
+
+# maps the MPRs like flat memory, bench.c does the same for the banks.
+# prepended for HuC6280, where they are all 0 after reset.
+huc_prologue = ''.join('\tlda #%d\n\ttam #$%02x\n'%(n, 1 << n) for n in range(1, 8))
+
+def asm_error(name, line, msg):
+	sys.stderr.write('%s: %s: %s\n'%(name, line.strip(), msg))
+	sys.exit(1)
+
+# a small two pass assembler for the syntax CPU_DEBUG prints, plus labels
+# and + or - in expressions. on the first pass unknown labels count as
+# 16 bit and the address mode chosen there is kept.
+def assemble(name, src, cpu, org):
+	tbl = optable(cpu)
+	ops = {}
+	for x in range(256):
+		mn, am = tbl[x]
+		if mn[0] == '%': mn = mn[1:] # documented on later types
+		if mn[0] in 'abcdefghijklmnopqrstuvwxyz' and not (mn, am) in ops: ops[(mn, am)] = x
+	size = { 'imp1': 1, 'acc': 1, 'imm': 2, 'imp2': 2, 'zp': 2, 'zpx': 2, 'zpy': 2,
+		'ind': 2, 'izx': 2, 'izy': 2, 'rel': 2, 'abs': 3, 'abx': 3, 'aby': 3,
+		'abi': 3, 'abix': 3, 'zprel': 3, 'immzp': 3, 'immzx': 3, 'immab': 4,
+		'immax': 4, 'imp3': 7 }
+	labels = {}
+	modes = {}
+	def value(s, line, need):
+		v = 0
+		for sign, t in re.findall(r'([+-]?)\s*([^+\-\s]+)', s):
+			if t[0] == '$': n = int(t[1:], 16)
+			elif t.isdigit(): n = int(t)
+			elif t in labels: n = labels[t]
+			elif need: asm_error(name, line, 'unknown label %s'%t)
+			else: return None
+			v = v - n if sign == '-' else v + n
+		return v
+	def mode(mn, o, line):
+		has = lambda am: (mn, am) in ops
+		zp = lambda s: value(s, line, 0) is not None and value(s, line, 0) < 256
+		if o == '': return 'imp1' if has('imp1') else 'acc'
+		if o == 'a' and has('acc'): return 'acc'
+		if has('imp3'): return 'imp3'
+		if has('imp2'): return 'imp2'
+		if has('zprel'): return 'zprel'
+		m = re.match(r'#([^,]+),\s*(.+?)(,\s*x)?$', o)
+		if m: return ('immzx' if m.group(3) else 'immzp') if zp(m.group(2)) else ('immax' if m.group(3) else 'immab')
+		if o[0] == '#': return 'imm'
+		m = re.match(r'\((.+)\),\s*y$', o)
+		if m: return 'izy'
+		m = re.match(r'\((.+),\s*x\)$', o)
+		if m: return 'izx' if zp(m.group(1)) and has('izx') else 'abix'
+		m = re.match(r'\((.+)\)$', o)
+		if m: return 'ind' if zp(m.group(1)) and has('ind') else 'abi'
+		m = re.match(r'(.+),\s*([xy])$', o)
+		if m: return ('zp' if zp(m.group(1)) and has('zp' + m.group(2)) else 'ab') + m.group(2)
+		if has('rel'): return 'rel'
+		return 'zp' if zp(o) and has('zp') else 'abs'
+	def operands(am, o, pc, line):
+		v = lambda s: value(s, line, 1)
+		def rel(s, end):
+			d = v(s) - end
+			if d < -128 or d > 127: asm_error(name, line, 'branch out of range')
+			return [d & 0xff]
+		w = lambda n: [n & 0xff, (n >> 8) & 0xff]
+		if am in ('imp1', 'acc'): return []
+		if am in ('imm', 'imp2'): return [v(o.lstrip('#')) & 0xff]
+		if am == 'rel': return rel(o, pc + 2)
+		a = [s.strip() for s in re.sub(r'[()]', '', o).split(',')]
+		if am == 'imp3': return w(v(a[0])) + w(v(a[1])) + w(v(a[2]))
+		if am == 'zprel': return [v(a[0]) & 0xff] + rel(a[1], pc + 3)
+		if am in ('immzp', 'immzx'): return [v(a[0][1:]) & 0xff, v(a[1]) & 0xff]
+		if am in ('immab', 'immax'): return [v(a[0][1:]) & 0xff] + w(v(a[1]))
+		if size[am] == 2: return [v(a[0]) & 0xff]
+		return w(v(a[0]))
+	for p in (1, 2):
+		pc = org
+		code = []
+		for i, line in enumerate(src.splitlines()):
+			l = line.split(';')[0].strip()
+			m = re.match(r'(\w+):\s*(.*)', l)
+			if m:
+				if p == 1: labels[m.group(1)] = pc
+				l = m.group(2)
+			if not l: continue
+			mn, o = (l.split(None, 1) + [''])[:2]
+			o = o.strip()
+			if p == 1: modes[i] = mode(mn, o, line)
+			am = modes[i]
+			if not (mn, am) in ops: asm_error(name, line, 'no %s %s on %s'%(mn, am, tmap[cpu]))
+			if p == 2: code += [ops[(mn, am)]] + operands(am, o, pc, line)
+			pc += size[am]
+	if not 'done' in labels: asm_error(name, '', 'no label done')
+	return code, labels['done']
+
+# writes the workloads for cpu to benchwl.h in d, see bench.c. returns
+# the code of each, with the address it's loaded at.
+def genheader(d, cpu):
+	out = open(os.path.join(d, 'benchwl.h'), 'w')
+	names = []
+	codes = {}
+	for name, types, org, src in workloads:
+		if not cpu in types: continue
+		if cpu == 4: src = huc_prologue + src
+		code, end = assemble(name, src, cpu, org)
+		codes[name] = (org, code)
+		out.write('static const u8 wl_%s[] = {'%name)
+		for i, b in enumerate(code):
+			out.write('%s0x%02x,'%('\n\t' if i % 12 == 0 else ' ', b))
+		out.write('\n};\n')
+		names.append((name, org, end))
+	out.write('static const struct workload workloads[] = {\n')
+	for name, org, end in names:
+		out.write('\t{ "%s", 0x%04x, 0x%04x, wl_%s, sizeof wl_%s },\n'%(name, org, end, name, name))
+	out.write('};\n')
+	out.close()
+	return codes
+
+# aot is the name of the workload to translate with aot.py, if any
+def build(src, tmp, cpu, backend, cflags, tag=None, fuse=None, aot=None):
+	d = os.path.join(tmp, '%d_%s'%(cpu, tag or backend))
+	os.mkdir(d)
+	for f in os.listdir(src):
+		if f.endswith(('.py', '.csv', '.c')): shutil.copy(os.path.join(src, f), d)
+	env = dict(os.environ, DISPATCH=backend)
+	env.pop('FUSE', None)
+	if fuse and backend == 'goto': env['FUSE'] = fuse
+	subprocess.check_call([sys.executable, 'gen.py', str(cpu)], cwd=d, env=env, stdout=subprocess.DEVNULL)
+	codes = genheader(d, cpu)
+	if aot:
+		org, code = codes[aot]
+		open(os.path.join(d, 'aot.bin'), 'wb').write(bytearray(code))
+		subprocess.check_call([sys.executable, 'aot.py', '-o', '%x'%org, '-e', '%x'%org, str(cpu), 'aot.bin'],
+			cwd=d, env=env, stdout=subprocess.DEVNULL)
+		cflags = cflags + ['-DCPU_AOT']
+	cc = os.environ['CC'] if 'CC' in os.environ else 'cc'
+	exe = os.path.join(d, 'bench')
+	if subprocess.call([cc] + cflags + ['bench.c', '-o', exe], cwd=d) != 0: return None
+	return exe
+
+# builds check.c next to exe and runs it, returns what it found off
+def check(exe, cflags):
+	d = os.path.dirname(exe)
+	cc = os.environ['CC'] if 'CC' in os.environ else 'cc'
+	chk = os.path.join(d, 'check')
+	if subprocess.call([cc] + cflags + ['check.c', '-o', chk], cwd=d) != 0: return ['check.c did not build']
+	p = subprocess.run([chk], stdout=subprocess.PIPE)
+	return (p.stdout.decode().splitlines() or ['check failed']) if p.returncode else []
+
+# runs exe, returns per workload: runs, cycles, seconds, checksum, and
+# with CPU_PROFILE instructions and cycles up to done. pairs is the file
+# the reference build writes the opcode pairs to.
+def run(exe, mcycles, pairs=None):
+	res = {}
+	for line in subprocess.check_output([exe, str(mcycles)] + ([pairs] if pairs else [])).decode().splitlines():
+		f = line.split()
+		res[f[0]] = (int(f[1]), int(f[2]), float(f[3]), f[4]) + tuple(int(x) for x in f[5:])
+	return res
+
+def load_golden(fn):
+	golden = {}
+	if not os.path.exists(fn): return golden
+	for line in open(fn):
+		f = line.split()
+		if not f or f[0][0] == '#': continue
+		golden[(int(f[0]), f[1])] = (f[2], int(f[3]), int(f[4]), int(f[5]))
+	return golden
+
+def write_golden(fn, golden):
+	out = open(fn, 'w')
+	out.write('# type workload checksum cycles instructions runcycles, written by bench.py -g\n')
+	for k in sorted(golden.keys()):
+		out.write('%d %s %s %d %d %d\n'%((k[0], k[1]) + golden[k]))
+	out.close()
+
+if __name__ == '__main__':
+	args = sys.argv[1:]
+	types = []
+	dispatch = []
+	mcycles = 100
+	runs = 3
+	js = 0
+	gen = 0
+	pairs = None
+	fuse = None
+	aot = 0
+	lanes = 0
+	bus = 0
+	while args and args[0] in ('-t', '-d', '-m', '-r', '-j', '-g', '-p', '-f', '-a', '-l', '-b'):
+		o = args.pop(0)
+		if o == '-j': js = 1
+		elif o == '-a': aot = 1
+		elif o == '-l': lanes = 1
+		elif o == '-b': bus = 1
+		elif o == '-g': gen = 1
+		elif not args: usage()
+		elif o == '-p': pairs = os.path.abspath(args.pop(0))
+		elif o == '-f': fuse = os.path.abspath(args.pop(0))
+		elif o == '-d':
+			if args[0] not in backends: usage()
+			dispatch.append(args.pop(0))
+		elif not args[0].isdigit(): usage()
+		elif o == '-t':
+			if int(args[0]) not in tmap: usage()
+			types.append(int(args.pop(0)))
+		elif o == '-m': mcycles = int(args.pop(0))
+		else: runs = int(args.pop(0))
+	if not runs: usage()
+	types = types or sorted(tmap.keys())
+	if pairs and len(types) != 1: usage()
+	dispatch = dispatch or list(backends)
+	cflags = (args or ['-O2']) + (['-DBENCH_BUS'] if bus else [])
+	# per column its name, the backend and the flags it's built with
+	columns = [(b, b, cflags) for b in dispatch]
+	if lanes: columns.append(('lanes', 'goto', cflags + ['-DCPU_LANES']))
+	src = os.path.dirname(os.path.abspath(__file__))
+	os.chdir(src)
+	gfn = os.path.join(src, 'bench.golden')
+	golden = load_golden(gfn)
+	fails = 0
+	tmp = tempfile.mkdtemp()
+	try:
+		for cpu in types:
+			# reference counts from the interpreter without any options
+			exe = build(src, tmp, cpu, 'goto', ['-O2', '-DCPU_PROFILE'], 'ref')
+			if not exe: sys.exit(1)
+			ref = run(exe, 0, pairs)
+			for e in check(exe, check_cflags):
+				sys.stderr.write('%s %s: %s\n'%(tmap[cpu], ' '.join(check_cflags[1:]), e))
+				fails += 1
+			if gen:
+				for k in list(golden.keys()):
+					if k[0] == cpu: del golden[k]
+				for w, r in ref.items(): golden[(cpu, w)] = (r[3], r[5], r[4], r[1])
+			res = {}
+			for b, backend, cf in columns:
+				res[b] = {}
+				# the workload each build is for, None for all of them
+				for a in (ref if aot else (None,)):
+					exe = build(src, tmp, cpu, backend, cf, '%s_%s'%(b, a) if a else b, fuse, a)
+					if not exe: continue
+					if not a:
+						for e in check(exe, cf):
+							sys.stderr.write('%s %s: %s\n'%(tmap[cpu], b, e))
+							fails += 1
+					for i in range(runs):
+						for w, r in run(exe, mcycles).items():
+							if a and w != a: continue
+							if not w in res[b] or r[1] * res[b][w][2] > res[b][w][1] * r[2]: res[b][w] = r
+			if not js:
+				sys.stdout.write('%s, %s, MHz per backend\n'%(tmap[cpu], ' '.join(cflags)))
+				sys.stdout.write('%-10s %10s %10s %6s'%('workload', 'cycles', 'insns', 'cpi'))
+				sys.stdout.write(''.join('%10s'%c[0] for c in columns) + '\n')
+			for w in ref:
+				g = golden.get((cpu, w))
+				rs = ref[w]
+				cpi = float(rs[5]) / rs[4] if rs[4] else 0
+				if not js: sys.stdout.write('%-10s %10d %10d %6.2f'%(w, rs[5], rs[4], cpi))
+				for b, backend, cf in columns:
+					r = res[b].get(w)
+					if not r: ok = 'build failed'
+					elif not g: ok = 'no golden'
+					elif (rs[3], rs[5], rs[4], rs[1]) != g or r[3] != g[0] or r[1] != r[0] * g[3]: ok = 'FAIL'
+					else: ok = 'ok'
+					if ok in ('FAIL', 'build failed'): fails += 1
+					mhz = r[1] / r[2] / 1e6 if r and r[2] else 0
+					if js:
+						sys.stdout.write(json.dumps({ 'type': tmap[cpu], 'backend': b,
+							'cflags': ' '.join(cf), 'workload': w,
+							'cycles': rs[5], 'instructions': rs[4], 'cpi': round(cpi, 3),
+							'mhz': round(mhz, 2), 'mips': round(mhz / cpi if cpi else 0, 2),
+							'checksum': r[3] if r else None, 'status': ok }) + '\n')
+					else: sys.stdout.write('%9.1f%s'%(mhz, { 'ok': ' ', 'no golden': '?' }.get(ok, '!')))
+				if not js: sys.stdout.write('\n')
+	finally:
+		shutil.rmtree(tmp)
+	if not js and fails: sys.stdout.write('! differs from bench.golden or did not build, or a check failed\n')
+	if gen: write_golden(gfn, golden)
+	sys.exit(1 if fails and not gen else 0)
@@ -0,0 +1,646 @@
+/* checks of behaviour the workloads of bench.c don't get to, built and
+   run by bench.py next to each build of bench.c, with the same options.
+   every check runs one cpu on flat 64K memory, what's off is printed and
+   the exit status is 1. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* 16 spare bytes for fetches running past 0xffff */
+static uint8_t mem[65536 + 16];
+
+#ifndef CPU_MEMMAP
+#define CPU_READ_N(DEST, ADDR, N) memcpy(DEST, mem + (ADDR), N)
+#define CPU_WRITE_N(SRC, ADDR, N) memcpy(mem + (ADDR), SRC, N)
+#endif
+
+#include "cpu65.c"
+
+#ifdef CPU65_ALL_TYPES
+#error check.c is for a single type, run gen.py with the type to check
+#endif
+#ifdef CPU_NO_COUNT_CYCLES
+#error check.c needs cpu65_exec() to return after the cycles it asks for
+#endif
+
+static struct cpu65 cpu;
+
+/* clears mem and sets it up as the memory of cpu */
+static void setup(void) {
+	memset(mem, 0, sizeof mem);
+	cpu65_init(&cpu, mem + ZP_BASE);
+#ifdef CPU_MEMMAP
+# if HAS_HUC
+	unsigned b;
+	for(b = 0; b < 8; ++b)
+		cpu65_map_bank(&cpu, b, mem + b * 0x2000, CPU65_MAP_READ | CPU65_MAP_WRITE);
+# else
+	cpu65_map(&cpu, 0, 0x10000, mem, CPU65_MAP_READ | CPU65_MAP_WRITE);
+# endif
+#endif
+}
+
+/* points all vectors to a jmp to itself at 0x0300, on HuC6280 all slots
+   show bank 0 after reset */
+static void vectors(void) {
+	unsigned a;
+	mem[0x300] = 0x4c; mem[0x301] = 0x00; mem[0x302] = 0x03;
+	for(a = 0xfff0; a < 0x10000; a += 2) {
+		mem[a] = mem[a - 0xe000] = 0x00;
+		mem[a + 1] = mem[a + 1 - 0xe000] = 0x03;
+	}
+}
+
+/* what the checks compare: registers, flags, cycles and memory */
+struct state {
+	u8 r[7];
+	uint64_t cycles;
+	u8 mem[sizeof mem];
+};
+
+static void get_state(struct state *st) {
+	u8 r[7] = { cpu.a, cpu.x, cpu.y, cpu.s, pack_flags(&cpu), cpu.pcl, cpu.pch };
+	memcpy(st->r, r, sizeof r);
+	st->cycles = cpu.cycles;
+	memcpy(st->mem, mem, sizeof mem);
+}
+
+static int same_state(const struct state *st) {
+	static struct state now;
+	get_state(&now);
+	return !memcmp(now.r, st->r, sizeof st->r) && now.cycles == st->cycles &&
+		!memcmp(now.mem, st->mem, sizeof mem);
+}
+
+static uint64_t fired;
+static void fire(struct cpu65 *cpu, void *ctx) {
+	(void) ctx;
+	fired = cpu->cycles;
+}
+
+/* an event falling due while an interrupt is entered needs to fire
+   before the handler runs, not at the end of the slice */
+static int check_int_event(void) {
+	uint64_t base;
+	setup();
+	vectors();
+	mem[0x200] = 0x4c; mem[0x201] = 0x00; mem[0x202] = 0x02;
+	cpu65_reset(&cpu, 0x200);
+	base = cpu.cycles;
+	fired = 0;
+	if(cpu65_schedule(&cpu, base + 3, fire, 0)) return -1;
+	cpu65_irq(&cpu, CPU65_IRQ2, 1);
+	cpu65_exec(&cpu, 100000);
+	return fired != base + INT_CYCLES;
+}
+
+/* an irq held while CLI or PLP clears I is taken after the instruction
+   following them. runs cli; inx; inx or plp; inx; inx with I set before,
+   the irq pushes the pc after the first inx. */
+static int check_cli(u8 opc) {
+	static uint8_t code[] = { 0, 0xe8, 0xe8, 0x4c, 0x03, 0x02 };
+	setup();
+	vectors();
+	code[0] = opc;
+	memcpy(mem + 0x200, code, sizeof code);
+	cpu65_reset(&cpu, 0x200);
+	cpu.f_i = 1;
+	cpu.stack[0] = 0;
+	cpu65_irq(&cpu, CPU65_IRQ2, 1);
+	cpu65_exec(&cpu, 1000);
+	return cpu.pc != 0x300 || cpu.x != 1 || cpu.stack[(u8)(cpu.s + 2)] != 0x02 ||
+		cpu.stack[(u8)(cpu.s + 3)] != 0x02;
+}
+
+#if CPU_TYPE == CPU_TYPE_65C02
+/* an irq ends WAI with I set too, it goes on with the next instruction
+   without taking the vector. runs sei; wai; lda #$42 */
+static int check_wai(void) {
+	static const uint8_t code[] = { 0x78, 0xcb, 0xa9, 0x42, 0x4c, 0x04, 0x02 };
+	setup();
+	vectors();
+	memcpy(mem + 0x200, code, sizeof code);
+	cpu65_reset(&cpu, 0x200);
+	cpu65_exec(&cpu, 100);
+	if(cpu.cs != cs_waiting || cpu.pc != 0x202) return 1;
+	cpu65_irq(&cpu, CPU65_IRQ2, 1);
+	cpu65_exec(&cpu, 100);
+	return cpu.cs != cs_normal || cpu.pc != 0x204 || cpu.a != 0x42;
+}
+#endif
+
+#if CPU_TYPE <= CPU_TYPE_6502 || CPU_TYPE == CPU_TYPE_65C02
+/* a cpu halted by KIL or STP ignores NMI and IRQ, only a reset gets it
+   going again. runs cli; kil or cli; stp */
+static int check_halt(void) {
+	static const uint8_t code[] = { 0x58, CPU_TYPE <= CPU_TYPE_6502 ? 0x02 : 0xdb };
+	enum cpu_status cs;
+	setup();
+	vectors();
+	memcpy(mem + 0x200, code, sizeof code);
+	cpu65_reset(&cpu, 0x200);
+	cpu65_exec(&cpu, 100);
+	cs = cpu.cs;
+	if((cs != cs_jammed && cs != cs_stopped) || cpu.pc != 0x202 || cpu.s != 0xff) return 1;
+	cpu65_nmi(&cpu);
+	cpu65_exec(&cpu, 100);
+	cpu65_irq(&cpu, CPU65_IRQ2, 1);
+	cpu65_exec(&cpu, 100);
+	if(cpu.cs != cs || cpu.pc != 0x202 || cpu.s != 0xff) return 1;
+	cpu65_reset_line(&cpu);
+	cpu65_exec(&cpu, 100);
+	return cpu.cs != cs_normal || cpu.pc != 0x300;
+}
+#endif
+
+#if defined(CPU_MEMMAP) && !HAS_HUC
+/* code cached for a page needs to go once another page is mapped there.
+   both run lda #n; sta $10 in a loop, long enough to get cached and
+   compiled. */
+static int check_remap(void) {
+	static uint8_t alt[256];
+	static const uint8_t loop[] = { 0xa9, 0x01, 0x85, 0x10, 0x4c, 0x00, 0x02 };
+	int r;
+	setup();
+	memcpy(mem + 0x200, loop, sizeof loop);
+	memcpy(alt, loop, sizeof loop);
+	alt[1] = 2;
+#ifdef CPU_DECODE_CACHE
+	if(cpu65_dcache_init(&cpu)) return -1;
+#endif
+#ifdef CPU_JIT
+	if(cpu65_jit_init(&cpu)) return -1;
+#endif
+	cpu65_reset(&cpu, 0x200);
+	cpu65_exec(&cpu, 10000);
+	cpu65_map(&cpu, 0x200, 256, alt, CPU65_MAP_READ);
+	cpu65_exec(&cpu, 10000);
+	r = mem[0x10] != 2;
+#ifdef CPU_JIT
+	cpu65_jit_free(&cpu);
+#endif
+#ifdef CPU_DECODE_CACHE
+	cpu65_dcache_free(&cpu);
+#endif
+	return r;
+}
+#endif
+
+#if defined(CPU_MEMMAP) && !HAS_HUC
+static u8 io_page[256];
+static void io_log(struct cpu65 *c, const u8 *src, u16 addr, unsigned n) {
+	(void) c;
+	memcpy(io_page + (addr & 0xff), src, n);
+}
+
+/* a loop patching the operand of the instruction after the store, long
+   enough to get cached and compiled, which needs to run patched every
+   time. the values go to page 3, which with io is i/o.
+   inx; stx $0205; ldy #0; tya; sta $0300, x; bne $0200 */
+static int check_patch(int io) {
+	static const uint8_t loop[] = { 0xe8, 0x8e, 0x05, 0x02, 0xa0, 0x00, 0x98,
+		0x9d, 0x00, 0x03, 0xd0, 0xf4, 0x4c, 0x0c, 0x02 };
+	u8 *page = io ? io_page : mem + 0x300;
+	unsigned i;
+	int r = 0;
+	setup();
+	memcpy(mem + 0x200, loop, sizeof loop);
+	memset(io_page, 0xff, sizeof io_page);
+	if(io) {
+		cpu65_map(&cpu, 0x300, 256, 0, CPU65_MAP_WRITE);
+		cpu.io_write = io_log;
+	}
+#ifdef CPU_DECODE_CACHE
+	if(cpu65_dcache_init(&cpu)) return -1;
+#endif
+#ifdef CPU_JIT
+	if(cpu65_jit_init(&cpu)) return -1;
+#endif
+	cpu65_reset(&cpu, 0x200);
+	cpu65_exec(&cpu, 10000);
+	for(i = 0; i < 256; ++i) r |= page[i] != i;
+	r |= cpu.pc != 0x20c;
+#ifdef CPU_JIT
+	cpu65_jit_free(&cpu);
+#endif
+#ifdef CPU_DECODE_CACHE
+	cpu65_dcache_free(&cpu);
+#endif
+	return r;
+}
+#endif
+
+#if defined(CPU_MEMMAP) && HAS_HUC
+/* ST0-2 go to bank $ff whatever MPR0 holds. runs st0 #$12; st1 #$34;
+   st2 #$56 with bank 0 in slot 0 */
+static int check_vdc(void) {
+	static uint8_t vdc[0x2000];
+	static const uint8_t code[] = { 0x03, 0x12, 0x13, 0x34, 0x23, 0x56, 0x4c, 0x06, 0x02 };
+	setup();
+	memset(vdc, 0, sizeof vdc);
+	cpu65_map_bank(&cpu, 0xff, vdc, CPU65_MAP_READ | CPU65_MAP_WRITE);
+	memcpy(mem + 0x200, code, sizeof code);
+	cpu65_reset(&cpu, 0x200);
+	cpu65_exec(&cpu, 100);
+	return vdc[0] != 0x12 || vdc[2] != 0x34 || vdc[3] != 0x56 ||
+		mem[0] || mem[2] || mem[3];
+}
+#endif
+
+#ifdef CPU_REPLAY
+/* a device at 0xd000: reads give a new value each time, reading 0xd002
+   acknowledges its irq */
+static unsigned dev_n;
+static void dev_read(struct cpu65 *cpu, u8 *dest, u16 addr, unsigned n) {
+	while(n--) *dest++ = dev_n++ * 37 + addr;
+	if(addr == 0xd002) cpu65_irq(cpu, CPU65_IRQ2, 0);
+}
+
+static void dev_irq(struct cpu65 *cpu, void *ctx) {
+	(void) ctx;
+	cpu65_irq(cpu, CPU65_IRQ2, 1);
+}
+
+/* the main loop stores what it reads from the device to 0x0400,x and
+   back to the device, the irq handler counts at 0x20. on HuC6280 the
+   device is mapped in with lda #$ff; tam #$40 first. */
+static void replay_setup(void) {
+	static const uint8_t code[] = {
+		0xa9, 0xff, 0x53, 0x40,
+		0x58, 0xa2, 0x00, 0xad, 0x00, 0xd0, 0x9d, 0x00, 0x04,
+		0x8d, 0x01, 0xd0, 0xe8, 0x4c, 0x07, 0x02 };
+	static const uint8_t handler[] = { 0xad, 0x02, 0xd0, 0xe6, 0x20, 0x40 };
+	unsigned skip = IS_HUC ? 0 : 4;
+	setup();
+	vectors();
+	memcpy(mem + 0x200, code + skip, sizeof code - skip);
+	mem[0x200 + sizeof code - skip - 2] -= skip;
+	memcpy(mem + 0x300, handler, sizeof handler);
+	if(!IS_HUC) cpu65_map(&cpu, 0xd000, 256, 0, CPU65_MAP_READ | CPU65_MAP_WRITE);
+	cpu65_reset(&cpu, 0x200);
+}
+
+/* a recording replays to the same state, and a changed read in it is
+   noticed */
+static int check_replay(void) {
+	static struct state st;
+	FILE *f = tmpfile();
+	uint64_t end;
+	long o;
+	int c, r = 1;
+	if(!f) return -1;
+	replay_setup();
+	cpu.io_read = dev_read;
+	if(cpu65_schedule(&cpu, cpu.cycles + 500, dev_irq, 0) ||
+	   cpu65_schedule(&cpu, cpu.cycles + 1500, dev_irq, 0) ||
+	   cpu65_replay_start(&cpu, f, 0)) goto out;
+	cpu65_exec(&cpu, 3000);
+	if(cpu65_replay_stop(&cpu) || mem[0x20] != 2) goto out;
+	get_state(&st);
+	end = cpu.cycles;
+
+	replay_setup();
+	rewind(f);
+	if(cpu65_replay_start(&cpu, f, 1)) goto out;
+	while(cpu.cycles < end) cpu65_exec(&cpu, end - cpu.cycles);
+	if(cpu65_replay_stop(&cpu) || !same_state(&st)) goto out;
+
+	/* the data of the first read: after the header, its tag, the
+	   cycles, the address and the length, unless left out */
+	fseek(f, 14, SEEK_SET);
+	c = getc(f);
+	while(getc(f) & 0x80);
+	o = ftell(f) + (c & RP_SAME ? 0 : 2) + (c & RP_ONE ? 0 : 1);
+	fseek(f, o, SEEK_SET);
+	c = getc(f);
+	fseek(f, o, SEEK_SET);
+	putc(c ^ 1, f);
+	replay_setup();
+	rewind(f);
+	if(cpu65_replay_start(&cpu, f, 1)) goto out;
+	while(cpu.cycles < end) cpu65_exec(&cpu, end - cpu.cycles);
+	r = cpu.replay->diverged == (uint64_t) -1;
+	if(!cpu65_replay_stop(&cpu)) r = 1;
+out:
+	if(cpu.replay) cpu65_replay_stop(&cpu);
+	fclose(f);
+	return r;
+}
+#endif
+
+#if defined(CPU_SNAPSHOT) && defined(CPU_MEMMAP)
+/* a loop storing what it computes to zeropage, 0x0500,x and 0x0600,x,
+   which goes through all flags. an event is pending far ahead. */
+static void snap_setup(void) {
+	static const uint8_t code[] = {
+		0xe8, 0x8a, 0x65, 0x40, 0x9d, 0x00, 0x05, 0x49, 0x5a, 0x85, 0x40,
+		0x08, 0x68, 0x9d, 0x00, 0x06, 0x4c, 0x00, 0x02 };
+	setup();
+	vectors();
+	memcpy(mem + 0x200, code, sizeof code);
+	cpu65_reset(&cpu, 0x200);
+	cpu65_schedule(&cpu, 1000000, fire, 0);
+	cpu65_exec(&cpu, 1000);
+}
+
+/* cpu65_load() goes back to what cpu65_save() saved, at a few points
+   of the loop, so the flags are seen both ways */
+static int check_snapshot(void) {
+	static struct state st;
+	size_t n;
+	u8 *buf;
+	unsigned i;
+	int r = 0;
+	snap_setup();
+	n = cpu65_save(&cpu, 0, 0);
+	if(!(buf = malloc(n))) return -1;
+	for(i = 0; i < 16 && !r; ++i) {
+		r = cpu65_save(&cpu, buf, n) != n;
+		get_state(&st);
+		cpu65_exec(&cpu, 2000);
+		r |= cpu65_load(&cpu, buf, n) || !same_state(&st) || cpu.cs != cs_normal ||
+			cpu.nevents != 1 || cpu.events[0].when != 1000000 || cpu.events[0].fn != fire;
+		cpu65_exec(&cpu, 7 + i);
+	}
+	free(buf);
+	return r;
+}
+
+/* cpu65_rollback() goes back to the latest checkpoint, copying the pages
+   written since, and to an older one, copying all of them */
+static int check_rollback(void) {
+	static struct cpu65_checkpoint cp[2];
+	static struct state st[2];
+	snap_setup();
+	cpu65_checkpoint(&cpu, &cp[0]);
+	get_state(&st[0]);
+	cpu65_exec(&cpu, 2000);
+	cpu65_checkpoint(&cpu, &cp[1]);
+	get_state(&st[1]);
+	cpu65_exec(&cpu, 2000);
+	cpu65_rollback(&cpu, &cp[1]);
+	if(!same_state(&st[1])) return 1;
+	cpu65_exec(&cpu, 2000);
+	cpu65_rollback(&cpu, &cp[0]);
+	return !same_state(&st[0]);
+}
+#endif
+
+#ifdef CPU_BREAK
+/* runs cpu65_exec() once, expects it to stop at pc for kind at addr */
+static int bp_expect(u16 pc, unsigned kind, unsigned addr) {
+	u16 a;
+	cpu65_exec(&cpu, 100);
+	return cpu.cs != cs_break || cpu.pc != pc || cpu65_bp_hit(&cpu, &a) != kind || a != addr;
+}
+
+/* an execute breakpoint, and watchpoints on an absolute read, a zeropage
+   store and a push, the latter two going to cpu->zp directly. runs
+   lda $1234; sta $30; pha; nop; and a jmp to itself */
+static int check_break(void) {
+	static const uint8_t code[] = {
+		0xad, 0x34, 0x12, 0x85, 0x30, 0x48, 0xea, 0x4c, 0x07, 0x02 };
+	int r;
+	setup();
+	vectors();
+	memcpy(mem + 0x200, code, sizeof code);
+	cpu65_reset(&cpu, 0x200);
+	if(cpu65_bp_init(&cpu)) return -1;
+	cpu65_bp_set(&cpu, 0x206, 1, CPU65_BP_EXEC, 1);
+	cpu65_bp_set(&cpu, 0x1234, 1, CPU65_BP_READ, 1);
+	cpu65_bp_set(&cpu, ZP_BASE + 0x30, 1, CPU65_BP_WRITE, 1);
+	cpu65_bp_set(&cpu, ZP_BASE + 0x1ff, 1, CPU65_BP_WRITE, 1);
+	r = bp_expect(0x203, CPU65_BP_READ, 0x1234) ||
+		bp_expect(0x205, CPU65_BP_WRITE, ZP_BASE + 0x30) ||
+		bp_expect(0x206, CPU65_BP_WRITE, ZP_BASE + 0x1ff) ||
+		bp_expect(0x206, CPU65_BP_EXEC, 0x206);
+	/* and then it runs on */
+	cpu65_exec(&cpu, 100);
+	r |= cpu.cs != cs_normal || cpu.pc != 0x207;
+	cpu65_bp_free(&cpu);
+	return r;
+}
+#endif
+
+#ifdef CPU_TRACE
+/* whether the n records in t are the numbers from k on of inx; jmp $0200,
+   x having started out as x0 */
+static int trace_recs(const struct cpu65_trace_rec *t, size_t n, uint64_t k, u8 x0) {
+	size_t i;
+	for(i = 0; i < n; ++i, ++k)
+		if(t[i].pc != (k & 1 ? 0x201 : 0x200) || t[i].ob[0] != (k & 1 ? 0x4c : 0xe8) ||
+		   t[i].x != (u8)(x0 + (k + 1) / 2) || (i && t[i].cycle <= t[i - 1].cycle))
+			return 1;
+	return 0;
+}
+
+/* overflows a ring of 8 records, then reads it back from the start, in
+   parts, and from past its end */
+static int check_trace(void) {
+	static const uint8_t code[] = { 0xe8, 0x4c, 0x00, 0x02 };
+	struct cpu65_trace_rec t[16];
+	uint64_t h, pos;
+	u8 x0;
+	int r;
+	setup();
+	vectors();
+	memcpy(mem + 0x200, code, sizeof code);
+	cpu65_reset(&cpu, 0x200);
+	x0 = cpu.x;
+	if(cpu65_trace_init(&cpu, 8)) return -1;
+	cpu65_exec(&cpu, 100);
+	h = cpu.trace->head;
+	if(h < 20) return 1;
+	/* the slot of the oldest record is the one written next, so 7 remain */
+	pos = 0;
+	r = cpu65_trace_read(&cpu, &pos, t, 16) != 7 || pos != h || trace_recs(t, 7, h - 7, x0);
+	pos = 0;
+	r |= cpu65_trace_read(&cpu, &pos, t, 2) != 2 || pos != h - 5 || trace_recs(t, 2, h - 7, x0);
+	r |= cpu65_trace_read(&cpu, &pos, t, 16) != 5 || pos != h || trace_recs(t, 5, h - 5, x0);
+	r |= cpu65_trace_read(&cpu, &pos, t, 16) != 0 || pos != h;
+	pos = h + 100;
+	r |= cpu65_trace_read(&cpu, &pos, t, 16) != 0 || pos != h;
+	/* and on from there */
+	cpu65_exec(&cpu, 10);
+	r |= cpu65_trace_read(&cpu, &pos, t, 16) != cpu.trace->head - h ||
+		trace_recs(t, cpu.trace->head - h, h, x0);
+	cpu65_trace_free(&cpu);
+	return r;
+}
+#endif
+
+#ifdef CPU_COVERAGE
+/* fills the map with runs and literals of lengths around those where
+   the encoding changes, up to a run across 64K */
+static void cov_fill(u8 *map, unsigned size) {
+	static const unsigned lens[] = {
+		1, 2, 3, 4, 127, 128, 129, 130, 255, 256, 16383, 16384, 16385, 70000 };
+	unsigned i, j, n, seed = 1;
+	for(i = 0; i < size; i += n) {
+		seed = seed * 1103515245 + 12345;
+		n = lens[(seed >> 16) % 14];
+		if(n > size - i) n = size - i;
+		if(seed >> 30 & 1) memset(map + i, seed >> 24 & 31, n);
+		else for(j = 0; j < n; ++j) map[i + j] = (i + j) * 7 >> 3 & 31;
+	}
+}
+
+/* saves a map and loads it into none, then over one with bits set
+   already, which merges them. a file cut short doesn't load */
+static int check_cov(void) {
+	u8 *a;
+	FILE *f, *g;
+	long len, i;
+	int r;
+	setup();
+	if(!(a = malloc(COV_SIZE)) || !(f = tmpfile()) || !(g = tmpfile()) ||
+	   cpu65_cov_init(&cpu)) return -1;
+	cov_fill(cpu.cov, COV_SIZE);
+	memcpy(a, cpu.cov, COV_SIZE);
+	r = cpu65_cov_save(&cpu, f);
+	len = ftell(f);
+	cpu65_cov_free(&cpu);
+	rewind(f);
+	r |= cpu65_cov_load(&cpu, f) || memcmp(cpu.cov, a, COV_SIZE) ||
+		ftell(f) != len || cpu.cov_on;
+	memset(cpu.cov, 0, COV_SIZE);
+	memset(cpu.cov + 0x1000, CPU65_COV_VECTOR, 0x1000);
+	rewind(f);
+	r |= cpu65_cov_load(&cpu, f);
+	for(i = 0; i < COV_SIZE; ++i)
+		if(cpu.cov[i] != (a[i] | (i >> 12 == 1 ? CPU65_COV_VECTOR : 0))) r = 1;
+	rewind(f);
+	for(i = 0; i < len - 1; ++i) putc(getc(f), g);
+	rewind(g);
+	r |= cpu65_cov_load(&cpu, g) != -1;
+	cpu65_cov_free(&cpu);
+	fclose(f);
+	fclose(g);
+	free(a);
+	return r;
+}
+#endif
+
+#if defined(CPU_REWIND) && defined(CPU_MEMMAP)
+#define RW_PUSHES 16
+/* pushes RW_PUSHES frames over the loop of snap_setup(), into a ring of
+   size bytes, then goes back by back frames, then to the oldest one
+   left. either needs to give the state pushed then. */
+static int check_rewind_ring(size_t size, unsigned back) {
+	static struct state st[RW_PUSHES + 1];
+	unsigned i, n;
+	int r = 1;
+	snap_setup();
+	if(cpu65_rewind_init(&cpu, size)) return -1;
+	get_state(&st[0]);
+	for(i = 1; i <= RW_PUSHES; ++i) {
+		cpu65_exec(&cpu, 300);
+		cpu65_rewind_push(&cpu);
+		get_state(&st[i]);
+	}
+	n = cpu65_rewind_frames(&cpu);
+	/* frames are dropped from a small ring, all are left in a big one */
+	if(size < 4096 ? n >= RW_PUSHES || n <= back : n != RW_PUSHES) goto out;
+	cpu65_exec(&cpu, 300);
+	if(cpu65_rewind(&cpu, back) || !same_state(&st[RW_PUSHES - back]) ||
+	   cpu65_rewind_frames(&cpu) != n - back) goto out;
+	/* 0 undoes what ran since the latest frame */
+	cpu65_exec(&cpu, 300);
+	if(cpu65_rewind(&cpu, 0) || !same_state(&st[RW_PUSHES - back])) goto out;
+	n -= back;
+	if(cpu65_rewind(&cpu, n) || !same_state(&st[RW_PUSHES - back - n])) goto out;
+	r = !cpu65_rewind(&cpu, 1);
+out:
+	cpu65_rewind_free(&cpu);
+	return r;
+}
+
+/* the same with a ring that holds all frames, and with one that holds
+   only a few, so older ones are dropped and the frames wrap around */
+static int check_rewind(void) {
+	return check_rewind_ring(1 << 16, 3) || check_rewind_ring(1500, 2);
+}
+#endif
+
+int main(void) {
+	int r = 0;
+	if(check_int_event()) {
+		printf("an event due during interrupt entry fired late\n");
+		r = 1;
+	}
+	if(check_cli(0x58) || check_cli(0x28)) {
+		printf("an irq was taken right after CLI or PLP\n");
+		r = 1;
+	}
+#if CPU_TYPE == CPU_TYPE_65C02
+	if(check_wai()) {
+		printf("an irq with I set didn't end WAI\n");
+		r = 1;
+	}
+#endif
+#if CPU_TYPE <= CPU_TYPE_6502 || CPU_TYPE == CPU_TYPE_65C02
+	if(check_halt()) {
+		printf("a halted cpu took an interrupt\n");
+		r = 1;
+	}
+#endif
+#if defined(CPU_MEMMAP) && !HAS_HUC
+	if(check_remap()) {
+		printf("code cached for a remapped page still ran\n");
+		r = 1;
+	}
+	if(check_patch(0) || check_patch(1)) {
+		printf("code patched by the instruction before it ran unpatched, or a store to i/o went astray\n");
+		r = 1;
+	}
+#endif
+#if defined(CPU_MEMMAP) && HAS_HUC
+	if(check_vdc()) {
+		printf("ST0-2 didn't go to bank $ff\n");
+		r = 1;
+	}
+#endif
+#if defined(CPU_SNAPSHOT) && defined(CPU_MEMMAP)
+	if(check_snapshot()) {
+		printf("a snapshot didn't load to the state it was saved from\n");
+		r = 1;
+	}
+	if(check_rollback()) {
+		printf("a rollback didn't restore the checkpoint\n");
+		r = 1;
+	}
+#endif
+#ifdef CPU_BREAK
+	if(check_break()) {
+		printf("a break- or watchpoint didn't stop where it's set\n");
+		r = 1;
+	}
+#endif
+#ifdef CPU_TRACE
+	if(check_trace()) {
+		printf("the trace ring didn't read back the records it should\n");
+		r = 1;
+	}
+#endif
+#ifdef CPU_COVERAGE
+	if(check_cov()) {
+		printf("a coverage map didn't load back as it was saved\n");
+		r = 1;
+	}
+#endif
+#if defined(CPU_REWIND) && defined(CPU_MEMMAP)
+	if(check_rewind()) {
+		printf("rewinding didn't give the state of the frame\n");
+		r = 1;
+	}
+#endif
+#ifdef CPU_REPLAY
+	if(check_replay()) {
+		printf("a recording didn't replay to the same state, or a changed read went unnoticed\n");
+		r = 1;
+	}
+#endif
+	return r;
+}
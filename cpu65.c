@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 
 #ifdef CPU_COMMENT_OPS
 #define OPSTART(HEX, NAME) __asm__ volatile ("# OPSTART: " # HEX " " # NAME)
@@ -20,23 +21,41 @@
 
 #include "cpu65type.h"
 
-#ifndef CPU_TYPE
+#ifdef CPU65_ALL_TYPES
+/* written by "gen.py all": there's one interpreter core per cpu type, each
+   built with CPU_TYPE as a constant, see exec.c. everywhere else CPU_TYPE
+   is the type of the cpu at hand, so everything depending on it needs to
+   use C conditionals rather than #if. */
+#define CPU_TYPE (cpu->type)
+#define HAS_HUC 1
+#elif !defined(CPU_TYPE)
 #error need to set CPU_TYPE to one of the above list
+#else
+#define HAS_HUC (CPU_TYPE == CPU_TYPE_HUC6280)
 #endif
 
-#if CPU_TYPE == CPU_TYPE_2A03
-#define CPU_NO_BCD
-#endif
-
-/* define this if you don't want BCD, e.g. to emulate a Ricoh 2A03 as used in NES */
+/* define this if you don't want BCD. the Ricoh 2A03 as used in NES never has it */
 #ifndef CPU_NO_BCD
-#define BCD 1
+#define BCD (CPU_TYPE != CPU_TYPE_2A03)
 #else
 #define BCD 0
 #endif
 
-#ifndef CPU_READ_N
-#error you need to provide macros CPU_READ_N(dest, addr, n) and CPU_WRITE_N(source, addr, b)
+#if defined(CPU_REWIND) && !defined(CPU_SNAPSHOT)
+#define CPU_SNAPSHOT
+#endif
+
+/* replay needs the cycle of each access */
+#if defined(CPU_REPLAY) && !defined(CPU_BUS_CYCLES)
+#define CPU_BUS_CYCLES
+#endif
+
+#ifdef CPU_MEMMAP
+# ifdef CPU_READ_N
+# error CPU_MEMMAP provides CPU_READ_N and CPU_WRITE_N, do not define them
+# endif
+#elif !defined(CPU_READ_N)
+#error you need to provide macros CPU_READ_N(dest, addr, n) and CPU_WRITE_N(source, addr, b), or define CPU_MEMMAP
 #endif
 
 #if !defined(__BYTE_ORDER__)
@@ -61,28 +80,21 @@
 #define Z_FLAG 0x02
 #define C_FLAG 0x01
 
-#if CPU_TYPE == CPU_TYPE_HUC6280
+#define IS_HUC (CPU_TYPE == CPU_TYPE_HUC6280)
+/* buffers holding fetched opcodes are sized by this, so with all types
+   it has to be the largest one. */
+#ifdef CPU65_ALL_TYPES
 #define PC_MAX_FETCH 8
-#define T_INIT 0
-#define B_INIT 0
-#define PLP_MASK 0xff
-#define INT_MASK (~(D_FLAG|T_FLAG))
-#define INT_VEC 0xfff6
-#define BR_PENALTY 2
 #else
-#define PC_MAX_FETCH 4
-#define T_INIT 1
-#define B_INIT 1
-#define BR_PENALTY 1
-// vector locations for HW interrupts: FFFE for the IRQ and FFFA for the NMI
-#define INT_VEC 0xfffe
-#define PLP_MASK (N_FLAG|Z_FLAG|C_FLAG|I_FLAG|D_FLAG|V_FLAG)
-# if CPU_TYPE > CPU_TYPE_6502
-# define INT_MASK (~(D_FLAG))
-# else
-# define INT_MASK 0xff
-# endif
+#define PC_MAX_FETCH (IS_HUC ? 8 : 4)
 #endif
+#define T_INIT (IS_HUC ? 0 : 1)
+#define B_INIT (IS_HUC ? 0 : 1)
+#define BR_PENALTY (IS_HUC ? 2 : 1)
+// vector locations for HW interrupts: FFFE for the IRQ and FFFA for the NMI
+#define INT_VEC (IS_HUC ? 0xfff6 : 0xfffe)
+#define PLP_MASK (IS_HUC ? 0xff : (N_FLAG|Z_FLAG|C_FLAG|I_FLAG|D_FLAG|V_FLAG))
+#define INT_MASK (IS_HUC ? ~(D_FLAG|T_FLAG) : CPU_TYPE > CPU_TYPE_6502 ? ~(D_FLAG) : 0xff)
 
 /* abbreviations:
    C8MSM - "HuC6280 - CMOS 8-bit Microprocessor Software Manual.pdf"
@@ -115,16 +127,63 @@ enum address_mode {
 	am_acc    /* accumulator. 3.20 in C8MSM (ACC). 1 byte insn. */
 };
 
+#ifdef CPU_DECODE_CACHE
+/* an entry depends on the bytes from its pc up to this many further.
+   one for a fused pair holds the bytes fetched at pc, then those fetched
+   after the first instruction, which is at most 2 bytes long. */
+#ifdef CPU_FUSED
+#define DC_SPAN (PC_MAX_FETCH + 2)
+#else
+#define DC_SPAN PC_MAX_FETCH
+#endif
+/* predecoded instruction cache, one entry per pc. code marks the bytes
+   some entry was decoded from, so most stores skip the entries. */
+struct cpu65_dcent {
+	void *lab; /* handler label, 0 if the entry is not valid */
+#ifdef CPU_FUSED
+	u8 ob[2 * PC_MAX_FETCH]; /* fetched from pc, then after a fused first one */
+#else
+	u8 ob[8];  /* opcode and operand bytes as fetched from pc */
+#endif
+};
+struct cpu65_dcache {
+	struct cpu65_dcent e[0x10000];
+	u8 code[0x10000];
+};
+#endif
+
+struct cpu65;
+
+/* timed callback, see cpu65_schedule() */
+struct cpu65_event {
+	uint64_t when;
+	void (*fn) (struct cpu65*, void *ctx);
+	void *ctx;
+};
+#ifndef CPU65_MAX_EVENTS
+#define CPU65_MAX_EVENTS 32
+#endif
+
+/* irq lines for cpu65_irq(). the HuC6280 has separate vectors for them,
+   on the other chips all lines are wired to the same IRQ input. */
+#define CPU65_IRQ2 1
+#define CPU65_IRQ1 2
+#define CPU65_TIRQ 4
+
 enum cpu_status {
 	cs_normal,
 	cs_jammed,
 	cs_stopped,
 	cs_waiting,
+	cs_break, /* a break- or watchpoint was hit, see CPU_BREAK */
 };
 
 struct cpu65 {
 	TUP16(pc, pch, pcl);
 	u8 s, a, x, y;
+	/* N and Z are evaluated lazily: f_n holds the last value N was set
+	   from, N is its bit 7. f_z is the last value Z was set from, Z is
+	   set when it is 0. use pack_flags() to get the real flags. */
 	flag f_n; /* sign */
 	flag f_v; /* overflow */
 	flag f_t; /* memory operation - HuC6280 only */
@@ -133,143 +192,1355 @@ struct cpu65 {
 	flag f_i; /* interrupt disable */
 	flag f_z; /* zero */
 	flag f_c; /* carry */
+	u8 mpr[8]; /* HuC6280 memory mapping registers, see cpu65_map_bank() */
+	u8 speed; /* HuC6280: 1 after CSH, 0 after CSL. cycles are counted
+		     in cpu clocks regardless, scaling them is up to the host. */
 	u8 *zp;
 	u8 *stack;
+	/* cs up to user is cpu state again, copied by snapshots */
 	enum cpu_status cs; /* special cpu status, might be signaled by KIL, WAI, STP.
 			       this is not automatically reset, so if you intend to use
-			       it set it to cs_normal before cpu65_exec(). */
+			       it set it to cs_normal before cpu65_exec().
+			       cs_waiting is left by the next interrupt, or an
+			       irq line asserted while I is set, which resumes
+			       at the next instruction. a reset
+			       is needed to leave cs_jammed and cs_stopped.
+			       cs_break is left by the next cpu65_exec(). */
+	uint64_t cycles; /* total cycles run, advanced by cpu65_exec() */
+#ifdef CPU_BUS_CYCLES
+	uint64_t bus_cycle; /* cycle of the current memory access */
+#endif
+	u8 irq; /* irq lines currently asserted, see cpu65_irq() */
+	u8 int_req; /* pending nmi/reset, see cpu65_nmi() */
+	unsigned nevents;
+	struct cpu65_event events[CPU65_MAX_EVENTS]; /* min-heap on when */
 	void *user; /* user data. */
 	void (*trace_print) (struct cpu65*, char*);
+#ifdef CPU65_ALL_TYPES
+	unsigned type; /* CPU_TYPE_*, see cpu65_init_type() */
+	unsigned (*exec) (struct cpu65*, unsigned); /* the core for type */
+#endif
+#ifdef CPU_DECODE_CACHE
+	struct cpu65_dcache *dc; /* see cpu65_dcache_init() */
+#endif
+#ifdef CPU_JIT
+	struct cpu65_jit *jit; /* see cpu65_jit_init() */
+#endif
+#ifdef CPU_AOT
+	struct cpu65_aot *aot; /* see cpu65_aot_init() */
+#endif
+#ifdef CPU_TRACE
+	struct cpu65_trace *trace; /* see cpu65_trace_init() */
+#endif
+#ifdef CPU_PROFILE
+	struct cpu65_prof *prof; /* see cpu65_prof_init() */
+#endif
+#ifdef CPU_BREAK
+	struct cpu65_bp *bp; /* see cpu65_bp_init() */
+	u8 bp_on; /* CPU65_BP_* kinds with any address set in bp */
+#endif
+#ifdef CPU_REPLAY
+	struct cpu65_replay *replay; /* see cpu65_replay_start() */
+#endif
+#ifdef CPU_COVERAGE
+	u8 *cov; /* CPU65_COV_* per address, see cpu65_cov_init() */
+	u8 cov_on; /* recording into cov */
+#endif
+#ifdef CPU_IDLE_SKIP
+	u8 idle_skip; /* set to skip idle loops, see CPU_IDLE_SKIP */
+	uint64_t idle_skipped; /* cycles skipped that way */
+#endif
+#ifdef CPU_MEMMAP
+	u8 *rmap[256]; /* host memory backing each 256 byte page for reads */
+	u8 *wmap[256]; /* same for writes, 0 means the page is i/o */
+	void (*io_read) (struct cpu65*, u8 *dest, u16 addr, unsigned n);
+	void (*io_write) (struct cpu65*, const u8 *src, u16 addr, unsigned n);
+#if HAS_HUC
+	u8 *bank_r[256]; /* host memory of each physical 8K bank, see */
+	u8 *bank_w[256]; /* cpu65_map_bank() */
+#endif
+#endif
+#ifdef CPU_SNAPSHOT
+	u8 dirty[256/8]; /* pages written since the last checkpoint */
+	const struct cpu65_checkpoint *snap_base; /* that checkpoint */
+#endif
+#ifdef CPU_REWIND
+	struct cpu65_rewind *rw; /* see cpu65_rewind_init() */
+	u8 rw_dirty[256/8]; /* pages written since the last rewind frame */
+#endif
+#ifdef CPU_LANES
+	struct cpu65_lanes_hook *lanes; /* of the lanes running it, see lanes.c */
+#endif
+};
+
+static void reset_regs(struct cpu65 *cpu) {
+	memset(cpu, 0, offsetof(struct cpu65, zp));
+	cpu->s = 0xff;
+	cpu->f_z = 1;
+	cpu->f_t = T_INIT;
+	cpu->f_b = B_INIT;
+	cpu->cs = cs_normal;
+}
+
+#ifdef CPU_LANES
+/* what the lanes running an instance need to hear from it while they
+   run, shared by all their instances */
+struct cpu65_lanes_hook {
+	int dirty; /* an instance may have got events or interrupts */
+	u8 same[65536/8]; /* pcs where all lanes hold the same instruction */
 };
 
+/* an instruction starting up to 2 bytes before addr may have fetched it */
+static void lanes_inval(struct cpu65_lanes_hook *h, unsigned addr, unsigned len) {
+	unsigned a, end = (addr + len) & 0xffff;
+	if(len > 0x10000 - 3) {
+		memset(h->same, 0, sizeof h->same);
+		return;
+	}
+	for(a = (addr - 2) & 0xffff; a != end; a = (a + 1) & 0xffff)
+		h->same[a >> 3] &= ~(1 << (a & 7));
+}
+
+#define LANES_INVAL(ADDR) do { if(cpu->lanes) lanes_inval(cpu->lanes, (ADDR), 1); } while(0)
+#define LANES_DIRTY() do { if(cpu->lanes) cpu->lanes->dirty = 1; } while(0)
+#else
+#define LANES_INVAL(ADDR) do{}while(0)
+#define LANES_DIRTY() do{}while(0)
+#endif
+
 /* you need to pass the address of the zeropage in the memory you allocated as
    a parameter.
    this is to have fast access to zeropage and stack. it needs to be a single
    continuous memory region of at least 512 bytes.
-   additionally, also for speed, our code always reads at least 4 (huc: 8)
-   bytes from pc. this means you should (c)allocate 8 bytes more for each
+   additionally, also for speed, our code always reads at least 4 (huc, or
+   any type with CPU65_ALL_TYPES: 8) bytes from pc. this means you should (c)allocate 8 bytes more for each
    memory region which can be executed (rom, ram) and if the READ_N call
    happens to read over the rom/ram area into a memory map region, ignore
    everything but the initial address for region checks.
+   with CPU_MEMMAP, accesses are split at page boundaries instead and no
+   extra space is needed.
 */
+#ifndef CPU65_ALL_TYPES
 void cpu65_init(struct cpu65 *cpu, u8 *zeropage) {
 	memset(cpu, 0, sizeof *cpu);
 	cpu->zp = zeropage;
 	cpu->stack = zeropage + 256;
-	cpu->s = 0xff;
-	cpu->f_t = T_INIT;
-	cpu->f_b = B_INIT;
+	reset_regs(cpu);
 }
+#endif
+
+#if HAS_HUC
+static void mpr_restored(struct cpu65 *cpu, const u8 *old);
+#endif
 
-/* pass the address of the initial pc on reset. */
+/* pass the address of the initial pc on reset.
+   only the registers are reset, user data and attached caches are kept.
+   on HuC6280 that includes the MPRs, which are all 0 afterwards. */
 void cpu65_reset(struct cpu65 *cpu, u16 pc) {
-	cpu65_init(cpu, cpu->zp);
+	u8 mpr[8];
+	memcpy(mpr, cpu->mpr, sizeof mpr);
+	reset_regs(cpu);
+#if HAS_HUC
+	if(IS_HUC) mpr_restored(cpu, mpr);
+#endif
 	cpu->pc = pc;
 }
 
+#define INT_NMI 1
+#define INT_RST 2
+
+/* set (level != 0) or clear the given CPU65_IRQ* lines. the IRQ is taken
+   at an instruction boundary while any line is asserted and I is clear. */
+void cpu65_irq(struct cpu65 *cpu, unsigned lines, int level) {
+	if(level) cpu->irq |= lines;
+	else cpu->irq &= ~lines;
+	LANES_DIRTY();
+}
+
+/* signal a falling edge on NMI */
+void cpu65_nmi(struct cpu65 *cpu) {
+	cpu->int_req |= INT_NMI;
+	LANES_DIRTY();
+}
+
+/* pull RESET, the reset sequence is run at the next instruction boundary
+   and takes pc from the reset vector. unlike cpu65_reset(), the registers
+   are kept as on the real chip. */
+void cpu65_reset_line(struct cpu65 *cpu) {
+	cpu->int_req |= INT_RST;
+	LANES_DIRTY();
+}
+
+/* call fn(cpu, ctx) once cpu->cycles reaches when. cpu65_exec() stops at
+   the instruction boundary where the deadline passes, so events aren't
+   late by more than one instruction, however large mincycles is. this
+   holds for events scheduled from CPU_READ_N and CPU_WRITE_N callbacks
+   too, the instruction doing the access ends the slice if needed.
+   returns 0 on success, -1 if CPU65_MAX_EVENTS are already pending. */
+int cpu65_schedule(struct cpu65 *cpu, uint64_t when, void (*fn) (struct cpu65*, void*), void *ctx) {
+	unsigned i, p;
+	if(cpu->nevents == CPU65_MAX_EVENTS) return -1;
+	LANES_DIRTY();
+	for(i = cpu->nevents++; i; i = p) {
+		p = (i - 1) / 2;
+		if(cpu->events[p].when <= when) break;
+		cpu->events[i] = cpu->events[p];
+	}
+	cpu->events[i].when = when;
+	cpu->events[i].fn = fn;
+	cpu->events[i].ctx = ctx;
+	return 0;
+}
+
+static void event_remove(struct cpu65 *cpu, unsigned i) {
+	struct cpu65_event e = cpu->events[--cpu->nevents];
+	unsigned c, p;
+	if(i == cpu->nevents) return;
+	/* the last element takes the hole, sift it up or down */
+	for(; i; i = p) {
+		p = (i - 1) / 2;
+		if(cpu->events[p].when <= e.when) break;
+		cpu->events[i] = cpu->events[p];
+	}
+	for(; (c = 2 * i + 1) < cpu->nevents; i = c) {
+		if(c + 1 < cpu->nevents && cpu->events[c + 1].when < cpu->events[c].when) ++c;
+		if(e.when <= cpu->events[c].when) break;
+		cpu->events[i] = cpu->events[c];
+	}
+	cpu->events[i] = e;
+}
+
+/* remove all pending events with matching fn and ctx */
+void cpu65_unschedule(struct cpu65 *cpu, void (*fn) (struct cpu65*, void*), void *ctx) {
+	unsigned i = 0;
+	while(i < cpu->nevents)
+		if(cpu->events[i].fn == fn && cpu->events[i].ctx == ctx) event_remove(cpu, i);
+		else ++i;
+}
+
+#ifdef CPU_MEMMAP
+#define CPU65_MAP_READ 1
+#define CPU65_MAP_WRITE 2
+
+/* built-in memory map. instead of providing CPU_READ_N and CPU_WRITE_N,
+   you map host memory for each 256 byte page, separately for reads and
+   writes. accesses to pages without host memory are passed to the
+   io_read/io_write callbacks, which take the same arguments as the
+   CPU_READ_N/CPU_WRITE_N macros. reads of unmapped pages without io_read
+   return 0xff, writes without io_write are ignored. see cpu65_map(). */
+
+/* accesses crossing a page boundary or hitting i/o pages are split into
+   the parts belonging to each page.
+   note that opcode fetches read PC_MAX_FETCH bytes, so code running up to
+   the end of a mapped page can make io_read see reads past the actual
+   instruction. */
+static void mm_read_slow(struct cpu65 *cpu, u8 *dest, unsigned addr, unsigned n) {
+	unsigned c;
+	u8 *p;
+	for(; n; n -= c, dest += c, addr += c) {
+		addr &= 0xffff;
+		c = 256 - (addr & 0xff);
+		if(c > n) c = n;
+		if((p = cpu->rmap[addr >> 8])) memcpy(dest, p + (addr & 0xff), c);
+		else if(cpu->io_read) cpu->io_read(cpu, dest, addr, c);
+		else memset(dest, 0xff, c);
+	}
+}
+
+static void mm_write_slow(struct cpu65 *cpu, const u8 *src, unsigned addr, unsigned n) {
+	unsigned c;
+	u8 *p;
+	for(; n; n -= c, src += c, addr += c) {
+		addr &= 0xffff;
+		c = 256 - (addr & 0xff);
+		if(c > n) c = n;
+		if((p = cpu->wmap[addr >> 8])) memcpy(p + (addr & 0xff), src, c);
+		else if(cpu->io_write) cpu->io_write(cpu, src, addr, c);
+	}
+}
+
+static inline __attribute__((always_inline))
+void mm_read(struct cpu65 *cpu, void *dest, unsigned addr, unsigned n) {
+	u8 *p = cpu->rmap[(addr >> 8) & 0xff];
+	if(p && (addr & 0xff) <= 256 - n) memcpy(dest, p + (addr & 0xff), n);
+	else mm_read_slow(cpu, dest, addr, n);
+}
+
+static inline __attribute__((always_inline))
+void mm_write(struct cpu65 *cpu, const void *src, unsigned addr, unsigned n) {
+	u8 *p = cpu->wmap[(addr >> 8) & 0xff];
+	if(p && (addr & 0xff) <= 256 - n) memcpy(p + (addr & 0xff), src, n);
+	else mm_write_slow(cpu, src, addr, n);
+}
+
+#define CPU_READ_N(DEST, ADDR, N) mm_read(cpu, DEST, ADDR, N)
+#define CPU_WRITE_N(SRC, ADDR, N) mm_write(cpu, SRC, ADDR, N)
+#endif
+
+#ifdef CPU_REPLAY
+#include "replay.c"
+#else
+#define REPLAY_INT(WHAT) do{}while(0)
+#define REPLAY_ON() 0
+#endif
+
+/* the zeropage and stack are accessed directly through cpu->zp, stores
+   there need to know which 16 bit address they alias, e.g. for cache
+   invalidation. on HuC6280 that's the RAM bank usually mapped via MPR1. */
+#define ZP_BASE (IS_HUC ? 0x2000 : 0x0000)
+
+#ifdef CPU_DECODE_CACHE
+/* enable the predecoded instruction cache. decoded instructions are
+   stored per pc together with the handler to run, so the fetch and decode
+   step is skipped the next time the same pc is executed.
+   stores through CPU_WRITE_N and to zeropage/stack invalidate the
+   entries they touch. if memory changes behind the cpu's back, e.g. due
+   to bank switching or DMA, you need to call cpu65_dcache_invalidate().
+   it takes over 1M, of which only the pages code runs from are touched.
+   returns 0 on success, -1 if out of memory. */
+int cpu65_dcache_init(struct cpu65 *cpu) {
+	if(!cpu->dc) cpu->dc = calloc(1, sizeof *cpu->dc);
+	return cpu->dc ? 0 : -1;
+}
+
+void cpu65_dcache_free(struct cpu65 *cpu) {
+	free(cpu->dc);
+	cpu->dc = 0;
+}
+
+/* an instruction starting up to DC_SPAN-1 bytes before addr may have
+   fetched it, so these entries are dropped as well. */
+static void dcache_inval(struct cpu65_dcache *dc, unsigned addr, unsigned len) {
+	unsigned a, end = (addr + len) & 0xffff;
+	for(a = (addr - (DC_SPAN-1)) & 0xffff; a != end; a = (a + 1) & 0xffff)
+		dc->e[a].lab = 0;
+}
+
+/* a single byte stored, there's nothing to drop unless it was decoded */
+static inline void dcache_written(struct cpu65_dcache *dc, unsigned addr) {
+	if(!dc->code[addr]) return;
+	dc->code[addr] = 0;
+	dcache_inval(dc, addr, 1);
+}
+
+void cpu65_dcache_invalidate(struct cpu65 *cpu, u16 addr, unsigned len) {
+	unsigned p;
+	struct cpu65_dcache *dc = cpu->dc;
+	if(!dc || !len) return;
+	if(len <= 0x10000 - DC_SPAN) {
+		dcache_inval(dc, addr, len);
+		return;
+	}
+	/* all of it, only the pages code ran from have entries */
+	for(p = 0; p < 0x10000; p += 256) if(memchr(&dc->code[p], 1, 256)) {
+		memset(&dc->e[p], 0, 256 * sizeof *dc->e);
+		memset(&dc->code[p], 0, 256);
+	}
+}
+
+/* stores a freshly decoded instruction, n bytes of ob. instructions
+   whose fetch would wrap around the address space are never cached.
+   returns whether it was stored. */
+static int dcache_fill(struct cpu65_dcache *dc, unsigned pc, void *lab, const u8 *ob, unsigned n) {
+	if(pc > 0x10000 - DC_SPAN) return 0;
+	memset(&dc->code[pc], 1, DC_SPAN);
+	memcpy(dc->e[pc].ob, ob, n);
+	dc->e[pc].lab = lab;
+	return 1;
+}
+
+#define DC_INVAL(ADDR) do { if(cpu->dc) dcache_written(cpu->dc, (ADDR)); } while(0)
+#else
+#define DC_INVAL(ADDR) do{}while(0)
+#endif
+
+#ifdef CPU65_ALL_TYPES
+#ifdef CPU_JIT
+#error CPU_JIT only supports a single cpu type
+#endif
+#ifdef CPU_LANES
+#error CPU_LANES only supports a single cpu type
+#endif
+#endif
+
+#if defined(CPU_JIT) || defined(CPU_LANES)
+/* cycles charged by the handler of each opcode, without penalties */
+static const u8 opcycles[256] = {
+#include "opcycles.h"
+};
+#endif
+
+#ifdef CPU_JIT
+#include "jit_x86_64.c"
+#else
+#define JIT_INVAL(ADDR) do{}while(0)
+#endif
+
+#ifdef CPU_AOT
+#include "aot.c"
+#else
+#define AOT_INVAL(ADDR) do{}while(0)
+#endif
+
+/* only remapping, snapshot restores and HuC6280 block transfers drop
+   code themselves, other stores go through CODE_INVAL */
+#if (defined(CPU_DECODE_CACHE) || defined(CPU_JIT) || defined(CPU_AOT) || defined(CPU_LANES)) && \
+	(defined(CPU_MEMMAP) || defined(CPU_SNAPSHOT) || HAS_HUC)
+/* drops everything cached about the code in the range */
+static void code_drop(struct cpu65 *cpu, unsigned addr, unsigned len) {
+#ifdef CPU_DECODE_CACHE
+	cpu65_dcache_invalidate(cpu, addr, len);
+#endif
+#ifdef CPU_JIT
+	cpu65_jit_invalidate(cpu, addr, len);
+#endif
+#ifdef CPU_AOT
+	cpu65_aot_invalidate(cpu, addr, len);
+#endif
+#ifdef CPU_LANES
+	if(cpu->lanes) lanes_inval(cpu->lanes, addr, len);
+#endif
+}
+#else
+#define code_drop(CPU, ADDR, LEN) do { (void) (ADDR); } while(0)
+#endif
+
+#if (defined(CPU_DECODE_CACHE) || defined(CPU_JIT) || defined(CPU_AOT) || defined(CPU_LANES)) && \
+	(defined(CPU_SNAPSHOT) || (HAS_HUC && defined(CPU_MEMMAP)))
+/* the same, for memory that changed. the caches are by 16 bit address,
+   on HuC6280 the bank may be mapped to more than one slot, the code
+   cached for each of them is dropped. */
+static void code_inval(struct cpu65 *cpu, unsigned addr, unsigned len) {
+	unsigned n, b;
+	if(!IS_HUC || len > 0x2000 - (addr & 0x1fff)) {
+		code_drop(cpu, addr, len);
+		return;
+	}
+	b = cpu->mpr[(addr >> 13) & 7];
+	for(n = 0; n < 8; ++n) if(cpu->mpr[n] == b) code_drop(cpu, n << 13 | (addr & 0x1fff), len);
+}
+#else
+#define code_inval(CPU, ADDR, LEN) do { (void) (ADDR); } while(0)
+#endif
+
+#if HAS_HUC && (defined(CPU_DECODE_CACHE) || defined(CPU_JIT) || defined(CPU_AOT) || defined(CPU_LANES))
+static inline void code_written(struct cpu65 *cpu, unsigned addr) {
+	unsigned n, b, a;
+	if(!IS_HUC) {
+		DC_INVAL(addr);
+		JIT_INVAL(addr);
+		AOT_INVAL(addr);
+		LANES_INVAL(addr);
+		return;
+	}
+	b = cpu->mpr[(addr >> 13) & 7];
+	for(n = 0; n < 8; ++n) if(cpu->mpr[n] == b) {
+		a = n << 13 | (addr & 0x1fff);
+		DC_INVAL(a);
+		JIT_INVAL(a);
+		AOT_INVAL(a);
+		LANES_INVAL(a);
+	}
+}
+#define CODE_INVAL(ADDR) code_written(cpu, (u16)(ADDR))
+#else
+#define CODE_INVAL(ADDR) do { DC_INVAL(ADDR); JIT_INVAL(ADDR); AOT_INVAL(ADDR); LANES_INVAL(ADDR); } while(0)
+#endif
+
+#ifdef CPU_MEMMAP
+/* maps mem to the range of len bytes at addr. addr and len need to be
+   multiples of 256. pass mem == 0 to turn the range into i/o for the
+   directions selected with how (CPU65_MAP_*).
+   to map ROM, use CPU65_MAP_READ only, so writes go to io_write.
+   code cached for the range is dropped if its reads are remapped. */
+void cpu65_map(struct cpu65 *cpu, unsigned addr, unsigned len, u8 *mem, unsigned how) {
+	unsigned i, n = len >> 8, p = addr >> 8;
+	for(i = 0; i < n && p + i < 256; ++i) {
+		if(how & CPU65_MAP_READ) cpu->rmap[p + i] = mem ? mem + (i << 8) : 0;
+		if(how & CPU65_MAP_WRITE) cpu->wmap[p + i] = mem ? mem + (i << 8) : 0;
+	}
+	if(how & CPU65_MAP_READ) code_drop(cpu, addr, i << 8);
+}
+#endif
+
+#if HAS_HUC
+/* HuC6280 bank mapping. the 16 bit address space is made of 8 slots of
+   8K, MPR n selects which of the 256 physical banks appears in slot n.
+   CPU_READ_N and CPU_WRITE_N are passed the 16 bit address, use
+   cpu65_phys() to get the 21 bit physical one. zeropage and stack are
+   at 0x2000, in the bank selected by MPR1.
+   without CPU_MEMMAP, the host needs to update cpu->zp if MPR1 changes.
+   define CPU_MPR_WRITTEN(N) to be told when MPR N was written.
+   ST0-2 don't go through the MPRs, see CPU_VDC_WRITE. */
+static inline unsigned cpu65_phys(struct cpu65 *cpu, u16 addr) {
+	return (cpu->mpr[addr >> 13] << 13) | (addr & 0x1fff);
+}
+
+#ifdef CPU_SNAPSHOT
+void cpu65_mark_dirty(struct cpu65 *cpu, u16 addr, unsigned len);
+#endif
+
+static void mpr_changed(struct cpu65 *cpu, unsigned n) {
+#ifdef CPU_MEMMAP
+	u8 *r = cpu->bank_r[cpu->mpr[n]], *w = cpu->bank_w[cpu->mpr[n]];
+	unsigned i;
+	for(i = 0; i < 32; ++i) {
+		cpu->rmap[n * 32 + i] = r ? r + (i << 8) : 0;
+		cpu->wmap[n * 32 + i] = w ? w + (i << 8) : 0;
+	}
+	if(n == 1 && w) {
+		cpu->zp = w;
+		cpu->stack = w + 256;
+	}
+#else
+	(void) cpu;
+#endif
+	code_drop(cpu, n << 13, 0x2000);
+#ifdef CPU_SNAPSHOT
+	/* the slot shows other memory now, rollback and rewind need to
+	   restore it */
+	cpu65_mark_dirty(cpu, n << 13, 0x2000);
+#endif
+#ifdef CPU_MPR_WRITTEN
+	CPU_MPR_WRITTEN(n);
+#endif
+}
+
+/* TAM: the MPRs selected in mask are set to v */
+static void mpr_write(struct cpu65 *cpu, u8 mask, u8 v) {
+	unsigned n;
+	for(n = 0; n < 8; ++n) if((mask & (1 << n)) && cpu->mpr[n] != v) {
+		cpu->mpr[n] = v;
+		mpr_changed(cpu, n);
+	}
+}
+
+/* applies the MPRs after they were overwritten, old are the previous ones */
+static void mpr_restored(struct cpu65 *cpu, const u8 *old) {
+	unsigned n;
+	for(n = 0; n < 8; ++n) if(cpu->mpr[n] != old[n]) mpr_changed(cpu, n);
+}
+
+#ifdef CPU_MEMMAP
+/* with CPU_MEMMAP, a HuC6280 has its memory mapped per physical bank
+   instead of with cpu65_map(). mem is 8K of host memory, or 0 to turn the
+   bank into i/o, like bank 0xff usually is. the slots are remapped
+   according to the MPRs whenever these change. */
+void cpu65_map_bank(struct cpu65 *cpu, u8 bank, u8 *mem, unsigned how) {
+	unsigned n;
+	if(how & CPU65_MAP_READ) cpu->bank_r[bank] = mem;
+	if(how & CPU65_MAP_WRITE) cpu->bank_w[bank] = mem;
+	for(n = 0; n < 8; ++n) if(cpu->mpr[n] == bank) mpr_changed(cpu, n);
+}
+#endif
+#define MPR_RESTORED(OLD) do { if(IS_HUC) mpr_restored(cpu, OLD); } while(0)
+#else
+#define MPR_RESTORED(OLD) do{}while(0)
+#endif
+
 static inline u8 pack_flags(struct cpu65 *cpu) {
 	return
-	(cpu->f_n << 7) | (cpu->f_v << 6) |
+	(cpu->f_n & 0x80) | (cpu->f_v << 6) |
 	(cpu->f_t << 5) | (cpu->f_b << 4) |
 	(cpu->f_d << 3) | (cpu->f_i << 2) |
-	(cpu->f_z << 1) | (cpu->f_c << 0);
+	(!cpu->f_z << 1) | (cpu->f_c << 0);
 }
 
-static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
-	cpu->f_n = !!(f & N_FLAG);
+/* huc is passed in so it's a constant inside the cores */
+#define unpack_flags(CPU, F) unpack_flags_huc(CPU, F, IS_HUC)
+static inline void unpack_flags_huc(struct cpu65 *cpu, u8 f, int huc) {
+	cpu->f_n = f & N_FLAG;
 	cpu->f_v = !!(f & V_FLAG);
-#if CPU_TYPE == CPU_TYPE_HUC6280
-	cpu->f_t = !!(f & T_FLAG);
-	cpu->f_b = !!(f & B_FLAG); // TODO: check whether huc really restores B
-#else
-	/* http://www.6502.org/tutorials/register_preservation.html :
-	   Chelly adds: At the end proper checking of the B flag is discussed.
-	   My feedback is that it would be simpler to explain that there is no
-	   B flag in the processor status register; that bit is simply unused.
-	   When pushing the status register on the stack, that bit is set to a
-	   fixed value based on the instruction/event (set for PHP and BRK,
-	   clear for NMI). This is much simpler to explain and leads to no
-	   incorrect assumption that there is a B flag in the status register
-	   that can be checked.	*/
-	cpu->f_t = 1;
-	cpu->f_b = 1;
-#endif
+	if(huc) {
+		cpu->f_t = !!(f & T_FLAG);
+		cpu->f_b = !!(f & B_FLAG); // TODO: check whether huc really restores B
+	} else {
+		/* http://www.6502.org/tutorials/register_preservation.html :
+		   Chelly adds: At the end proper checking of the B flag is discussed.
+		   My feedback is that it would be simpler to explain that there is no
+		   B flag in the processor status register; that bit is simply unused.
+		   When pushing the status register on the stack, that bit is set to a
+		   fixed value based on the instruction/event (set for PHP and BRK,
+		   clear for NMI). This is much simpler to explain and leads to no
+		   incorrect assumption that there is a B flag in the status register
+		   that can be checked.	*/
+		cpu->f_t = 1;
+		cpu->f_b = 1;
+	}
 	cpu->f_d = !!(f & D_FLAG);
 	cpu->f_i = !!(f & I_FLAG);
-	cpu->f_z = !!(f & Z_FLAG);
+	cpu->f_z = !(f & Z_FLAG);
 	cpu->f_c = !!(f & C_FLAG);
 }
 
+#ifdef CPU_SNAPSHOT
+/* snapshots hold the registers, interrupt and event state, and the memory
+   the cpu can write to: zeropage, stack and, with CPU_MEMMAP, all pages
+   mapped writable. i/o and ROM pages, and any device state, are up to the
+   host. event callbacks and their ctx are stored as host pointers, so a
+   snapshot can only be loaded by the program that saved it.
+   pages are saved by their 16 bit address. on HuC6280 the MPRs are
+   restored first, so with CPU_MEMMAP they go to the banks mapped at the
+   time of saving. banks not mapped at that time aren't covered, the same
+   goes for checkpoints and rewind. */
+#define CPU65_SNAP_VERSION 2
+
+/* in-process checkpoint, see cpu65_checkpoint() */
+struct cpu65_checkpoint {
+	struct cpu65 cpu; /* only the register and event state is used */
+	u8 saved[256/8]; /* pages present in mem */
+	u8 mem[256][256];
+};
+
+/* host memory behind page p, if it's part of snapshots */
+static u8 *snap_page(struct cpu65 *cpu, unsigned p) {
+#ifdef CPU_MEMMAP
+	if(cpu->wmap[p]) return cpu->wmap[p];
+#endif
+	if(p == ZP_BASE >> 8) return cpu->zp;
+	if(p == (ZP_BASE >> 8) + 1) return cpu->stack;
+	return 0;
+}
+
+/* copies the register and event state, everything but the host pointers */
+static void snap_regs(struct cpu65 *dst, const struct cpu65 *src) {
+	memcpy(dst, src, offsetof(struct cpu65, zp));
+	memcpy(&dst->cs, &src->cs,
+	       offsetof(struct cpu65, user) - offsetof(struct cpu65, cs));
+}
+
+#ifdef CPU_REWIND
+#define RW_DIRTY(P) cpu->rw_dirty[(P) >> 3] |= 1 << ((P) & 7)
+#else
+#define RW_DIRTY(P) do{}while(0)
+#endif
+#define SNAP_DIRTY_PAGE(P) do { cpu->dirty[(P) >> 3] |= 1 << ((P) & 7); \
+	RW_DIRTY(P); } while(0)
+
+/* stores through the cpu are tracked automatically. if the host changes
+   memory that is part of snapshots, it needs to tell with this function
+   so cpu65_rollback() and cpu65_rewind() restore it. */
+void cpu65_mark_dirty(struct cpu65 *cpu, u16 addr, unsigned len) {
+	unsigned p;
+	if(!len) return;
+	if(len > 0x10000) len = 0x10000;
+	for(p = addr >> 8; p <= (addr + len - 1u) >> 8; ++p)
+		SNAP_DIRTY_PAGE(p & 0xff);
+}
+
+/* saves the current state into cp, and starts tracking the pages written
+   from now on. */
+void cpu65_checkpoint(struct cpu65 *cpu, struct cpu65_checkpoint *cp) {
+	unsigned p;
+	u8 *m;
+	snap_regs(&cp->cpu, cpu);
+	memset(cp->saved, 0, sizeof cp->saved);
+	for(p = 0; p < 256; ++p) if((m = snap_page(cpu, p))) {
+		memcpy(cp->mem[p], m, 256);
+		cp->saved[p >> 3] |= 1 << (p & 7);
+	}
+	memset(cpu->dirty, 0, sizeof cpu->dirty);
+	cpu->snap_base = cp;
+}
+
+/* restores the state saved by cpu65_checkpoint(). when going back to the
+   most recent checkpoint, only the pages written since then are copied,
+   which makes this cheap enough to run for every fuzzer iteration.
+   the memory map itself isn't part of the checkpoint and must not have
+   changed. */
+void cpu65_rollback(struct cpu65 *cpu, const struct cpu65_checkpoint *cp) {
+	unsigned p;
+	u8 *m;
+	int all = cpu->snap_base != cp;
+	u8 mpr[8];
+	memcpy(mpr, cpu->mpr, sizeof mpr);
+	snap_regs(cpu, &cp->cpu);
+	MPR_RESTORED(mpr);
+	for(p = 0; p < 256; ++p) {
+		if(!all && !(cpu->dirty[p >> 3] & (1 << (p & 7)))) {
+			if(!cpu->dirty[p >> 3]) p |= 7;
+			continue;
+		}
+		if(!(cp->saved[p >> 3] & (1 << (p & 7))) || !(m = snap_page(cpu, p))) continue;
+		memcpy(m, cp->mem[p], 256);
+		code_inval(cpu, p << 8, 256);
+		RW_DIRTY(p);
+	}
+	memset(cpu->dirty, 0, sizeof cpu->dirty);
+	cpu->snap_base = cp;
+}
+
+/* the fixed part of a snapshot, followed by 24 bytes per event, the bitmap
+   of saved pages and their contents. */
+#define SNAP_HDR 41
+
+static u8 *snap_le(u8 *p, uint64_t v, unsigned n) {
+	for(; n; --n, v >>= 8) *p++ = v;
+	return p;
+}
+
+static uint64_t snap_get(const u8 **p, unsigned n) {
+	uint64_t v = 0;
+	unsigned i;
+	for(i = n; i--; ) v = (v << 8) | (*p)[i];
+	*p += n;
+	return v;
+}
+
+/* serializes the state into buf, which has room for size bytes.
+   returns the size of the snapshot. if that's larger than size, nothing
+   was written, so you can pass buf = 0 to query the size. */
+size_t cpu65_save(struct cpu65 *cpu, void *buf, size_t size) {
+	u8 *p = buf, *saved, f;
+	unsigned i, n = 0;
+	size_t need;
+	for(i = 0; i < 256; ++i) if(snap_page(cpu, i)) ++n;
+	need = SNAP_HDR + cpu->nevents * 24 + 32 + n * 256;
+	if(!buf || size < need) return need;
+	memcpy(p, "C65S", 4); p += 4;
+	p = snap_le(p, CPU65_SNAP_VERSION, 1);
+	p = snap_le(p, CPU_TYPE, 1);
+	p = snap_le(p, cpu->pc, 2);
+	memcpy(p, &cpu->s, 4); p += 4; /* s, a, x, y */
+	f = pack_flags(cpu);
+	for(i = 0; i < 8; ++i) *p++ = (f >> (7 - i)) & 1; /* n, v, t, b, d, i, z, c */
+	memcpy(p, cpu->mpr, 8); p += 8;
+	p = snap_le(p, cpu->speed, 1);
+	p = snap_le(p, cpu->cs, 1);
+	p = snap_le(p, cpu->irq, 1);
+	p = snap_le(p, cpu->int_req, 1);
+	p = snap_le(p, cpu->cycles, 8);
+	p = snap_le(p, cpu->nevents, 1);
+	for(i = 0; i < cpu->nevents; ++i) {
+		p = snap_le(p, cpu->events[i].when, 8);
+		p = snap_le(p, (uintptr_t) cpu->events[i].fn, 8);
+		p = snap_le(p, (uintptr_t) cpu->events[i].ctx, 8);
+	}
+	saved = p;
+	memset(saved, 0, 32); p += 32;
+	for(i = 0; i < 256; ++i) if(snap_page(cpu, i)) {
+		saved[i >> 3] |= 1 << (i & 7);
+		memcpy(p, snap_page(cpu, i), 256); p += 256;
+	}
+	return need;
+}
+
+/* restores a state written by cpu65_save(). the pages saved in the
+   snapshot need to be mapped writable the same way as when it was saved.
+   returns 0 on success, -1 if the snapshot doesn't fit this cpu. */
+int cpu65_load(struct cpu65 *cpu, const void *buf, size_t size) {
+	const u8 *p = buf, *saved;
+	unsigned i, n = 0, nev;
+	u8 f, mpr[8];
+	if(size < SNAP_HDR || memcmp(p, "C65S", 4) || p[4] != CPU65_SNAP_VERSION ||
+	   p[5] != CPU_TYPE || (nev = p[SNAP_HDR-1]) > CPU65_MAX_EVENTS ||
+	   size < SNAP_HDR + nev * 24 + 32) return -1;
+	saved = p + SNAP_HDR + nev * 24;
+	/* on HuC6280 the MPRs may map the pages only after they are restored */
+	for(i = 0; i < 256; ++i) if(saved[i >> 3] & (1 << (i & 7))) {
+		if(!IS_HUC && !snap_page(cpu, i)) return -1;
+		++n;
+	}
+	if(size < SNAP_HDR + nev * 24 + 32 + n * 256) return -1;
+	p += 6;
+	cpu->pc = snap_get(&p, 2);
+	memcpy(&cpu->s, p, 4); p += 4;
+	for(i = f = 0; i < 8; ++i) f = f << 1 | !!*p++;
+	unpack_flags(cpu, f);
+	/* unpack_flags() forces T and B on 6502, keep them as saved */
+	cpu->f_t = (f >> 5) & 1;
+	cpu->f_b = (f >> 4) & 1;
+	memcpy(mpr, cpu->mpr, 8);
+	memcpy(cpu->mpr, p, 8); p += 8;
+	cpu->speed = snap_get(&p, 1);
+	cpu->cs = snap_get(&p, 1);
+	cpu->irq = snap_get(&p, 1);
+	cpu->int_req = snap_get(&p, 1);
+	cpu->cycles = snap_get(&p, 8);
+	cpu->nevents = snap_get(&p, 1);
+	for(i = 0; i < nev; ++i) {
+		cpu->events[i].when = snap_get(&p, 8);
+		cpu->events[i].fn = (void (*) (struct cpu65*, void*)) (uintptr_t) snap_get(&p, 8);
+		cpu->events[i].ctx = (void *) (uintptr_t) snap_get(&p, 8);
+	}
+	MPR_RESTORED(mpr);
+	p += 32;
+	for(i = 0; i < 256; ++i) if(saved[i >> 3] & (1 << (i & 7))) {
+		/* the restored MPRs may have mapped the page away */
+		if(snap_page(cpu, i)) memcpy(snap_page(cpu, i), p, 256);
+		RW_DIRTY(i);
+		p += 256;
+	}
+	code_inval(cpu, 0, 0x10000);
+	memset(cpu->dirty, 0, sizeof cpu->dirty);
+	cpu->snap_base = 0;
+	return 0;
+}
+
+#define SNAP_DIRTY(ADDR) SNAP_DIRTY_PAGE((u16)(ADDR) >> 8)
+
+#ifdef CPU_REWIND
+#include "rewind.c"
+#endif
+#else
+#define SNAP_DIRTY(ADDR) do{}while(0)
+#endif
+
 #define M (*m)
 #define PC cpu->pc
 #define A cpu->a
 #define X cpu->x
 #define Y cpu->y
 
-#define N cpu->f_n
+/* N and Z can only be read, use SET_N/SET_Z/SET_ZN to set them */
+#define N (cpu->f_n >> 7)
 #define V cpu->f_v
 #define T cpu->f_t
 #define B cpu->f_b
 #define D cpu->f_d
 #define I cpu->f_i
-#define Z cpu->f_z
+#define Z (!cpu->f_z)
 #define C cpu->f_c
 
+#ifdef CPU_BUS_CYCLES
+/* cpu->bus_cycle is set to the absolute cycle of each access before calling
+   CPU_READ_N/CPU_WRITE_N. opcyc and oprmw are defined by the generated
+   handlers. stores happen on the last cycle of an instruction, and so do
+   operand reads, except for read-modify-write, which read 2 cycles earlier.
+   opcode fetches happen on the first cycle. */
+#define BUS_AT(OFS) cpu->bus_cycle = base + cyc + (OFS)
+#else
+#define BUS_AT(OFS) do{}while(0)
+#endif
+
+#ifdef CPU_BREAK
+/* break- and watchpoints. there's a bitmap of the 64K addresses per kind
+   of access. executing an instruction from, reading or writing an
+   address with its bit set makes cpu65_exec() return early with cpu->cs
+   set to cs_break, cpu65_bp_hit() tells where and how. it stops before
+   an instruction at an execute breakpoint, and after the instruction
+   hitting a watchpoint, at the next instruction boundary in both cases.
+   the next cpu65_exec() continues from there.
+   reads are those of operands, pointers, vectors and the stack, also
+   the direct ones of zeropage and stack, by their 16 bit address (see
+   ZP_BASE). opcode fetches aren't, neither is the read done internally
+   before a store. the kinds with any bit set are kept in cpu->bp_on,
+   so without any a check is a single branch. while there are some, JIT
+   and AOT blocks don't run and idle loops aren't skipped, so every
+   instruction is seen, and lanes run the instance by cpu65_exec(). */
+#define CPU65_BP_EXEC 1
+#define CPU65_BP_READ 2
+#define CPU65_BP_WRITE 4
+
+struct cpu65_bp {
+	u8 map[3][0x10000/8]; /* by kind >> 1: exec, read, write */
+	u16 addr; /* where it stopped */
+	u8 kind; /* and why, CPU65_BP_* */
+	u8 resume; /* continuing from an execute breakpoint at addr */
+};
+
+#define BP_BIT(BP, KIND, ADDR) ((BP)->map[(KIND) >> 1][(ADDR) >> 3] & (1 << ((ADDR) & 7)))
+
+/* returns 0 on success, -1 if out of memory */
+int cpu65_bp_init(struct cpu65 *cpu) {
+	if(!cpu->bp) cpu->bp = calloc(1, sizeof *cpu->bp);
+	return cpu->bp ? 0 : -1;
+}
+
+void cpu65_bp_free(struct cpu65 *cpu) {
+	free(cpu->bp);
+	cpu->bp = 0;
+	cpu->bp_on = 0;
+}
+
+/* sets (on != 0) or clears the breakpoints of the kinds in mask, any of
+   CPU65_BP_*, for the len addresses from addr on. */
+void cpu65_bp_set(struct cpu65 *cpu, u16 addr, unsigned len, unsigned mask, int on) {
+	struct cpu65_bp *bp = cpu->bp;
+	unsigned k, i, a;
+	if(!bp) return;
+	if(len > 0x10000) len = 0x10000;
+	cpu->bp_on = 0;
+	for(k = 0; k < 3; ++k) {
+		for(i = 0; i < len && (mask & (1 << k)); ++i) {
+			a = (u16)(addr + i);
+			if(on) bp->map[k][a >> 3] |= 1 << (a & 7);
+			else bp->map[k][a >> 3] &= ~(1 << (a & 7));
+		}
+		for(i = 0; i < sizeof bp->map[k]; ++i) if(bp->map[k][i]) {
+			cpu->bp_on |= 1 << k;
+			break;
+		}
+	}
+	if(!cpu->bp_on) bp->resume = 0;
+}
+
+/* after cpu65_exec() returned with cs_break, returns the kind of access
+   that hit, CPU65_BP_*, and stores its address to addr. returns 0 if the
+   cpu didn't stop at a breakpoint. */
+unsigned cpu65_bp_hit(struct cpu65 *cpu, u16 *addr) {
+	if(!cpu->bp || cpu->cs != cs_break) return 0;
+	if(addr) *addr = cpu->bp->addr;
+	return cpu->bp->kind;
+}
+
+/* only the first hit of an instruction is reported */
+static void bp_hit(struct cpu65 *cpu, unsigned kind, unsigned addr) {
+	if(cpu->cs == cs_break) return;
+	cpu->bp->addr = addr;
+	cpu->bp->kind = kind;
+	cpu->cs = cs_break;
+}
+
+static void bp_access(struct cpu65 *cpu, unsigned kind, unsigned addr, unsigned n) {
+	for(; n; --n, ++addr) if(BP_BIT(cpu->bp, kind, (u16) addr)) {
+		bp_hit(cpu, kind, (u16) addr);
+		return;
+	}
+}
+
+/* run before each instruction while cpu->bp_on is set. returns whether
+   to stop: the previous instruction hit a watchpoint, or there's an
+   execute breakpoint at pc, other than the one cpu65_exec() continues
+   from. */
+static int bp_stop(struct cpu65 *cpu) {
+	struct cpu65_bp *bp = cpu->bp;
+	if(cpu->cs == cs_break) return 1;
+	if(bp->resume) {
+		bp->resume = 0;
+		if(cpu->pc == bp->addr) return 0;
+	}
+	if(!(cpu->bp_on & CPU65_BP_EXEC) || !BP_BIT(bp, CPU65_BP_EXEC, cpu->pc)) return 0;
+	bp_hit(cpu, CPU65_BP_EXEC, cpu->pc);
+	return 1;
+}
+
+/* at the start of cpu65_exec() */
+static void bp_resume(struct cpu65 *cpu) {
+	cpu->cs = cs_normal;
+	if(cpu->bp_on) cpu->bp->resume = cpu->bp->kind == CPU65_BP_EXEC;
+}
+
+/* these are expressions, so they can go into POP() */
+#define BP_ACCESS(KIND, ADDR, N) ((cpu->bp_on & (KIND)) ? bp_access(cpu, KIND, ADDR, N) : (void) 0)
+#define BP_ON() cpu->bp_on
+#else
+#define BP_ACCESS(KIND, ADDR, N) ((void) 0)
+#define BP_ON() 0
+#endif
+#define BP_READ(ADDR, N) BP_ACCESS(CPU65_BP_READ, ADDR, N)
+#define BP_WRITE(ADDR) BP_ACCESS(CPU65_BP_WRITE, ADDR, 1)
+
+#ifdef CPU_COVERAGE
+/* coverage. a map of attributes per address, CPU65_COV_* or-ed together
+   for each way it was accessed while recording: the first byte of an
+   instruction executed, the rest of it, read as data, written, or read
+   as a pointer or vector. the map has 64K entries, on HuC6280 2M, one
+   per physical address (see cpu65_phys()). the host reads it from
+   cpu->cov directly.
+   accesses are those watchpoints see (see CPU_BREAK). while recording,
+   JIT and AOT blocks don't run and HuC6280 block transfers go a byte at
+   a time, so nothing is missed. idle loops are still skipped, they ran
+   once before. lanes run the instance by cpu65_exec().
+   maps are saved to a stdio stream with cpu65_cov_save() and merged in
+   again with cpu65_cov_load(), e.g. to be fed to aot.py -c. a map that
+   isn't recorded into serves as a hint: the JIT doesn't translate bytes
+   marked written, which would keep dropping the blocks.
+   the stream is "C65C", the version, the cpu type and the map size (4
+   bytes), followed by records covering the map: a tag byte below 0x80
+   is followed by that + 1 entries as they are, one with bit 7 set
+   stands for a run of the entry in its low bits, of length LEB128 + 1. */
+#include <stdio.h>
+
+#define CPU65_COV_EXEC 1
+#define CPU65_COV_OPERAND 2
+#define CPU65_COV_READ 4
+#define CPU65_COV_WRITE 8
+#define CPU65_COV_VECTOR 16
+
+#define COV_VERSION 1
+#define COV_SIZE (IS_HUC ? 0x200000u : 0x10000u)
+
+/* allocates the map, if there's none yet, and starts recording.
+   returns 0 on success, -1 if out of memory. */
+int cpu65_cov_init(struct cpu65 *cpu) {
+	if(!cpu->cov && !(cpu->cov = calloc(1, COV_SIZE))) return -1;
+	cpu->cov_on = 1;
+	return 0;
+}
+
+void cpu65_cov_free(struct cpu65 *cpu) {
+	free(cpu->cov);
+	cpu->cov = 0;
+	cpu->cov_on = 0;
+}
+
+/* stops (on == 0) or resumes recording, keeping the map */
+void cpu65_cov_record(struct cpu65 *cpu, int on) {
+	cpu->cov_on = on && cpu->cov;
+}
+
+/* returns 0 on success, -1 if there's no map or f couldn't be written */
+int cpu65_cov_save(struct cpu65 *cpu, FILE *f) {
+	const u8 *map = cpu->cov;
+	unsigned i, n, size = COV_SIZE, r;
+	if(!map) return -1;
+	fwrite("C65C", 1, 4, f);
+	putc(COV_VERSION, f);
+	putc(CPU_TYPE, f);
+	for(i = 0; i < 4; ++i) putc(size >> (i * 8), f);
+	for(i = 0; i < size; i += n) {
+		for(n = 1; i + n < size && map[i + n] == map[i]; ++n);
+		if(n >= 3) {
+			putc(0x80 | map[i], f);
+			for(r = n - 1; r > 0x7f; r >>= 7) putc(0x80 | (r & 0x7f), f);
+			putc(r, f);
+			continue;
+		}
+		/* up to where the next run starts */
+		for(n = 1; n < 128 && i + n < size; ++n)
+			if(i + n + 2 < size && map[i + n] == map[i + n + 1] &&
+			   map[i + n] == map[i + n + 2]) break;
+		putc(n - 1, f);
+		fwrite(map + i, 1, n, f);
+	}
+	return fflush(f) || ferror(f) ? -1 : 0;
+}
+
+/* merges the map saved to f into the one of cpu, which is allocated if
+   needed, without starting to record. returns 0 on success, -1 if out of
+   memory, or f doesn't hold a map for this cpu type. */
+int cpu65_cov_load(struct cpu65 *cpu, FILE *f) {
+	u8 h[10], *map;
+	unsigned i, n, s, size = COV_SIZE;
+	int c, v;
+	if(fread(h, 1, 10, f) != 10 || memcmp(h, "C65C", 4) || h[4] != COV_VERSION ||
+	   h[5] != CPU_TYPE || (h[6] | h[7] << 8 | (unsigned) h[8] << 16 | (unsigned) h[9] << 24) != size)
+		return -1;
+	if(!cpu->cov && !(cpu->cov = calloc(1, size))) return -1;
+	map = cpu->cov;
+	for(i = 0; i < size; i += n) {
+		if((c = getc(f)) == EOF) return -1;
+		v = -1;
+		if(c & 0x80) {
+			v = c & 0x7f;
+			n = s = 0;
+			do {
+				if((c = getc(f)) == EOF || s > 21) return -1;
+				n |= (c & 0x7f) << s;
+				s += 7;
+			} while(c & 0x80);
+		} else n = c;
+		if(++n > size - i) return -1;
+		for(s = 0; s < n; ++s) {
+			if(v < 0 && (c = getc(f)) == EOF) return -1;
+			map[i + s] |= v < 0 ? c : v;
+		}
+	}
+	return 0;
+}
+
+static inline unsigned cov_addr(struct cpu65 *cpu, u16 addr) {
+#if HAS_HUC
+	if(IS_HUC) return cpu65_phys(cpu, addr);
+#else
+	(void) cpu;
+#endif
+	return addr;
+}
+
+static void cov_mark(struct cpu65 *cpu, unsigned kind, unsigned addr, unsigned n) {
+	for(; n; --n, ++addr) cpu->cov[cov_addr(cpu, addr)] |= kind;
+}
+
+/* the instruction of n bytes at pc is about to run */
+static inline void cov_exec(struct cpu65 *cpu, u16 pc, unsigned n) {
+	cpu->cov[cov_addr(cpu, pc)] |= CPU65_COV_EXEC;
+	while(--n) cpu->cov[cov_addr(cpu, ++pc)] |= CPU65_COV_OPERAND;
+}
+
+#ifdef CPU_JIT
+/* whether any of the n bytes from addr is marked written */
+static int cov_written(struct cpu65 *cpu, u16 addr, unsigned n) {
+	for(; n; --n, ++addr) if(cpu->cov[cov_addr(cpu, addr)] & CPU65_COV_WRITE) return 1;
+	return 0;
+}
+#endif
+
+#define COV_MARK(KIND, ADDR, N) (cpu->cov_on ? cov_mark(cpu, KIND, ADDR, N) : (void) 0)
+#define COV_EXEC(N) do { if(cpu->cov_on) cov_exec(cpu, PC, N); } while(0)
+#define COV_ON() cpu->cov_on
+#else
+#define COV_MARK(KIND, ADDR, N) ((void) 0)
+#define COV_EXEC(N) do{}while(0)
+#define COV_ON() 0
+#endif
+
+/* reads as seen by watchpoints and coverage. COV is CPU65_COV_READ, or
+   CPU65_COV_VECTOR for pointers and vectors */
+#define ACC_READ(ADDR, N, COV) (BP_READ(ADDR, N), COV_MARK(COV, ADDR, N))
+
+/* all accesses to memory go through these, so caches of the memory contents
+   can be kept coherent. opst is defined by the generated handlers as
+   well, stores don't read their operand, but may read a pointer. */
+#define CODE_WRITTEN(ADDR) do { BP_WRITE(ADDR); COV_MARK(CPU65_COV_WRITE, ADDR, 1); \
+	CODE_INVAL(ADDR); SNAP_DIRTY(ADDR); } while(0)
+#define MEM_READ_N(DEST, ADDR, N) do { BUS_AT(opcyc - 1 - 2*oprmw); \
+	if(!opst) ACC_READ(ADDR, N, CPU65_COV_READ); \
+	CPU_READ_N(DEST, ADDR, N); BUS_POLL(); } while(0)
+#define PTR_READ_N(DEST, ADDR, N) do { BUS_AT(opcyc - 1 - 2*oprmw); \
+	ACC_READ(ADDR, N, CPU65_COV_VECTOR); \
+	CPU_READ_N(DEST, ADDR, N); BUS_POLL(); } while(0)
+/* reads of zeropage through cpu->zp */
+#define ZP_READ(N) ACC_READ(ZP_BASE + (N), 1, CPU65_COV_READ)
+#define ZP_PTR_READ(N) ACC_READ(ZP_BASE + (N), 1, CPU65_COV_VECTOR)
+#define MEM_WRITE_N(SRC, ADDR, N) do { BUS_AT(opcyc - 1); \
+	CPU_WRITE_N(SRC, ADDR, N); CODE_WRITTEN(ADDR); BUS_POLL(); } while(0)
+#define ZP_WRITTEN(N) CODE_WRITTEN(ZP_BASE + (N))
+#define STACK_WRITTEN(S) CODE_WRITTEN(ZP_BASE + 0x100 + (S))
+
+#ifdef CPU_JIT
+/* a JIT block stored to addr, returns whether that dropped translated
+   code, which may have been the block's own */
+static int jit_written(struct cpu65 *cpu, unsigned addr) {
+	unsigned d = cpu->jit->dropped;
+	CODE_WRITTEN(addr);
+	return cpu->jit->dropped != d;
+}
+#endif
+
+#if HAS_HUC
+/* HuC6280 block transfers. byte i goes from xfer_src(i) to xfer_dst(i). */
+#define XFER_TII 0x73
+#define XFER_TDD 0xc3
+#define XFER_TIN 0xd3
+#define XFER_TIA 0xe3
+#define XFER_TAI 0xf3
+static inline u16 xfer_src(u8 opc, u16 src, unsigned i) {
+	switch(opc) {
+	case XFER_TDD: return src - i;
+	case XFER_TAI: return src + (i & 1);
+	default: return src + i;
+	}
+}
+
+static inline u16 xfer_dst(u8 opc, u16 dst, unsigned i) {
+	switch(opc) {
+	case XFER_TDD: return dst - i;
+	case XFER_TIN: return dst;
+	case XFER_TIA: return dst + (i & 1);
+	default: return dst + i;
+	}
+}
+
+#ifdef CPU_MEMMAP
+/* does as many bytes from i on as possible without going through the
+   generic path. these stay within a page for both source and destination,
+   and produce the same memory contents and device writes as copying
+   byte by byte. returns the number of bytes done, 0 if byte i needs to
+   go the generic way, as all do while there are breakpoints or coverage
+   is recorded. with CPU_BUS_CYCLES, cpu->bus_cycle is the cycle byte i is
+   written on. */
+static unsigned xfer_fast(struct cpu65 *cpu, u8 opc, u16 src, u16 dst, unsigned i, unsigned len) {
+	u16 s = xfer_src(opc, src, i), d = xfer_dst(opc, dst, i);
+	u8 *rs = cpu->rmap[s >> 8], *wd = cpu->wmap[d >> 8], *p;
+	unsigned n = len - i, k;
+	if(!rs || BP_ON() || COV_ON()) return 0;
+	rs += s & 0xff;
+	switch(opc) {
+	case XFER_TII:
+		if(!wd) return 0;
+		wd += d & 0xff;
+		if(n > 256u - (s & 0xff)) n = 256 - (s & 0xff);
+		if(n > 256u - (d & 0xff)) n = 256 - (d & 0xff);
+		/* copying forward repeats the first wd - rs bytes */
+		if(wd > rs && wd - rs < n) n = wd - rs;
+		memmove(wd, rs, n);
+		code_inval(cpu, d, n);
+		SNAP_DIRTY(d);
+		return n;
+	case XFER_TDD:
+		if(!wd) return 0;
+		wd += d & 0xff;
+		if(n > (s & 0xff) + 1u) n = (s & 0xff) + 1;
+		if(n > (d & 0xff) + 1u) n = (d & 0xff) + 1;
+		if(rs > wd && rs - wd < n) n = rs - wd;
+		memmove(wd - n + 1, rs - n + 1, n);
+		code_inval(cpu, (u16)(d - n + 1), n);
+		SNAP_DIRTY(d);
+		return n;
+	case XFER_TIN:
+	case XFER_TIA:
+		if(n > 256u - (s & 0xff)) n = 256 - (s & 0xff);
+		if(opc == XFER_TIA && (dst & 0xff) == 0xff) return 0;
+		if(!wd) {
+			/* typically the VDC data port, each byte goes to the device */
+			if(!cpu->io_write) return n;
+			for(k = 0; k < n; ++k) {
+				cpu->io_write(cpu, rs + k, xfer_dst(opc, dst, i + k), 1);
+#ifdef CPU_BUS_CYCLES
+				cpu->bus_cycle += 6;
+#endif
+			}
+			return n;
+		}
+		/* plain memory only keeps the last byte written to each address,
+		   unless the destination is read again */
+		wd += (d & 0xff) - (opc == XFER_TIA ? (i & 1) : 0);
+		if(wd + 1 >= rs && wd < rs + n) return 0;
+		for(k = n < 2 ? n : 2; k; --k) {
+			p = opc == XFER_TIA ? wd + ((i + n - k) & 1) : wd;
+			*p = rs[n - k];
+		}
+		code_inval(cpu, (u16)(d - (opc == XFER_TIA ? (i & 1) : 0)), 2);
+		SNAP_DIRTY(d);
+		return n;
+	case XFER_TAI:
+		if((src & 0xff) == 0xff || !wd) return 0;
+		rs -= i & 1;
+		wd += d & 0xff;
+		if(n > 256u - (d & 0xff)) n = 256 - (d & 0xff);
+		/* stop before overwriting the source */
+		if(rs + 1 >= wd && rs < wd + n) n = rs > wd ? rs - wd : 0;
+		for(k = 0; k < n; ++k) wd[k] = rs[(i + k) & 1];
+		if(n) {
+			code_inval(cpu, d, n);
+			SNAP_DIRTY(d);
+		}
+		return n;
+	}
+	return 0;
+}
+#endif
+
+/* runs a block transfer of len bytes. plain memory is copied or filled in
+   bulk with CPU_MEMMAP, everything else goes through CPU_READ_N and
+   CPU_WRITE_N a byte at a time. the caller adds the cycles. */
+static void huc_xfer(struct cpu65 *cpu, u8 opc, u16 src, u16 dst, unsigned len) {
+	unsigned i = 0;
+	uint64_t t = 0;
+	u16 d;
+	u8 b;
+#ifdef CPU_BUS_CYCLES
+	t = cpu->bus_cycle + 17;
+#endif
+	while(i < len) {
+#ifdef CPU_MEMMAP
+		unsigned n;
+#ifdef CPU_BUS_CYCLES
+		cpu->bus_cycle = t + 6 * i + 5;
+#endif
+		if((n = xfer_fast(cpu, opc, src, dst, i, len))) {
+			i += n;
+			continue;
+		}
+#endif
+		d = xfer_dst(opc, dst, i);
+#ifdef CPU_BUS_CYCLES
+		cpu->bus_cycle = t + 6 * i + 2;
+#endif
+		ACC_READ(xfer_src(opc, src, i), 1, CPU65_COV_READ);
+		CPU_READ_N(&b, xfer_src(opc, src, i), 1);
+#ifdef CPU_BUS_CYCLES
+		cpu->bus_cycle = t + 6 * i + 5;
+#endif
+		CPU_WRITE_N(&b, d, 1);
+		CODE_WRITTEN(d);
+		++i;
+	}
+	(void) cpu;
+	(void) t;
+}
+
+/* ST0-2 write to the VDC at $1fe000, $1fe002 and $1fe003, whatever the
+   MPRs hold. with CPU_MEMMAP they go to bank $ff: to its memory if it
+   has some, else to io_write, called with the address in slot 0 while
+   MPR0 reads $ff, so cpu65_phys() gives the physical one. without
+   CPU_MEMMAP, define CPU_VDC_WRITE(N, V) to get them, N being 0-2,
+   they're dropped otherwise. */
+#define VDC_ADDR(N) ((N) ? (N) + 1 : 0)
+#ifdef CPU_MEMMAP
+static void vdc_write(struct cpu65 *cpu, unsigned n, u8 v) {
+	unsigned a = VDC_ADDR(n), s;
+	u8 m0;
+	if(cpu->bank_w[0xff]) {
+		cpu->bank_w[0xff][a] = v;
+		for(s = 0; s < 8; ++s) if(cpu->mpr[s] == 0xff) CODE_WRITTEN(s << 13 | a);
+	} else if(cpu->io_write) {
+		m0 = cpu->mpr[0];
+		cpu->mpr[0] = 0xff;
+		cpu->io_write(cpu, &v, a, 1);
+		cpu->mpr[0] = m0;
+	}
+}
+#define VDC_WRITE(N, V) vdc_write(cpu, N, V)
+#elif defined(CPU_VDC_WRITE)
+#define VDC_WRITE(N, V) CPU_VDC_WRITE(N, V)
+#else
+#define VDC_WRITE(N, V) do{}while(0)
+#endif
+#endif
+
 /* get 16 bit value into addr, depending on address mode */
 #define GET_W(AM) \
 	switch(AM) { \
 	case am_abs:	addr = MAKELE16(op.pw[0]); break; \
 	case am_abi:	addr = MAKELE16(op.pw[0]); \
-			CPU_READ_N(&addr, addr, 2); \
+			PTR_READ_N(&addr, addr, 2); \
 			addr = MAKELE16(addr); break; \
 	case am_abix:	addr = MAKELE16(op.pw[0]) + X; \
-			CPU_READ_N(&addr, addr, 2); \
+			PTR_READ_N(&addr, addr, 2); \
 			addr = MAKELE16(addr); break; \
 	}
 
 /* get 16 bit value into addr from zeropage
    the second byte of the address might wrap around if N == 0xff */
-#define GET_W_ZP(N) addr = cpu->zp[(N)] | (cpu->zp[((N)+1)&0xff] << 8)
+#define GET_W_ZP(N) ZP_PTR_READ(N); ZP_PTR_READ(((N)+1)&0xff); \
+	addr = cpu->zp[(N)] | (cpu->zp[((N)+1)&0xff] << 8)
 //#define GET_W_ZP(N) memcpy(&addr, cpu->zp+(N), 2); addr = MAKELE16(addr)
 
+#define GET_M_ZP(N) do { m = &cpu->zp[(N)]; if(!opst) ZP_READ(N); } while(0)
+
 #define GET_M(AM) \
 	switch(AM) { \
 	case am_imp1:  abort() ;break; \
 	case am_imp2:  abort() ;break; \
 	case am_imp3:  abort() ;break; \
 	case am_imm:   m = &op.pb[0]; break; \
-	case am_zp:    m = &cpu->zp[op.pb[0]]; break; \
-	case am_zpx:   m = &cpu->zp[(op.pb[0] + X)&0xff]; break; \
-	case am_zpy:   m = &cpu->zp[(op.pb[0] + Y)&0xff]; break; \
+	case am_zp:    GET_M_ZP(op.pb[0]); break; \
+	case am_zpx:   GET_M_ZP((op.pb[0] + X)&0xff); break; \
+	case am_zpy:   GET_M_ZP((op.pb[0] + Y)&0xff); break; \
 	case am_zprel: abort() ; break; \
 	case am_ind:	GET_W_ZP(op.pb[0]); \
-			m = &op.pb[4]; CPU_READ_N(m, addr, 1); break; \
+			m = &op.pb[4]; MEM_READ_N(m, addr, 1); break; \
 	case am_izx:	GET_W_ZP((op.pb[0] + X)&0xff); \
-			m = &op.pb[4]; CPU_READ_N(m, addr, 1); break; \
+			m = &op.pb[4]; MEM_READ_N(m, addr, 1); break; \
 	case am_izy:	GET_W_ZP(op.pb[0]); \
-			if(pcp && ((addr + Y)^addr)>0xff) ADDCYC(pcp); \
+			if(pcp && ((addr + Y)^addr)>0xff) { ADDCYC(pcp); PROF_PCROSS(); } \
 			addr += Y; \
-			m = &op.pb[4]; CPU_READ_N(m, addr, 1); break; \
+			m = &op.pb[4]; MEM_READ_N(m, addr, 1); break; \
 	case am_abs:	GET_W(am); \
-			m = &op.pb[4]; CPU_READ_N(m, addr, 1); break; \
+			m = &op.pb[4]; MEM_READ_N(m, addr, 1); break; \
 	case am_abx:	addr=MAKELE16(op.pw[0]); \
-			if(pcp && ((addr + X)^addr)>0xff) ADDCYC(pcp); \
+			if(pcp && ((addr + X)^addr)>0xff) { ADDCYC(pcp); PROF_PCROSS(); } \
 			addr += X; \
-			m = &op.pb[4]; CPU_READ_N(m, addr, 1); break; \
+			m = &op.pb[4]; MEM_READ_N(m, addr, 1); break; \
 	case am_aby:	addr=MAKELE16(op.pw[0]); \
-			if(pcp && ((addr + Y)^addr)>0xff) ADDCYC(pcp); \
+			if(pcp && ((addr + Y)^addr)>0xff) { ADDCYC(pcp); PROF_PCROSS(); } \
 			addr += Y; \
-			m = &op.pb[4]; CPU_READ_N(m, addr, 1); break; \
+			m = &op.pb[4]; MEM_READ_N(m, addr, 1); break; \
 	case am_abi:	addr=MAKELE16(op.pw[0]); \
-			m = &op.pb[4]; CPU_READ_N(m, addr, 2); \
+			m = &op.pb[4]; PTR_READ_N(m, addr, 2); \
 			addr=MAKELE16(op.pw[1]); \
-			CPU_READ_N(m, addr, 2); break; \
+			MEM_READ_N(m, addr, 2); break; \
 	case am_abix: abort() ;break; \
 	case am_rel: abort() ;break; \
-	case am_immzp: m = &cpu->zp[op.pb[1]]; break; \
-	case am_immzx: m = &cpu->zp[(op.pb[1] + X) & 0xff]; break; \
-	case am_immab: abort() ;break; \
-	case am_immax: abort() ;break; \
+	case am_immzp: GET_M_ZP(op.pb[1]); break; \
+	case am_immzx: GET_M_ZP((op.pb[1] + X) & 0xff); break; \
+	case am_immab:	addr = op.pb[1] | (op.pb[2] << 8); \
+			m = &op.pb[4]; MEM_READ_N(m, addr, 1); break; \
+	case am_immax:	addr = (op.pb[1] | (op.pb[2] << 8)) + X; \
+			m = &op.pb[4]; MEM_READ_N(m, addr, 1); break; \
 	case am_acc: m = &A; break; \
 	}
 
@@ -281,12 +1552,13 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 	case am_abx: \
 	case am_aby: \
 	case am_abs: \
-		*m = VAL; CPU_WRITE_N(m, addr, 1); break; \
+		*m = VAL; MEM_WRITE_N(m, addr, 1); break; \
 	case am_acc: \
+		*m = VAL; break; \
 	case am_zp: \
 	case am_zpx: \
 	case am_zpy: \
-		*m = VAL; break; \
+		*m = VAL; ZP_WRITTEN(m - cpu->zp); break; \
 	default: abort(); \
 	}
 #if 0
@@ -311,15 +1583,20 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 #define COND_BR8P(COND, TARGET, PENALTY) \
 			do { if(!(COND)) break; \
 			unsigned pcn = PC + (signed char) TARGET; \
+			IDLE_LOOP(PC, pcn); \
+			PROF_TAKEN(); \
 			ADDCYC(PENALTY); \
 			ADDCYC((pcp && ((pcn&0xff00) != (PC&0xff00))) ?pcp:0); \
+			if(pcp && ((pcn&0xff00) != (PC&0xff00))) PROF_PCROSS(); \
 			PC = pcn; } while(0)
 #define COND_BR8(COND, TARGET) \
 			COND_BR8P(COND, TARGET, BR_PENALTY)
 
-#define PUSH(VAL)	cpu->stack[cpu->s--] = VAL
-#define POP()		cpu->stack[++cpu->s]
-#define SET_ZN(VAL)	do {Z = (VAL == 0) ; N =!!(VAL & 0x80);} while (0)
+#define PUSH(VAL)	do { STACK_WRITTEN(cpu->s); cpu->stack[cpu->s--] = VAL; } while(0)
+#define POP()		(ACC_READ(ZP_BASE + 0x100 + (u8)(cpu->s + 1), 1, CPU65_COV_READ), cpu->stack[++cpu->s])
+#define SET_N(VAL)	cpu->f_n = (VAL)
+#define SET_Z(VAL)	cpu->f_z = (VAL)
+#define SET_ZN(VAL)	do { cpu->f_z = cpu->f_n = (VAL); } while (0)
 /* http://www.6502.org/tutorials/vflag.html :
  As stated above, the second purpose of the carry flag is to indicate when the
  result of the addition or subtraction is outside the range 0 to 255,
@@ -337,14 +1614,14 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 #define LOAD(VAL)	GET_M(am); VAL = M; SET_ZN(VAL)
 
 #define OP_ADC()	GET_M(am); tmp = A + M + C; \
-			if(BCD && D) { if(CPU_TYPE <= CPU_TYPE_6502) Z = ((u8)tmp == 0); \
+			if(BCD && D) { if(CPU_TYPE <= CPU_TYPE_6502) SET_Z(tmp); \
 			if (((A & 0xf) + (M & 0xf) + C) > 9) tmp += 6; \
 			V = !((A ^ M) & 0x80) && ((A ^ tmp) & 0x80); \
-			if(CPU_TYPE <= CPU_TYPE_6502) N = !!(tmp & 0x80); \
+			if(CPU_TYPE <= CPU_TYPE_6502) SET_N(tmp); \
 			else /* N = (tmp >= 0x120) */ ; \
 			if (tmp > 0x99) tmp += 96; \
 			C = tmp>0x99; A = tmp; \
-			if(CPU_TYPE > CPU_TYPE_6502) { Z = (A==0); N = !!(A & 0x80); }\
+			if(CPU_TYPE > CPU_TYPE_6502) SET_ZN(A); \
 			} else { \
 			V = !((A ^ M) & 0x80) && ((A ^ tmp) & 0x80); \
 			C = tmp>0xff; A = tmp; SET_ZN(A); }
@@ -358,8 +1635,8 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 #define OP_ASL()	GET_M(am); C = !!(M & 0x80); tmp = M << 1; \
 			SET_M(am, tmp); SET_ZN(M)
 #define OP_AXS()	GET_M(am); tmp = A & X ; SET_M(am, tmp)
-#define OP_BBR(BIT)	COND_BR8(!(cpu->zp[op.pb[0]] & (1 << BIT)), op.pb[1])
-#define OP_BBS(BIT)	COND_BR8(cpu->zp[op.pb[0]] & (1 << BIT), op.pb[1])
+#define OP_BBR(BIT)	ZP_READ(op.pb[0]); COND_BR8(!(cpu->zp[op.pb[0]] & (1 << BIT)), op.pb[1])
+#define OP_BBS(BIT)	ZP_READ(op.pb[0]); COND_BR8(cpu->zp[op.pb[0]] & (1 << BIT), op.pb[1])
 #define OP_BCC()	COND_BR8(!C, op.pb[0])
 #define OP_BCS()	COND_BR8(C, op.pb[0])
 #define OP_BEQ()	COND_BR8(Z, op.pb[0])
@@ -367,26 +1644,34 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 			   http://www.6502.org/tutorials/65c02opcodes.html
 			   this might be different on HuC6280, official doc
 			   doesn't mention anything being different for imm */
-#define OP_BIT()	GET_M(am); tmp = A & M; Z=(tmp == 0); \
-			if(am != am_imm) {N=!!(M & 0x80); V=!!(M & 0x40);}
+#define OP_BIT()	GET_M(am); SET_Z(A & M); \
+			if(am != am_imm) {SET_N(M); V=!!(M & 0x40);}
 #define OP_BMI()	COND_BR8(N, op.pb[0])
 #define OP_BNE()	COND_BR8(!Z, op.pb[0])
 #define OP_BPL()	COND_BR8(!N, op.pb[0])
 #define OP_BRA()	COND_BR8P(1, op.pb[0], 0)
-#define OP_BRK()	++PC; PUSH(cpu->pch); PUSH(cpu->pcl); \
+#define OP_BRK()	IDLE_RESET(); ++PC; PUSH(cpu->pch); PUSH(cpu->pcl); \
 			PUSH(pack_flags(cpu)|B_FLAG); \
-			CPU_READ_N(&op.pb[0], INT_VEC, 2); \
-			PC = MAKELE16(op.pw[0]); T = T_INIT; I = 1; B = 1; \
+			PTR_READ_N(&op.pb[0], INT_VEC, 2); \
+			PC = MAKELE16(op.pw[0]); T = T_INIT; I = 1; B = 1; PROF_CALL(); \
 			if(!(INT_MASK & D_FLAG)) D = 0
+#define OP_BSR()	IDLE_RESET(); --PC; PUSH(cpu->pch); PUSH(cpu->pcl); \
+			PC += 1 + (signed char) op.pb[0]; PROF_CALL()
 #define OP_BVC()	COND_BR8(!V, op.pb[0])
 #define OP_BVS()	COND_BR8(V, op.pb[0])
+#define OP_CLA()	A = 0
 #define OP_CLC()	C = 0
 #define OP_CLD()	D = 0
-#define OP_CLI()	I = 0
+#define OP_CLI()	I = 0; INT_POLL_NEXT()
 #define OP_CLV()	V = 0
+#define OP_CLX()	X = 0
+#define OP_CLY()	Y = 0
 #define OP_CMP()	CMP(A)
 #define OP_CPX()	CMP(X)
 #define OP_CPY()	CMP(Y)
+/* the speed only matters to whoever turns cycles into time */
+#define OP_CSH()	cpu->speed = 1
+#define OP_CSL()	cpu->speed = 0
 #define OP_DCP()	GET_M(am); tmp = M-1; SET_M(am, tmp); tmp = A - M; SET_ZN(tmp); \
                         C=((int)tmp >= 0)
 #define OP_DEC()	GET_M(am); tmp = M - 1; SET_M(am, tmp); SET_ZN(M)
@@ -399,12 +1684,14 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 #define OP_ISC()	OP_INC(); OP_SBC()
 #define OP_JMP()	if(CPU_TYPE <= CPU_TYPE_6502 && am == am_abi && op.pb[0] == 0xff) { \
 			/* emulate nmos 6502 jump bug */ \
-			CPU_READ_N(&op.pb[4], (op.pb[1] << 8) | 0xff, 1); \
-			CPU_READ_N(&op.pb[5], (op.pb[1] << 8) | 0x00, 1); \
-			PC = MAKELE16(op.pw[2]); \
-			} else { GET_W(am); PC = addr; }
-#define OP_JSR()	--PC; PUSH(cpu->pch); PUSH(cpu->pcl); PC = MAKELE16(op.pw[0])
-#define OP_KIL()	cpu->cs = cs_jammed; goto done
+			PTR_READ_N(&op.pb[4], (op.pb[1] << 8) | 0xff, 1); \
+			PTR_READ_N(&op.pb[5], (op.pb[1] << 8) | 0x00, 1); \
+			PC = MAKELE16(op.pw[2]); IDLE_RESET(); \
+			} else { GET_W(am); \
+			if(am == am_abs) IDLE_LOOP(PC, addr); else IDLE_RESET(); \
+			PC = addr; }
+#define OP_JSR()	IDLE_RESET(); --PC; PUSH(cpu->pch); PUSH(cpu->pcl); PC = MAKELE16(op.pw[0]); PROF_CALL()
+#define OP_KIL()	cpu->cs = cs_jammed; DONE()
 #define OP_LAS()	GET_M(am); cpu->s &= M; A = X = cpu->s; SET_ZN(A)
 #define OP_LAX()	GET_M(am); A = X = M; SET_ZN(A)
 #define OP_LDA()	LOAD(A)
@@ -415,25 +1702,25 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 #define OP_LXA()	GET_M(am); A |= 0xff; A &= M; X = A; SET_ZN(A)
 #define OP_NOP()	if(am == am_abx && pcp) { \
 			addr=MAKELE16(op.pw[0]); \
-			if(((addr + X)^addr)>0xff) ADDCYC(pcp); }
+			if(((addr + X)^addr)>0xff) { ADDCYC(pcp); PROF_PCROSS(); } }
 #define OP_ORA()	GET_M(am); A |= M; SET_ZN(A)
 #define OP_PHA()	PUSH(A)
 #define OP_PHP()	PUSH(pack_flags(cpu))
 #define OP_PHX()	PUSH(X)
 #define OP_PHY()	PUSH(Y)
 #define OP_PLA()	A = POP() ; SET_ZN(A)
-#define OP_PLP()	unpack_flags(cpu, POP() & PLP_MASK)
+#define OP_PLP()	unpack_flags(cpu, POP() & PLP_MASK); INT_POLL_NEXT()
 #define OP_PLX()	X = POP() ; SET_ZN(X)
 #define OP_PLY()	Y = POP() ; SET_ZN(Y)
-#define OP_RMB(BIT)	cpu->zp[op.pb[0]] &= ~(1 << BIT)
+#define OP_RMB(BIT)	ZP_READ(op.pb[0]); cpu->zp[op.pb[0]] &= ~(1 << BIT); ZP_WRITTEN(op.pb[0])
 #define OP_RLA()	OP_ROL(); OP_AND()
 #define OP_ROL()	GET_M(am); tmp = C; C = !!(M & 0x80); tmp |= (M << 1); \
 			SET_M(am, tmp); SET_ZN(M)
 #define OP_ROR()	GET_M(am); tmp2 = M & 1; tmp = (C << 7) | (M >> 1); \
 			SET_M(am, tmp); C = tmp2; SET_ZN(M)
 #define OP_RRA()	OP_ROR(); OP_ADC()
-#define OP_RTI()	unpack_flags(cpu, POP()); cpu->pcl = POP(); cpu->pch = POP()
-#define OP_RTS()	cpu->pcl = POP(); cpu->pch = POP(); ++PC;
+#define OP_RTI()	IDLE_RESET(); unpack_flags(cpu, POP()); cpu->pcl = POP(); cpu->pch = POP(); PROF_RET(); INT_POLL()
+#define OP_RTS()	IDLE_RESET(); cpu->pcl = POP(); cpu->pch = POP(); ++PC; PROF_RET()
 /* these 2 are the OFFICIAL HUC6280 opcodes, not the undocumented 6502 ones,
    we call the latter AXS and SHY */
 #define OP_SAX()	tmp = A; A = X; X = tmp
@@ -445,7 +1732,7 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 			if(CPU_TYPE <= CPU_TYPE_6502) SET_ZN((u8)tmp); \
 			if (((A & 0xf) - (!C)) < (M & 0xf)) tmp -= 6; \
 			if (tmp > 0x99) tmp -= 0x60; \
-			if(CPU_TYPE > CPU_TYPE_6502) { Z = ((u8)tmp==0); N = !!((u8)tmp & 0x80); } \
+			if(CPU_TYPE > CPU_TYPE_6502) SET_ZN(tmp); \
 			} \
 			C = ((int)tmp >= 0); A = tmp
 /* special case AXS variant with immediate */
@@ -459,41 +1746,57 @@ static inline void unpack_flags(struct cpu65 *cpu, u8 f) {
 			op.pb[2] = D_XY & (op.pb[1]+1); \
 			addr = (op.pb[0] + A_XY)&0xff; \
 			addr |= op.pb[2] << 8; \
-			CPU_WRITE_N(&op.pb[2], addr, 1)
+			MEM_WRITE_N(&op.pb[2], addr, 1)
 #define OP_SHY()	SHY_SHX(X, Y)
 #define OP_SHX()	SHY_SHX(Y, X)
 #define OP_SLO()	GET_M(am); C = !!(M & 0x80); tmp = M << 1; \
                         SET_M(am, tmp); A |= M; SET_ZN(A)
-#define OP_SMB(BIT)	cpu->zp[op.pb[0]] |= (1 << BIT)
+#define OP_SMB(BIT)	ZP_READ(op.pb[0]); cpu->zp[op.pb[0]] |= (1 << BIT); ZP_WRITTEN(op.pb[0])
 #define OP_SRE()	OP_LSR(); OP_EOR()
+/* ST0-2, see VDC_WRITE */
+#define OP_ST(N)	BUS_AT(opcyc - 1); VDC_WRITE(N, op.pb[0]); BUS_POLL()
 #define OP_STA()	GET_M(am); SET_M(am, A)
-#define OP_STP()	cpu->cs = cs_stopped; goto done // this stops the cpu, and needs a reset
+#define OP_STP()	cpu->cs = cs_stopped; DONE() // this stops the cpu, and needs a reset
 #define OP_STX()	GET_M(am); SET_M(am, X)
 #define OP_STY()	GET_M(am); SET_M(am, Y)
 #define OP_STZ()	GET_M(am); SET_M(am, 0)
 #define OP_SXY()	tmp = X; X = Y; Y = tmp
+/* a length of 0 means 64K. the cycles per byte come on top of the table's. */
+#define XFER(OPC)	tmp = MAKELE16(op.pw[2]); if(!tmp) tmp = 0x10000; BUS_AT(0); \
+			huc_xfer(cpu, OPC, MAKELE16(op.pw[0]), MAKELE16(op.pw[1]), tmp); \
+			ADDCYC(6 * tmp); INT_POLL()
+#define OP_TAI()	XFER(XFER_TAI)
+#define OP_TAM()	mpr_write(cpu, op.pb[0], A)
 #define OP_TAS()	GET_M(am); cpu->s = A & X; tmp = cpu->s & ((addr >> 8)+1); \
 			SET_M(am, tmp)
 #define OP_TAX()	X = A; SET_ZN(A)
 #define OP_TAY()	Y = A; SET_ZN(A)
-#define OP_TRB()	GET_M(am); tmp = (~A) & M; Z = (!(A & M)); SET_M(am, tmp)
+#define OP_TDD()	XFER(XFER_TDD)
+#define OP_TIA()	XFER(XFER_TIA)
+#define OP_TII()	XFER(XFER_TII)
+#define OP_TIN()	XFER(XFER_TIN)
+/* with more than one bit set, the MPRs are ORed together */
+#define OP_TMA()	A = 0; for(tmp = 0; tmp < 8; ++tmp) \
+			if(op.pb[0] & (1 << tmp)) A |= cpu->mpr[tmp]
+#define OP_TRB()	GET_M(am); tmp = (~A) & M; SET_Z(A & M); SET_M(am, tmp)
 			/* warning: the documentation of HuC6280 states quite
 			   different behaviour than 65c02 - memory is NOT written
 			   back, V & M are set from "memory" - before or after
 			   the operation is unclear, and Z is supposedly set from
 			   tmp - which makes more sense than 65c02 behaviour. */
-#define OP_TRB_HUCXXX()	GET_M(am); tmp = (~A) & M; N = !!(tmp & 0x80); \
-			V = !!(tmp & 0x40); Z = (tmp == 0)
+#define OP_TRB_HUCXXX()	GET_M(am); tmp = (~A) & M; SET_ZN(tmp); \
+			V = !!(tmp & 0x40)
 			/* in this case, the huc documentation says the value
 			   IS stored in memory, but VN are set from memory,
 			   additionally to what 65c02 does; Z behaviour isn't
 			   explained. */
-#define OP_TSB()	GET_M(am); tmp = A | M ; Z = (!(A & M)); SET_M(am, tmp)
+#define OP_TSB()	GET_M(am); tmp = A | M ; SET_Z(A & M); SET_M(am, tmp)
+#define OP_TST()	GET_M(am); SET_Z(op.pb[0] & M); SET_N(M); V = !!(M & 0x40)
 #define OP_TSX()	X = cpu->s; SET_ZN(X)
 #define OP_TXA()	A = X; SET_ZN(A)
 #define OP_TXS()	cpu->s = X
 #define OP_TYA()	A = Y; SET_ZN(A)
-#define OP_WAI()	cpu->cs = cs_waiting; goto done // wait for interrupt
+#define OP_WAI()	cpu->cs = cs_waiting; SLICED() // wait for interrupt
 #define OP_XAA()	GET_M(am); A = X & M; SET_ZN(A)
 
 #ifdef CPU_DEBUG
@@ -528,52 +1831,321 @@ char *trace_fmt(enum address_mode am, u8 p[]) {
 }
 #endif
 
+#ifdef CPU_TRACE
+/* binary execution trace. with CPU_TRACE, every instruction run by the
+   interpreter appends a record to a ring owned by the instance, while
+   cpu65_trace_read() fetches them, also from another thread. records are
+   in host byte order, tracedec.py turns a file of them into the text
+   CPU_DEBUG prints. instructions run as JIT blocks aren't recorded, lanes
+   run the instance by cpu65_exec() while it's tracing. */
+struct cpu65_trace_rec {
+	uint64_t cycle; /* cycles at the start of the instruction */
+	u16 pc;
+	u16 ea; /* effective address going by the registers before the
+		   instruction; the pointer for (abs) and (abs, x), the target
+		   for relative branches, 0 if there's none */
+	u8 ob[7]; /* opcode and operand bytes */
+	u8 a, x, y, s, p;
+};
+
+struct cpu65_trace {
+	uint64_t head; /* records written so far */
+	unsigned mask;
+	struct cpu65_trace_rec rec[];
+};
+
+/* start tracing into a ring of n records, n being a power of 2.
+   returns 0 on success, -1 if out of memory or n is no power of 2. */
+int cpu65_trace_init(struct cpu65 *cpu, unsigned n) {
+	if(cpu->trace) return 0;
+	if(!n || (n & (n - 1))) return -1;
+	if(!(cpu->trace = calloc(1, sizeof *cpu->trace + n * sizeof *cpu->trace->rec))) return -1;
+	cpu->trace->mask = n - 1;
+	return 0;
+}
+
+void cpu65_trace_free(struct cpu65 *cpu) {
+	free(cpu->trace);
+	cpu->trace = 0;
+}
+
+static inline u16 trace_ea(struct cpu65 *cpu, enum address_mode am, const u8 *p) {
+	u8 *zp = cpu->zp;
+	switch(am) {
+	case am_zp:
+	case am_zprel: return ZP_BASE | p[0];
+	case am_zpx: return ZP_BASE | (u8)(p[0] + cpu->x);
+	case am_zpy: return ZP_BASE | (u8)(p[0] + cpu->y);
+	case am_immzp: return ZP_BASE | p[1];
+	case am_immzx: return ZP_BASE | (u8)(p[1] + cpu->x);
+	case am_ind: return zp[p[0]] | zp[(u8)(p[0] + 1)] << 8;
+	case am_izx: return zp[(u8)(p[0] + cpu->x)] | zp[(u8)(p[0] + cpu->x + 1)] << 8;
+	case am_izy: return (zp[p[0]] | zp[(u8)(p[0] + 1)] << 8) + cpu->y;
+	case am_abs:
+	case am_abi: return p[0] | p[1] << 8;
+	case am_abx:
+	case am_abix: return (p[0] | p[1] << 8) + cpu->x;
+	case am_aby: return (p[0] | p[1] << 8) + cpu->y;
+	case am_immab: return p[1] | p[2] << 8;
+	case am_immax: return (p[1] | p[2] << 8) + cpu->x;
+	case am_rel: return cpu->pc + 2 + (signed char) p[0];
+	default: return 0;
+	}
+}
+
+/* ob is the opcode followed by the operand bytes */
+static inline void trace_push(struct cpu65 *cpu, enum address_mode am, const u8 *ob, uint64_t cycle) {
+	struct cpu65_trace *t = cpu->trace;
+	struct cpu65_trace_rec *r = &t->rec[t->head & t->mask];
+	/* the slot holds the oldest record, readers only skip it once they
+	   see the previous head. keep the stores below from passing that
+	   one, which weakly ordered hosts would otherwise allow. on x86 this
+	   costs nothing. */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	r->cycle = cycle;
+	r->pc = cpu->pc;
+	r->ea = trace_ea(cpu, am, ob + 1);
+	memcpy(r->ob, ob, sizeof r->ob);
+	r->a = cpu->a;
+	r->x = cpu->x;
+	r->y = cpu->y;
+	r->s = cpu->s;
+	r->p = pack_flags(cpu);
+	/* the record is complete before readers see it */
+	__atomic_store_n(&t->head, t->head + 1, __ATOMIC_RELEASE);
+}
+
+/* copies up to n records to dst, starting with record number *pos (the
+   first one recorded being 0), and advances *pos past them. records
+   already overwritten are skipped, so *pos may advance further than
+   the number returned. a *pos past the last record, e.g. from before
+   cpu65_trace_init() started over, is moved back to its end. to be
+   called by one thread per pos; this is safe while cpu65_exec() runs.
+   returns the number of records copied. */
+size_t cpu65_trace_read(struct cpu65 *cpu, uint64_t *pos, struct cpu65_trace_rec *dst, size_t n) {
+	struct cpu65_trace *t = cpu->trace;
+	uint64_t h, first;
+	size_t i;
+	if(!t) return 0;
+	/* the slot of record h-mask-1 may be overwritten right now */
+	h = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+	first = h > t->mask ? h - t->mask : 0;
+	if(*pos < first) *pos = first;
+	if(*pos > h) *pos = h;
+	if(n > h - *pos) n = h - *pos;
+	for(i = 0; i < n; ++i) dst[i] = t->rec[(*pos + i) & t->mask];
+	/* drop what was overwritten while copying */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	h = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+	first = h > t->mask ? h - t->mask : 0;
+	if(*pos < first) {
+		i = first - *pos;
+		if(i > n) i = n;
+		memmove(dst, dst + i, (n - i) * sizeof *dst);
+		n -= i;
+		*pos = first;
+	}
+	*pos += n;
+	return n;
+}
+#endif
+
+/* the interpreter runs in slices, ending at limit: mincycles or the next
+   event, whichever comes first. interrupts are taken between slices. */
 #ifdef CPU_NO_COUNT_CYCLES
 #define CHKDONE() do{}while(0)
 #define ADDCYC(X) do{}while(0)
+#define JIT_FITS(B) 1
+#define JIT_CHKDONE() do{}while(0)
+#define INT_POLL() do{}while(0)
+#define INT_POLL_NEXT() do{}while(0)
+#define BUS_POLL() do{}while(0)
 #else
-#define CHKDONE() if (cyc >= mincycles) break;
+#define CHKDONE() if (cyc >= limit) SLICED();
 #define ADDCYC(X) do { cyc+=(X); } while(0)
+/* a block may only run if the interpreter wouldn't have stopped in it */
+#define JIT_FITS(B) (cyc + (B)->guard < limit)
+#define JIT_CHKDONE() if (cyc >= limit) SLICED()
+/* ends the slice after the current instruction if an interrupt became
+   pending, e.g. due to a store to a device register. */
+#define INT_POLL() do { if(cpu->int_req || (cpu->irq && !I)) limit = cyc; } while(0)
+/* the same for CLI and PLP, which clear I too late for the irq to be
+   taken right after them, the 6502 runs one more instruction first. that
+   one takes at least 2 cycles, so the slice ends after it. */
+#define INT_POLL_NEXT() do { if(cpu->irq && !I && limit > cyc + opcyc + 1) \
+	limit = cyc + opcyc + 1; } while(0)
+/* the same after accesses through CPU_READ_N and CPU_WRITE_N, whose
+   callbacks may also have scheduled an event before limit. */
+#define BUS_POLL() do { INT_POLL(); \
+	if(cpu->nevents && cpu->events[0].when < base + limit) \
+		limit = cpu->events[0].when > base + cyc ? cpu->events[0].when - base : cyc; } while(0)
 #endif
 
-unsigned cpu65_exec(struct cpu65 *cpu, unsigned mincycles) {
-	struct {
-		u8 align; // needed for alignment of 16 bit params
-		u8 op;  // op, followed by up to 6 parameter bytes on HuC.
-		union {
-			u8  pb[6];
-			u16 pw[3];
-		};
-		u8 pad; // needed so we can access &op.op using a word-sized memcpy
-	} op;
-	u8 *m; // points to the memory operand of address mode
-	u16 addr; // temporary storage of address needed more than once.
-	//enum address_mode am;
-	unsigned cyc = 0; //unsigned tmp, tmp2;
-
-#define OPDEF(N, L)  [N] = &&lab_ ## L
-	static void *opdisp[256] = {
-		#include "optbl.h"
-	};
-#undef OPDEF
+#ifdef CPU_IDLE_SKIP
+/* idle loop skipping. when a short backward branch or jmp abs closes a loop
+   with the registers and flags the same as at its previous iteration, and
+   the loop only changes registers and flags, every further iteration will
+   do the same, until something it reads changes. so whole iterations are
+   skipped up to the end of the slice, i.e. the next event or mincycles.
+   the cycles are the same as if they had run.
+   this assumes that what the loop reads from i/o only changes with
+   scheduled events, so enable it per cpu by setting cpu->idle_skip only
+   if the devices work that way, e.g. schedule an event for vblank rather
+   than deriving the status from the cycle count. the cycles skipped are
+   counted in cpu->idle_skipped.
+   taken branches and jumps backward that aren't candidates, and control
+   flow that isn't checked, like jsr and rts, forget the previous iteration.
+   so the body can only be entered from its start in between, and is
+   decoded from there to check it. */
+#ifdef CPU_NO_COUNT_CYCLES
+#error CPU_IDLE_SKIP needs cycles to be counted
+#endif
+/* bytes from the start of a loop to the end of its closing branch */
+#ifndef CPU_IDLE_MAX_LEN
+#define CPU_IDLE_MAX_LEN 32
+#elif CPU_IDLE_MAX_LEN > 64
+#error CPU_IDLE_MAX_LEN can be 64 at most
+#endif
+#define IDLE_REL 0x10
+#define IDLE_JMP 0x20
+/* the previous iteration. fp is -1 if there is none */
+struct idle_rec {
+	uint64_t fp;
+	unsigned cyc;
+	u16 end;
+};
+#define IDLE_FP() ((uint64_t) pack_flags(cpu) << 32 | (uint32_t) A << 24 | \
+	X << 16 | Y << 8 | cpu->s)
+#define IDLE_RESET() IDLE_REC.fp = (uint64_t) -1
+/* END is the pc after the branch or jump, T its target */
+#define IDLE_LOOP(END, T) do { if(cpu->idle_skip) { u16 e_ = (END), t_ = (T); \
+	if((u16)(e_ - t_ - 1) < CPU_IDLE_MAX_LEN) \
+		cyc = CORE(idle_loop)(cpu, &IDLE_REC, t_, e_, cyc, limit); \
+	else if(t_ < e_) IDLE_RESET(); } } while(0)
+#else
+#define IDLE_RESET() do{}while(0)
+#define IDLE_LOOP(END, T) do{}while(0)
+#endif
 
-#ifdef CPU_DEBUG
-#define TRACE(INSN, AM) if(cpu->trace_print) { char trbuf[128]; \
-	sprintf(trbuf, \
-	"PC:%04x S:%02x A:%02x X:%02x Y:%02x %c%c%c%c%c%c%c%c O:%02x %s%s", \
-	PC, cpu->s, A, X, Y, \
-	cpu->f_n?'N':'n', cpu->f_v?'V':'v', cpu->f_t?'T':'t', cpu->f_b?'B':'b', \
-	cpu->f_d?'D':'d', cpu->f_i?'I':'i', cpu->f_z?'Z':'z', cpu->f_c?'C':'c', \
-	op.op, INSN, trace_fmt(AM, op.pb)); cpu->trace_print(cpu, trbuf); }
+#ifdef CPU_PROFILE
+#include "profile.c"
 #else
-#define TRACE(INSN, AM)
+#define PROF_INSN(AM)
+#define PROF_FLUSH() do{}while(0)
+#define PROF_INT(C, RST) ((void) (RST), (C))
+#define PROF_WAIT(C) do{}while(0)
+#define PROF_CALL() do{}while(0)
+#define PROF_RET() do{}while(0)
+#define PROF_TAKEN() do{}while(0)
+#define PROF_PCROSS() do{}while(0)
 #endif
-#define FETCH_OP() do { CPU_READ_N(&op.op, cpu->pc, PC_MAX_FETCH); } while(0)
-#define DISPATCH() do { FETCH_OP(); goto *opdisp[op.op]; } while(0)
-	do {
-		DISPATCH();
-		#include "oplabels.h"
-	} while(0);
-done:
-	return cyc;
+
+/* the instruction being run */
+struct exec_op {
+	u8 align; // needed for alignment of 16 bit params
+	u8 op;  // op, followed by up to 6 parameter bytes on HuC.
+	union {
+		u8  pb[6];
+		u16 pw[3];
+	};
+	u8 pad; // needed so we can access &op.op using a word-sized memcpy
+};
+
+#if defined(CPU_DISPATCH_FNPTR) || defined(CPU_DISPATCH_MUSTTAIL) || defined(CPU_AOT)
+/* what the handler functions and translated blocks share, see exec.c */
+struct exec_st {
+	struct exec_op op;
+	unsigned cyc, limit;
+	uint64_t base;
+#ifdef CPU_IDLE_SKIP
+	struct idle_rec idle;
+#endif
+};
+/* what a handler function returns. a translated block returns EXEC_MISS
+   if it didn't run, as its memory doesn't hold the image. */
+enum { EXEC_NEXT, EXEC_SLICED, EXEC_DONE, EXEC_MISS };
+#endif
+
+#define INT_CYCLES (IS_HUC ? 8 : 7)
+#define VEC_RST (IS_HUC ? 0xfffe : 0xfffc)
+#define VEC_NMI (IS_HUC ? 0xfffc : 0xfffa)
+
+#ifdef CPU65_ALL_TYPES
+#undef CPU_TYPE
+#define CPU_TYPE CPU_TYPE_2A03
+#define CORE(F) F ## _2a03
+#define CORE_OPTBL "optbl_2a03.h"
+#define CORE_OPLABELS "oplabels_2a03.h"
+#define CORE_OPIDLE "opidle_2a03.h"
+#define CORE_OPFUSE "opfuse_2a03.h"
+#include "exec.c"
+#undef CPU_TYPE
+#define CPU_TYPE CPU_TYPE_6502
+#define CORE(F) F ## _6502
+#define CORE_OPTBL "optbl_6502.h"
+#define CORE_OPLABELS "oplabels_6502.h"
+#define CORE_OPIDLE "opidle_6502.h"
+#define CORE_OPFUSE "opfuse_6502.h"
+#include "exec.c"
+#undef CPU_TYPE
+#define CPU_TYPE CPU_TYPE_65C02
+#define CORE(F) F ## _65c02
+#define CORE_OPTBL "optbl_65c02.h"
+#define CORE_OPLABELS "oplabels_65c02.h"
+#define CORE_OPIDLE "opidle_65c02.h"
+#define CORE_OPFUSE "opfuse_65c02.h"
+#include "exec.c"
+#undef CPU_TYPE
+#define CPU_TYPE CPU_TYPE_R65C02
+#define CORE(F) F ## _r65c02
+#define CORE_OPTBL "optbl_r65c02.h"
+#define CORE_OPLABELS "oplabels_r65c02.h"
+#define CORE_OPIDLE "opidle_r65c02.h"
+#define CORE_OPFUSE "opfuse_r65c02.h"
+#include "exec.c"
+#undef CPU_TYPE
+#define CPU_TYPE CPU_TYPE_HUC6280
+#define CORE(F) F ## _huc6280
+#define CORE_OPTBL "optbl_huc6280.h"
+#define CORE_OPLABELS "oplabels_huc6280.h"
+#define CORE_OPIDLE "opidle_huc6280.h"
+#define CORE_OPFUSE "opfuse_huc6280.h"
+#include "exec.c"
+#undef CPU_TYPE
+#define CPU_TYPE (cpu->type)
+
+static unsigned (*const cpu65_cores[]) (struct cpu65 *, unsigned) = {
+	[CPU_TYPE_2A03] = cpu65_exec_2a03,
+	[CPU_TYPE_6502] = cpu65_exec_6502,
+	[CPU_TYPE_65C02] = cpu65_exec_65c02,
+	[CPU_TYPE_R65C02] = cpu65_exec_r65c02,
+	[CPU_TYPE_HUC6280] = cpu65_exec_huc6280,
+};
+
+/* like cpu65_init(), which isn't available with CPU65_ALL_TYPES, with the
+   type of the cpu, one of CPU_TYPE_*, chosen here. */
+void cpu65_init_type(struct cpu65 *cpu, u8 *zeropage, unsigned type) {
+	memset(cpu, 0, sizeof *cpu);
+	cpu->type = type;
+	cpu->exec = cpu65_cores[type];
+	cpu->zp = zeropage;
+	cpu->stack = zeropage + 256;
+	reset_regs(cpu);
+}
+
+/* runs the core for the type of cpu, see exec.c. */
+unsigned cpu65_exec(struct cpu65 *cpu, unsigned mincycles) {
+	return cpu->exec(cpu, mincycles);
 }
+#else
+#define CORE(F) F
+#define CORE_OPTBL "optbl.h"
+#define CORE_OPLABELS "oplabels.h"
+#define CORE_OPIDLE "opidle.h"
+#define CORE_OPFUSE "opfuse.h"
+#include "exec.c"
+#endif
+
+#ifdef CPU_LANES
+#include "lanes.c"
+#endif
@@ -0,0 +1,498 @@
+/* the interpreter core. this file is included by cpu65.c, once for the
+   type chosen with gen.py, or with CPU65_ALL_TYPES once for every type,
+   with CPU_TYPE defined to it. CORE() names the functions of the core,
+   CORE_OPTBL, CORE_OPLABELS, CORE_OPIDLE and CORE_OPFUSE are the tables
+   gen.py wrote for the type. */
+
+/* runs the reset or interrupt sequence, if one is pending.
+   returns the number of cycles used. */
+static unsigned CORE(int_service)(struct cpu65 *cpu) {
+	u16 vec;
+	u8 v[2];
+	if(cpu->int_req & INT_RST) {
+		cpu->int_req = 0;
+		cpu->s -= 3;
+		I = 1; T = T_INIT;
+		if(CPU_TYPE > CPU_TYPE_6502) D = 0;
+		cpu->cs = cs_normal;
+		vec = VEC_RST;
+		REPLAY_INT(INT_RST);
+		goto jump;
+	}
+	if(cpu->int_req & INT_NMI) {
+		cpu->int_req &= ~INT_NMI;
+		vec = VEC_NMI;
+	} else if(cpu->irq && !I) {
+		if(CPU_TYPE != CPU_TYPE_HUC6280) vec = 0xfffe;
+		else if(cpu->irq & CPU65_TIRQ) vec = 0xfffa;
+		else if(cpu->irq & CPU65_IRQ1) vec = 0xfff8;
+		else vec = 0xfff6;
+	} else {
+		/* an irq with I set still ends WAI, without the handler */
+		if(cpu->irq && cpu->cs == cs_waiting) {
+			REPLAY_INT(cpu->irq << 2);
+			cpu->cs = cs_normal;
+		}
+		return 0;
+	}
+	REPLAY_INT(vec == VEC_NMI ? INT_NMI : cpu->irq << 2);
+	PUSH(cpu->pch); PUSH(cpu->pcl);
+	PUSH(pack_flags(cpu) & ~B_FLAG);
+	I = 1; T = T_INIT;
+	if(!(INT_MASK & D_FLAG)) D = 0;
+	if(cpu->cs == cs_waiting) cpu->cs = cs_normal;
+jump:
+	ACC_READ(vec, 2, CPU65_COV_VECTOR);
+	CPU_READ_N(v, vec, 2);
+	PC = v[0] | (v[1] << 8);
+	return INT_CYCLES;
+}
+
+#ifdef CPU_IDLE_SKIP
+/* whether the code from t to end only changes registers and flags, going
+   by the instructions decoded from t. branches and jumps within it need
+   to land on one of these. */
+static int CORE(idle_body)(struct cpu65 *cpu, u16 t, u16 end) {
+	static const u8 info[256] = {
+		#include CORE_OPIDLE
+	};
+	uint64_t starts = 0, targets = 0;
+	unsigned i, n, len = (u16)(end - t);
+	u16 dest;
+	u8 ob[4];
+	for(i = 0; i < len; i += n) {
+#ifdef CPU_MEMMAP
+		/* leave i/o alone, there's hardly any code running from it */
+		if(!cpu->rmap[(u16)(t + i) >> 8] || !cpu->rmap[(u16)(t + i + 3) >> 8]) return 0;
+#endif
+		CPU_READ_N(ob, (u16)(t + i), 4);
+		if(!(n = info[ob[0]] & 7)) return 0;
+		starts |= 1ull << i;
+		if(info[ob[0]] & IDLE_REL) dest = t + i + n + (signed char) ob[n - 1];
+		else if(info[ob[0]] & IDLE_JMP) dest = ob[1] | ob[2] << 8;
+		else continue;
+		/* leaving the loop is fine, as that ends it */
+		if((u16)(dest - t) < len) targets |= 1ull << (u16)(dest - t);
+	}
+	return i == len && !(targets & ~starts);
+}
+
+/* called on taken branches closing a loop at end. if the registers and
+   flags are the same as at the previous iteration, skips as many
+   iterations as fit before limit. returns the new cycle count. */
+static unsigned CORE(idle_loop)(struct cpu65 *cpu, struct idle_rec *r, u16 t, u16 end, unsigned cyc, unsigned limit) {
+	uint64_t fp = IDLE_FP();
+	unsigned ic, k;
+	if(r->fp == fp && r->end == end && limit > cyc && !BP_ON() && !REPLAY_ON()) {
+		ic = cyc - r->cyc;
+		k = (limit - 1 - cyc) / ic;
+		if(k && CORE(idle_body)(cpu, t, end)) {
+			cyc += k * ic;
+			cpu->idle_skipped += k * ic;
+		}
+	}
+	r->fp = fp;
+	r->end = end;
+	r->cyc = cyc;
+	return cyc;
+}
+#endif
+
+/* how the handlers in CORE_OPLABELS are reached depends on DISPATCH as
+   passed to gen.py:
+   CPU_DISPATCH_GOTO: labels in cpu65_exec(), jumped to with computed goto.
+   CPU_DISPATCH_SWITCH: cases of a switch in cpu65_exec(), for compilers
+   without computed goto.
+   CPU_DISPATCH_FNPTR: functions, called from a table in a loop.
+   CPU_DISPATCH_MUSTTAIL: functions, each calling the next handler as a
+   tail call. without compiler support for musttail, this relies on the
+   optimizer turning these into jumps, so don't use it with -O0.
+   the functions keep what handlers share in struct exec_st and work on
+   copies of it in locals, like the handlers inside cpu65_exec() do. */
+#ifdef CPU_TRACE
+#define TRACE_REC(AM) if(cpu->trace) trace_push(cpu, AM, &op.op, base + cyc);
+#else
+#define TRACE_REC(AM)
+#endif
+#ifdef CPU_DEBUG
+#define TRACE(INSN, AM) TRACE_REC(AM) PROF_INSN(AM) if(cpu->trace_print) { char trbuf[128]; \
+	sprintf(trbuf, \
+	"PC:%04x S:%02x A:%02x X:%02x Y:%02x %c%c%c%c%c%c%c%c O:%02x %s%s", \
+	PC, cpu->s, A, X, Y, \
+	N?'N':'n', V?'V':'v', T?'T':'t', B?'B':'b', \
+	D?'D':'d', I?'I':'i', Z?'Z':'z', C?'C':'c', \
+	op.op, INSN, trace_fmt(AM, op.pb)); cpu->trace_print(cpu, trbuf); }
+#else
+#define TRACE(INSN, AM) TRACE_REC(AM) PROF_INSN(AM)
+#endif
+#define FETCH_OP() do { BUS_AT(0); CPU_READ_N(&op.op, cpu->pc, PC_MAX_FETCH); } while(0)
+#ifdef CPU_JIT
+/* blocks leave pc where they stopped and return the cycles taken. one
+   that took none stopped at its first instruction, which is left to the
+   handler. */
+#define JIT_LOOP() do { struct jit_block *jb; unsigned jc_; \
+	while((jb = jit_lookup(cpu, PC)) && JIT_FITS(jb)) { \
+		jc_ = jb->fn(cpu); ADDCYC(jc_); \
+		JIT_CHKDONE(); \
+		if(!jc_) break; } } while(0)
+/* whether pc may start a block, it doesn't if it's known not to */
+#define JIT_AT(ADDR) (cpu->jit && cpu->jit->blk[ADDR] != &jit_none)
+#endif
+
+#if defined(CPU_DISPATCH_FNPTR) || defined(CPU_DISPATCH_MUSTTAIL) || defined(CPU_AOT)
+#define EXEC_LEAVE() do { st->cyc = cyc; st->limit = limit; } while(0)
+#endif
+
+#ifdef CPU_AOT
+/* the blocks aot.py translated the image to. whatever the backend, these
+   are functions like the handlers of the fnptr backend, made of the same
+   code. a block first checks that the pages it was translated from hold
+   the image, and again after each instruction that may have written
+   there. it returns EXEC_NEXT after its last instruction, or if the
+   pages changed, with pc at the next instruction to run. */
+#define AOT_ENTER(P0, P1) struct exec_op op; u8 *m; u16 addr; \
+	unsigned cyc = st->cyc, limit = st->limit; uint64_t base = st->base; \
+	(void) m; (void) addr; (void) base; \
+	if(!aot_same(cpu, P0) || !aot_same(cpu, P1)) return EXEC_MISS
+#define AOT_OB(O, B0, B1, B2, B3, B4, B5) do { op.op = O; \
+	op.pb[0] = B0; op.pb[1] = B1; op.pb[2] = B2; \
+	op.pb[3] = B3; op.pb[4] = B4; op.pb[5] = B5; } while(0)
+#define AOT_NEXT() do { EXEC_LEAVE(); return EXEC_NEXT; } while(0)
+#define AOT_CHECK(P0, P1) if(cpu->aot->page[P0] != AOT_SAME || \
+	cpu->aot->page[P1] != AOT_SAME) AOT_NEXT()
+#define SLICED() do { EXEC_LEAVE(); return EXEC_SLICED; } while(0)
+#define DONE() do { EXEC_LEAVE(); return EXEC_DONE; } while(0)
+#define IDLE_REC st->idle
+#include "aotblk.h"
+#undef SLICED
+#undef DONE
+#undef IDLE_REC
+
+/* whether a block starts at ADDR, in a page not known to differ */
+#define AOT_AT(ADDR) (aot_pages[(ADDR) >> 8] && aot_pages[(ADDR) >> 8][(ADDR) & 0xff] && \
+	cpu->aot->page[(ADDR) >> 8] != AOT_DIFF)
+
+/* runs blocks for as long as pc is at the start of one. returns
+   EXEC_NEXT if it isn't, or the block there didn't run, otherwise
+   EXEC_SLICED or EXEC_DONE as returned by the block. */
+static int aot_run(struct cpu65 *cpu, struct exec_st *st) {
+	int r;
+	do r = aot_pages[PC >> 8][PC & 0xff](cpu, st);
+	while(r == EXEC_NEXT && AOT_AT(PC));
+	return r == EXEC_MISS ? EXEC_NEXT : r;
+}
+#endif
+
+#if defined(CPU_DISPATCH_FNPTR) || defined(CPU_DISPATCH_MUSTTAIL)
+#define EXEC_ENTER() struct exec_op op = st->op; u8 *m; u16 addr; \
+	unsigned cyc = st->cyc, limit = st->limit; uint64_t base = st->base; \
+	(void) m; (void) addr; (void) base
+#define SLICED() do { EXEC_LEAVE(); return EXEC_SLICED; } while(0)
+#define DONE() do { EXEC_LEAVE(); return EXEC_DONE; } while(0)
+#define IDLE_REC st->idle
+#ifdef CPU_AOT
+#define AOT_RUN() if(cpu->aot && AOT_AT(PC)) { int r_; EXEC_LEAVE(); \
+	if((r_ = aot_run(cpu, st)) != EXEC_NEXT) return r_; \
+	cyc = st->cyc; limit = st->limit; }
+#endif
+#ifdef CPU_JIT
+#define JIT_RUN() if(JIT_AT(PC)) JIT_LOOP()
+#endif
+#ifdef CPU_DISPATCH_FNPTR
+#define NEXT_OP() do { st->op = op; EXEC_LEAVE(); return EXEC_NEXT; } while(0)
+#else
+#if defined(__has_attribute)
+#if __has_attribute(musttail)
+#define MUSTTAIL __attribute__((musttail))
+#endif
+#endif
+#ifndef MUSTTAIL
+#define MUSTTAIL
+#endif
+#define NEXT_OP() do { st->op = op; EXEC_LEAVE(); \
+	MUSTTAIL return CORE(ophandlers)[op.op](cpu, st); } while(0)
+#endif
+/* the decode cache only needs to know the entry is valid */
+#define DC_LAB ((void *) 1)
+#define DC_GOTO(LAB) NEXT_OP()
+#else
+#ifdef CPU_NO_COUNT_CYCLES
+/* only WAI ends a slice then, and the next one starts right away */
+#define SLICED() goto slice
+#else
+#define SLICED() goto sliced
+#endif
+#define DONE() goto done
+#define IDLE_REC idle
+#ifdef CPU_AOT
+/* the blocks are run at the label aot, see cpu65_exec() */
+#define AOT_RUN() if(cpu->aot && AOT_AT(PC)) goto aot
+#endif
+#ifdef CPU_JIT
+/* and these at the label jit, so the handlers stay small */
+#define JIT_RUN() if(JIT_AT(PC)) goto jit
+#endif
+#ifdef CPU_DISPATCH_SWITCH
+#define NEXT_OP() goto dispatch
+#define DC_LAB ((void *) 1)
+#define DC_GOTO(LAB) NEXT_OP()
+#else
+#define NEXT_OP() goto *opdisp[op.op]
+#define DC_LAB opdisp[op.op]
+#define DC_GOTO(LAB) goto *(LAB)
+#endif
+#endif
+
+#if defined(CPU_FUSED) && defined(CPU_DECODE_CACHE)
+/* with FUSE passed to gen.py, there are handlers running a pair of
+   instructions, the ones picked from the profile as most frequent. when
+   the decode cache is filled for the first of a pair followed by the
+   second, the entry gets the fused handler and the bytes of both. the
+   first of a pair doesn't write memory or change control flow, so the
+   second is what would have been fetched next, and the budget is still
+   checked in between. so everything, down to the trace and profile,
+   is the same as running them one by one. */
+#ifndef CPU_DISPATCH_GOTO
+#error CPU_FUSED needs DISPATCH=goto
+#endif
+static const u8 CORE(fuse_pairs)[][3] = {
+#define FUSEFIRST(A, I)
+#define FUSEDEF(N, A, LEN, B) { A, LEN, B },
+	#include CORE_OPFUSE
+#undef FUSEDEF
+#undef FUSEFIRST
+	{ 0, 0, 0 }
+};
+/* per opcode, 1 + the index of the first pair starting with it */
+static const u16 CORE(fuse_first)[256] = {
+#define FUSEFIRST(A, I) [A] = (I) + 1,
+#define FUSEDEF(N, A, LEN, B)
+	#include CORE_OPFUSE
+#undef FUSEDEF
+#undef FUSEFIRST
+};
+
+/* the fused pair starting with the instruction in ob, -1 if none */
+static int CORE(fuse_find)(const u8 *ob) {
+	const u8 *f;
+	unsigned i = CORE(fuse_first)[ob[0]];
+	if(!i) return -1;
+	for(f = CORE(fuse_pairs)[--i]; f[0] == ob[0] && f[1]; f = CORE(fuse_pairs)[++i])
+		if(f[2] == ob[f[1]]) return i;
+	return -1;
+}
+
+#define DC_FILL() do { int f_ = CORE(fuse_find)(&op.op); u8 fb_[2 * PC_MAX_FETCH]; \
+	if(f_ < 0) dcache_fill(cpu->dc, PC, DC_LAB, &op.op, PC_MAX_FETCH); \
+	else { memcpy(fb_, &op.op, PC_MAX_FETCH); \
+		CPU_READ_N(fb_ + PC_MAX_FETCH, (u16)(PC + CORE(fuse_pairs)[f_][1]), PC_MAX_FETCH); \
+		if(dcache_fill(cpu->dc, PC, fusedisp[f_], fb_, sizeof fb_)) goto *fusedisp[f_]; } } while(0)
+/* moves on to the second instruction of the pair, the first one was LEN
+   bytes. its entry is still there, as the first one didn't write. */
+#define FUSE_NEXT(LEN) do { u16 f_ = PC - (LEN); BP_STOP(); \
+	memcpy(&op.op, cpu->dc->e[f_].ob + PC_MAX_FETCH, PC_MAX_FETCH); } while(0)
+#else
+#define DC_FILL() dcache_fill(cpu->dc, PC, DC_LAB, &op.op, PC_MAX_FETCH)
+#endif
+
+#ifndef CPU_AOT
+#define AOT_RUN()
+#endif
+
+#ifdef CPU_BREAK
+/* blocks run more than one instruction at once, so they're left out
+   while there are breakpoints, see CPU_BREAK, or coverage is recorded */
+#define BP_STOP() do { if(cpu->bp_on && bp_stop(cpu)) DONE(); } while(0)
+#define BLOCK_RUN() if(cpu->bp_on) { if(bp_stop(cpu)) DONE(); } \
+	else if(!COV_ON()) AOT_RUN();
+#define BLOCK_ON() (!cpu->bp_on && !COV_ON())
+#else
+#define BP_STOP() do{}while(0)
+#define BLOCK_RUN() if(!COV_ON()) AOT_RUN();
+#define BLOCK_ON() (!COV_ON())
+#endif
+
+/* fetches the instruction at pc and runs it, DISPATCH() runs the AOT
+   block at pc first, or checks the breakpoints. JUMP_DISPATCH() ends the
+   handlers changing control flow, and slices start with it. it runs the
+   JIT blocks from pc first, which are only looked for there, the lookup
+   would cost more than it saves after every instruction. */
+#ifdef CPU_DECODE_CACHE
+#define FETCH_DISPATCH() do { struct cpu65_dcent *de; \
+	if(cpu->dc) { \
+		if((de = &cpu->dc->e[PC])->lab) { \
+			memcpy(&op.op, de->ob, PC_MAX_FETCH); DC_GOTO(de->lab); } \
+		FETCH_OP(); DC_FILL(); \
+	} else FETCH_OP(); \
+	NEXT_OP(); } while(0)
+#else
+#define FETCH_DISPATCH() do { FETCH_OP(); NEXT_OP(); } while(0)
+#endif
+#define DISPATCH() do { BLOCK_RUN() FETCH_DISPATCH(); } while(0)
+#ifdef CPU_JIT
+#define JUMP_DISPATCH() do { if(BLOCK_ON()) JIT_RUN(); DISPATCH(); } while(0)
+#else
+#define JUMP_DISPATCH() DISPATCH()
+#endif
+
+#if defined(CPU_DISPATCH_FNPTR) || defined(CPU_DISPATCH_MUSTTAIL)
+static int (*const CORE(ophandlers)[256])(struct cpu65 *, struct exec_st *);
+#include CORE_OPLABELS
+#define OPDEF(N, L)  [N] = CORE(h_ ## L)
+static int (*const CORE(ophandlers)[256])(struct cpu65 *, struct exec_st *) = {
+	#include CORE_OPTBL
+};
+#undef OPDEF
+
+/* fetches the instruction at pc, and with musttail runs it */
+static int CORE(dispatch)(struct cpu65 *cpu, struct exec_st *st) {
+	EXEC_ENTER();
+	JUMP_DISPATCH();
+}
+#endif
+
+/* run until at least mincycles have passed and return the number of cycles
+   actually run. scheduled events are fired and pending interrupts are
+   taken at instruction boundaries. */
+#ifdef CPU65_ALL_TYPES
+static
+#endif
+unsigned CORE(cpu65_exec)(struct cpu65 *cpu, unsigned mincycles) {
+	unsigned cyc = 0, limit; //unsigned tmp, tmp2;
+	uint64_t base = cpu->cycles, d;
+#if defined(CPU_DISPATCH_FNPTR) || defined(CPU_DISPATCH_MUSTTAIL)
+	struct exec_st st_, *st = &st_;
+	int r;
+	st->base = base;
+#else
+	struct exec_op op;
+	u8 *m; // points to the memory operand of address mode
+	u16 addr; // temporary storage of address needed more than once.
+	//enum address_mode am;
+#ifdef CPU_IDLE_SKIP
+	struct idle_rec idle;
+#endif
+#ifdef CPU_AOT
+	struct exec_st aot_st;
+	int r;
+	aot_st.base = base;
+#endif
+#ifndef CPU_DISPATCH_SWITCH
+#define OPDEF(N, L)  [N] = &&lab_ ## L
+	static void *opdisp[256] = {
+		#include CORE_OPTBL
+	};
+#undef OPDEF
+#endif
+#if defined(CPU_FUSED) && defined(CPU_DECODE_CACHE)
+#define FUSEFIRST(A, I)
+#define FUSEDEF(N, A, LEN, B) &&lab_fuse_ ## N,
+	static void *fusedisp[] = {
+		#include CORE_OPFUSE
+		0
+	};
+#undef FUSEDEF
+#undef FUSEFIRST
+#endif
+#endif
+
+#ifdef CPU_BREAK
+	if(cpu->cs == cs_break) bp_resume(cpu);
+#endif
+slice:
+	IDLE_RESET();
+	PROF_FLUSH();
+	cpu->cycles = base + cyc;
+	while(cpu->nevents && cpu->events[0].when <= cpu->cycles) {
+		struct cpu65_event e = cpu->events[0];
+		event_remove(cpu, 0);
+		e.fn(cpu, e.ctx);
+	}
+	/* only a reset gets a jammed or stopped cpu going again */
+	if((cpu->cs == cs_jammed || cpu->cs == cs_stopped) && !(cpu->int_req & INT_RST))
+		goto done;
+	if(cpu->int_req || cpu->irq) {
+		unsigned rst = cpu->int_req & INT_RST, c;
+		BUS_AT(INT_CYCLES - 2);
+		c = PROF_INT(CORE(int_service)(cpu), rst);
+		/* events falling due during the sequence fire before the
+		   handler runs */
+		cyc += c;
+		if(c) goto slice;
+	}
+	limit = mincycles;
+	if(cpu->nevents && limit > cyc) {
+		d = cpu->events[0].when - (base + cyc);
+		if(d < limit - cyc) limit = cyc + d;
+	}
+	if(cpu->cs == cs_waiting) {
+#ifdef CPU_NO_COUNT_CYCLES
+		goto done;
+#else
+		/* nothing to do until the next event */
+		if(limit > cyc) {
+			PROF_WAIT(limit - cyc);
+			cyc = limit;
+		}
+		goto sliced;
+#endif
+	}
+#if defined(CPU_DISPATCH_FNPTR) || defined(CPU_DISPATCH_MUSTTAIL)
+	st->cyc = cyc;
+	st->limit = limit;
+	r = CORE(dispatch)(cpu, st);
+#ifdef CPU_DISPATCH_FNPTR
+	while(r == EXEC_NEXT) r = CORE(ophandlers)[st->op.op](cpu, st);
+#endif
+	cyc = st->cyc;
+	if(r == EXEC_DONE) goto done;
+#elif defined(CPU_DISPATCH_SWITCH)
+	JUMP_DISPATCH();
+dispatch:
+	switch(op.op) {
+	#include CORE_OPLABELS
+	}
+#else
+	JUMP_DISPATCH();
+	#include CORE_OPLABELS
+#endif
+#if defined(CPU_AOT) && !defined(CPU_DISPATCH_FNPTR) && !defined(CPU_DISPATCH_MUSTTAIL)
+aot:
+	aot_st.cyc = cyc;
+	aot_st.limit = limit;
+#ifdef CPU_IDLE_SKIP
+	aot_st.idle = idle;
+#endif
+	r = aot_run(cpu, &aot_st);
+	cyc = aot_st.cyc;
+	limit = aot_st.limit;
+#ifdef CPU_IDLE_SKIP
+	idle = aot_st.idle;
+#endif
+	if(r == EXEC_SLICED) SLICED();
+	if(r == EXEC_DONE) goto done;
+	FETCH_DISPATCH();
+#endif
+#if defined(CPU_JIT) && !defined(CPU_DISPATCH_FNPTR) && !defined(CPU_DISPATCH_MUSTTAIL)
+jit:
+	JIT_LOOP();
+	DISPATCH();
+#endif
+#ifndef CPU_NO_COUNT_CYCLES
+sliced:
+#endif
+#ifdef CPU_BREAK
+	if(cpu->cs == cs_break) goto done;
+#endif
+	if(cyc < mincycles) goto slice;
+done:
+	PROF_FLUSH();
+	cpu->cycles = base + cyc;
+	return cyc;
+}
+
+#undef CORE
+#undef CORE_OPTBL
+#undef CORE_OPLABELS
+#undef CORE_OPIDLE
+#undef CORE_OPFUSE
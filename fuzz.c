@@ -0,0 +1,362 @@
+/* differential fuzzing driver, built and run by fuzz.py once per engine
+   configuration. tests are random memory images with a stream of valid
+   instructions, taken from fuzzops.h which fuzz.py generates for the
+   type, at the initial pc, and random registers.
+   fuzz gen seed file [group]
+	writes the image of test seed to file: 64K of memory, then pc,
+	a, x, y, s and p.
+   fuzz step|slice cycles seed count [group]
+	runs tests seed to seed+count-1.
+   fuzz step|slice cycles -f file
+	runs the image in file.
+   fuzz lanes cycles seed count group
+   fuzz lanes cycles -f file group
+	the same with CPU_LANES, see below.
+   step calls cpu65_exec() for a single cycle at a time, i.e. runs one
+   instruction per call, slice for random numbers of cycles. after each
+   call a line is printed with the cycles, pc, registers, state, a hash of
+   zeropage and stack, the MPRs on HuC6280, the number and a hash of all
+   writes through CPU_WRITE_N so far, and the first of them since the
+   last line. each test starts with "T seed" and
+   runs until the cycles are used up or the cpu is jammed or stopped.
+   built with CPU_TRACE, slice also prints a line starting with "I" per
+   instruction it has a record of, before the line of the call it ran in:
+   the state it started in, the cycles, pc, registers and the number and
+   hash of the writes, and the writes since the previous line. those of
+   JIT blocks aren't recorded.
+   the tests of a group, seeds with the same seed / group, share their
+   memory and code, the ones after the first get other zeropage bytes,
+   so they take other paths through it now and then.
+   lanes runs each group in lanes like slice, cpu65_lanes_exec() for
+   random numbers of cycles, and prints the lines of every lane as a
+   test of its own. with -f, the other lanes run the image varied. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the memory of an instance and its writes so far, all counted and
+   hashed, the first of the current step listed. lines go to out. */
+struct fuzz_cpu {
+	uint8_t mem[65536];
+	uint64_t wcount;
+	uint32_t whash;
+	char wlog[256];
+	unsigned wlen;
+	FILE *out;
+	uint64_t tpos; /* trace records printed */
+};
+#define FUZZ_CPU(CPU) ((struct fuzz_cpu *) (CPU)->user)
+
+struct cpu65;
+static void fuzz_read(struct cpu65 *cpu, void *dest, uint16_t addr, unsigned n);
+static void fuzz_write(struct cpu65 *cpu, const uint8_t *src, uint16_t addr, unsigned n);
+static void fuzz_mpr(struct cpu65 *cpu);
+static void fuzz_store(struct fuzz_cpu *f, unsigned a, uint8_t v);
+static void trace_lines(struct cpu65 *cpu);
+
+#ifndef CPU_MEMMAP
+#define CPU_READ_N(DEST, ADDR, N) fuzz_read(cpu, DEST, ADDR, N)
+#define CPU_WRITE_N(SRC, ADDR, N) fuzz_write(cpu, (const uint8_t *) (SRC), ADDR, N)
+/* ST0-2, to bank $ff like they go with CPU_MEMMAP */
+#define CPU_VDC_WRITE(N, V) do { trace_lines(cpu); \
+	fuzz_store(FUZZ_CPU(cpu), (0xff << 13 | VDC_ADDR(N)) & 0xffff, V); } while(0)
+#endif
+#define CPU_MPR_WRITTEN(N) fuzz_mpr(cpu)
+
+#include "cpu65.c"
+
+#ifdef CPU65_ALL_TYPES
+#error fuzz.c is for a single type, run gen.py with the type to test
+#endif
+
+#include "fuzzops.h"
+
+/* instructions written at the initial pc */
+#define STREAM_OPS 256
+
+/* HuC6280 banks b and b+8n are the same 8K of mem */
+static unsigned phys(struct cpu65 *cpu, unsigned addr) {
+#if HAS_HUC
+	return cpu65_phys(cpu, addr) & 0xffff;
+#else
+	(void) cpu;
+	return addr & 0xffff;
+#endif
+}
+
+/* prints the lines of the instructions recorded since the last call */
+static void trace_lines(struct cpu65 *cpu) {
+#ifdef CPU_TRACE
+	struct fuzz_cpu *f = FUZZ_CPU(cpu);
+	struct cpu65_trace_rec t[16];
+	size_t i, n;
+	while((n = cpu65_trace_read(cpu, &f->tpos, t, 16))) for(i = 0; i < n; ++i) {
+		fprintf(f->out, "I %llu %04x %02x %02x %02x %02x %02x %llu:%08x |%s\n",
+			(unsigned long long) t[i].cycle, t[i].pc, t[i].a, t[i].x, t[i].y, t[i].s, t[i].p,
+			(unsigned long long) f->wcount, (unsigned) f->whash, f->wlog);
+		f->wlen = 0;
+		f->wlog[0] = 0;
+	}
+#else
+	(void) cpu;
+#endif
+}
+
+static void fuzz_read(struct cpu65 *cpu, void *dest, uint16_t addr, unsigned n) {
+	unsigned i;
+	for(i = 0; i < n; ++i) ((u8 *) dest)[i] = FUZZ_CPU(cpu)->mem[phys(cpu, (addr + i) & 0xffff)];
+}
+
+/* a write of v to a, already folded by phys() */
+static void fuzz_store(struct fuzz_cpu *f, unsigned a, uint8_t v) {
+	f->mem[a] = v;
+	f->wcount++;
+	f->whash = (f->whash ^ a) * 16777619u;
+	f->whash = (f->whash ^ v) * 16777619u;
+	if(f->wlen < sizeof f->wlog - 16) f->wlen += sprintf(f->wlog + f->wlen, " %04x:%02x", a, v);
+	else if(f->wlog[f->wlen - 1] != '.') f->wlen += sprintf(f->wlog + f->wlen, " ...");
+}
+
+static void fuzz_write(struct cpu65 *cpu, const uint8_t *src, uint16_t addr, unsigned n) {
+	unsigned i;
+	/* the record of the instruction writing is there already, the writes
+	   go with the line of the next one */
+	trace_lines(cpu);
+	for(i = 0; i < n; ++i) fuzz_store(FUZZ_CPU(cpu), phys(cpu, (addr + i) & 0xffff), src[i]);
+}
+
+/* zeropage and stack follow MPR1 on HuC6280 */
+static void fuzz_mpr(struct cpu65 *cpu) {
+	cpu->zp = FUZZ_CPU(cpu)->mem + phys(cpu, ZP_BASE);
+	cpu->stack = cpu->zp + 256;
+}
+
+static uint64_t rs;
+static unsigned rnd(void) {
+	rs ^= rs << 13;
+	rs ^= rs >> 7;
+	rs ^= rs << 17;
+	return (unsigned) rs;
+}
+
+/* gives the image 16 other bytes around the zeropage. other registers
+   would make lanes part right away. */
+static void vary(u8 *img, uint64_t seed) {
+	unsigned i;
+	rs = seed * 0xbf58476d1ce4e5b9ULL + 1;
+	for(i = 0; i < 16; ++i) img[ZP_BASE + rnd() % 256] = rnd();
+}
+
+static void gen(uint64_t seed, unsigned group, u8 *img) {
+	unsigned i, j, pc;
+	const u8 *o;
+	rs = seed / group * 0x9e3779b97f4a7c15ULL + 1;
+	for(i = 0; i < 65536 + 7; ++i) img[i] = rnd();
+	pc = img[65536] | img[65537] << 8;
+	for(i = 0; i < STREAM_OPS; ++i) {
+		o = fuzz_ops[rnd() % (sizeof fuzz_ops / sizeof *fuzz_ops)];
+		img[pc++ & 0xffff] = o[0];
+		for(j = 1; j < o[1]; ++j) img[pc++ & 0xffff] = rnd();
+	}
+	if(seed % group) vary(img, seed);
+}
+
+static void state(struct cpu65 *cpu) {
+	struct fuzz_cpu *f = FUZZ_CPU(cpu);
+	uint32_t h = 2166136261u;
+	unsigned i;
+	for(i = 0; i < 512; ++i) h = (h ^ cpu->zp[i]) * 16777619u;
+	fprintf(f->out, "%llu %04x %02x %02x %02x %02x %02x %d %08x", (unsigned long long) cpu->cycles,
+		cpu->pc, cpu->a, cpu->x, cpu->y, cpu->s, pack_flags(cpu), cpu->cs, (unsigned) h);
+	if(HAS_HUC) for(i = 0; i < 8; ++i) fprintf(f->out, " %02x", cpu->mpr[i]);
+	fprintf(f->out, " %llu:%08x |%s\n", (unsigned long long) f->wcount, (unsigned) f->whash, f->wlog);
+	f->wlen = 0;
+	f->wlog[0] = 0;
+}
+
+/* sets up cpu to run test seed from img, with f as its memory */
+static void start(struct cpu65 *cpu, struct fuzz_cpu *f, const u8 *img, uint64_t seed) {
+	memcpy(f->mem, img, 65536);
+	cpu65_init(cpu, f->mem);
+	cpu->user = f;
+#ifdef CPU_MEMMAP
+	/* reads are mapped, writes go to fuzz_write */
+	cpu->io_write = fuzz_write;
+# if HAS_HUC
+	unsigned b;
+	for(b = 0; b < 256; ++b) cpu65_map_bank(cpu, b, f->mem + (b & 7) * 0x2000, CPU65_MAP_READ);
+# else
+	cpu65_map(cpu, 0, 0x10000, f->mem, CPU65_MAP_READ);
+# endif
+#endif
+#ifdef CPU_DECODE_CACHE
+	cpu65_dcache_init(cpu);
+#endif
+#ifdef CPU_JIT
+	cpu65_jit_init(cpu);
+#endif
+#ifdef CPU_IDLE_SKIP
+	cpu->idle_skip = 1;
+#endif
+	cpu65_reset(cpu, img[65536] | img[65537] << 8);
+	fuzz_mpr(cpu);
+	cpu->a = img[65538];
+	cpu->x = img[65539];
+	cpu->y = img[65540];
+	cpu->s = img[65541];
+	unpack_flags(cpu, img[65542]);
+	f->wcount = 0;
+	f->whash = 2166136261u;
+	f->wlen = 0;
+	f->wlog[0] = 0;
+	/* so fuzz.py knows which test hangs */
+	fprintf(f->out, "T %llu\n", (unsigned long long) seed);
+	fflush(f->out);
+	state(cpu);
+}
+
+static void finish(struct cpu65 *cpu) {
+#ifdef CPU_TRACE
+	cpu65_trace_free(cpu);
+#endif
+#ifdef CPU_JIT
+	cpu65_jit_free(cpu);
+#endif
+#ifdef CPU_DECODE_CACHE
+	cpu65_dcache_free(cpu);
+#endif
+	(void) cpu;
+}
+
+static int running(struct cpu65 *cpu, uint64_t cycles) {
+	return cpu->cycles < cycles && cpu->cs != cs_jammed && cpu->cs != cs_stopped;
+}
+
+static void run(const u8 *img, int step, uint64_t cycles, uint64_t seed) {
+	static struct cpu65 cpu;
+	static struct fuzz_cpu f;
+	f.out = stdout;
+	start(&cpu, &f, img, seed);
+#ifdef CPU_TRACE
+	/* a slice is no longer than 200 cycles, with a cycle per instruction
+	   at the least */
+	if(!step && cpu65_trace_init(&cpu, 256)) exit(1);
+	f.tpos = 0;
+#endif
+	rs = seed ^ 0x5851f42d4c957f2dULL;
+	while(running(&cpu, cycles)) {
+		cpu65_exec(&cpu, step ? 1 : 1 + rnd() % 200);
+		trace_lines(&cpu);
+		state(&cpu);
+	}
+	finish(&cpu);
+}
+
+#ifdef CPU_LANES
+/* runs tests seed to seed+n-1 in lanes, from their images, or with img
+   all from that one, varied for the lanes after the first, of which only
+   the first is printed. the lines of the others are kept in temporary
+   files until all are done. */
+static void run_lanes(const u8 *img, unsigned n, uint64_t cycles, uint64_t seed, unsigned group) {
+	static struct cpu65 cpus[CPU65_LANES];
+	static struct fuzz_cpu f[CPU65_LANES];
+	static struct cpu65_lanes l;
+	static u8 li[65536 + 8];
+	struct cpu65 *cp[CPU65_LANES];
+	int on[CPU65_LANES], live, c;
+	unsigned i;
+	for(i = 0; i < n; ++i) {
+		if(img) {
+			memcpy(li, img, sizeof li);
+			if(i) vary(li, seed + i);
+		} else gen(seed + i, group, li);
+		if(!(f[i].out = i ? tmpfile() : stdout)) exit(1);
+		start(&cpus[i], &f[i], li, seed + i);
+		cp[i] = &cpus[i];
+	}
+	cpu65_lanes_init(&l, cp, n);
+	rs = seed ^ 0x5851f42d4c957f2dULL;
+	for(live = 1; live;) {
+		for(live = 0, i = 0; i < n; ++i) live |= on[i] = running(&cpus[i], cycles);
+		if(live) cpu65_lanes_exec(&l, 1 + rnd() % 200);
+		for(i = 0; i < n; ++i) if(on[i]) state(&cpus[i]);
+	}
+	for(i = 0; i < n; ++i) {
+		finish(&cpus[i]);
+		if(!i) continue;
+		rewind(f[i].out);
+		if(!img) while((c = getc(f[i].out)) != EOF) putchar(c);
+		fclose(f[i].out);
+	}
+}
+#endif
+
+static int usage(void) {
+	fprintf(stderr, "usage: fuzz gen seed file [group]\n"
+		"       fuzz step|slice cycles seed count [group]\n"
+		"       fuzz step|slice cycles -f file\n"
+#ifdef CPU_LANES
+		"       fuzz lanes cycles seed count group\n"
+		"       fuzz lanes cycles -f file group\n"
+#endif
+		);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	static u8 img[65536 + 8];
+	uint64_t seed, cycles, i, n, e;
+	unsigned group = 1;
+	int step, lanes;
+	FILE *f;
+	if((argc == 4 || argc == 5) && !strcmp(argv[1], "gen")) {
+		if(argc == 5 && !(group = strtoul(argv[4], 0, 10))) return usage();
+		gen(strtoull(argv[2], 0, 10), group, img);
+		if(!(f = fopen(argv[3], "wb"))) return 1;
+		fwrite(img, 1, 65536 + 7, f);
+		return fclose(f) ? 1 : 0;
+	}
+	if(argc < 5) return usage();
+	step = !strcmp(argv[1], "step");
+	lanes = !strcmp(argv[1], "lanes");
+	if(!step && !lanes && strcmp(argv[1], "slice")) return usage();
+	if(lanes ? argc != 6 : argc != 5 && (argc != 6 || !strcmp(argv[3], "-f"))) return usage();
+	if(argc == 6 && !(group = strtoul(argv[5], 0, 10))) return usage();
+#ifdef CPU_LANES
+	if(group > CPU65_LANES) return usage();
+#else
+	if(lanes) return usage();
+#endif
+	cycles = strtoull(argv[2], 0, 10);
+	if(!strcmp(argv[3], "-f")) {
+		if(!(f = fopen(argv[4], "rb"))) return 1;
+		if(fread(img, 1, 65536 + 7, f) != 65536 + 7) return 1;
+		fclose(f);
+#ifdef CPU_LANES
+		if(lanes) run_lanes(img, group, cycles, 0, group);
+		else
+#endif
+		run(img, step, cycles, 0);
+		return 0;
+	}
+	seed = strtoull(argv[3], 0, 10);
+	n = strtoull(argv[4], 0, 10);
+	for(i = 0; i < n; i = e) {
+		/* up to the end of the group of seed + i */
+		e = (seed + i) / group * group + group - seed;
+		if(e > n) e = n;
+#ifdef CPU_LANES
+		if(lanes) {
+			run_lanes(0, e - i, cycles, seed + i, group);
+			continue;
+		}
+#endif
+		for(; i < e; ++i) {
+			gen(seed + i, group, img);
+			run(img, step, cycles, seed + i);
+		}
+	}
+	return 0;
+}
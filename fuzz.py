@@ -0,0 +1,258 @@
+import sys, os, shutil, subprocess, tempfile, threading
+from tracedec import tmap, optable
+
+# differential fuzzer. builds fuzz.c for two engine configurations, the
+# reference a and the one under test b, each from compiler flags and
+# optionally a dispatch backend, and runs the same random tests on both.
+# a runs one instruction per cpu65_exec() call, b random numbers of
+# cycles, and each state b stops at is compared with the state a is in
+# after the same number of cycles: registers, flags, zeropage and stack,
+# and the writes since the previous one. so b may be anything that has
+# to agree with the plain interpreter at slice boundaries, like the
+# decode cache, the JIT or another backend.
+# within a slice, b is built with CPU_TRACE and the state each of its
+# instructions started in is compared with the one a is in at that
+# cycle: registers, flags, and the writes up to there, so a divergence
+# is reported at the instruction after the one causing it, even if it
+# evens out again before the slice ends. instructions run as JIT blocks
+# aren't recorded, they're only seen at the next one that is.
+# CPU_NO_COUNT_CYCLES can't be compared this way, a slice never ends.
+# tests are spread over one thread per host core, each taking the next
+# batch of seeds when done with its last. a diverging test is minimized:
+# memory bytes are set to 0 as long as it still diverges, and the result
+# is written to fuzz-TYPE-SEED.bin, with what diverged in the .txt, for
+# replay with -f. a test hanging on either is written as it is.
+# -l checks CPU_LANES against a: b is built with it and runs groups of
+# that many tests in lanes, each sharing its code with the others in the
+# group, with other zeropage bytes. every lane is compared
+# with a like a slice run: registers, flags, memory and cycles. a
+# reproducer is replayed with the other lanes running it varied.
+# python3 fuzz.py -t 2 -l 16 -O2 -- -O2 -mavx2
+# python3 fuzz.py -t 2 -n 10000 -O2 -- -O2 -DCPU_JIT -DCPU_DECODE_CACHE
+
+batch = 20
+
+def usage():
+	sys.stderr.write('usage: %s [-t type] [-n tests] [-s seed] [-c cycles] [-j jobs] [-a backend] [-b backend] [-f file] [-l lanes] cflags_a -- cflags_b\n'%sys.argv[0])
+	sys.stderr.write('chip type: ')
+	for k in sorted(tmap.keys()):
+		sys.stderr.write('%d: %s, '%(k, tmap[k]))
+	sys.stderr.write('\n')
+	sys.stderr.write('-n: number of tests (default 1000)\n')
+	sys.stderr.write('-s: first seed (default 1)\n')
+	sys.stderr.write('-c: cycles per test (default 5000)\n')
+	sys.stderr.write('-j: threads (default one per core)\n')
+	sys.stderr.write('-a, -b: dispatch backend of a and b (default goto)\n')
+	sys.stderr.write('-f: replay a reproducer instead\n')
+	sys.stderr.write('-l: run b in lanes, with CPU_LANES, this many tests at once\n')
+	sys.exit(1)
+
+# the opcodes tests are made of, with their length. those stopping the
+# cpu for good are left out, they would end a test right away.
+def genops(d, cpu):
+	size = { 'imp1': 1, 'acc': 1, 'imm': 2, 'imp2': 2, 'zp': 2, 'zpx': 2, 'zpy': 2,
+		'ind': 2, 'izx': 2, 'izy': 2, 'rel': 2, 'abs': 3, 'abx': 3, 'aby': 3,
+		'abi': 3, 'abix': 3, 'zprel': 3, 'immzp': 3, 'immzx': 3, 'immab': 4,
+		'immax': 4, 'imp3': 7 }
+	tbl = optable(cpu)
+	out = open(os.path.join(d, 'fuzzops.h'), 'w')
+	out.write('static const u8 fuzz_ops[][2] = {\n')
+	for x in range(256):
+		mn, am = tbl[x]
+		if mn.lstrip('%@').lower() in ('kil', 'stp', 'wai'): continue
+		out.write('\t{ 0x%02x, %d }, /* %s %s */\n'%(x, size[am], mn, am))
+	out.write('};\n')
+	out.close()
+
+def build(src, tmp, cpu, name, backend, cflags):
+	d = os.path.join(tmp, name)
+	os.mkdir(d)
+	for f in os.listdir(src):
+		if f.endswith(('.py', '.csv', '.c')): shutil.copy(os.path.join(src, f), d)
+	env = dict(os.environ, DISPATCH=backend)
+	subprocess.check_call([sys.executable, 'gen.py', str(cpu)], cwd=d, env=env, stdout=subprocess.DEVNULL)
+	genops(d, cpu)
+	cc = os.environ['CC'] if 'CC' in os.environ else 'cc'
+	exe = os.path.join(d, 'fuzz')
+	if subprocess.call([cc] + cflags + ['fuzz.c', '-o', exe], cwd=d) != 0:
+		sys.stderr.write('building %s failed\n'%name)
+		sys.exit(1)
+	return exe
+
+# a run taking longer than this many seconds hangs
+hang_secs = 120
+
+# runs exe, returns the tests as {seed: [(cycles, state, writes, insn)]},
+# insn telling the state an instruction of b started in from the state
+# after a call. the test a hanging run was in ends with (None, 'hangs',
+# [], False), the rest of the tests are left out.
+def run(exe, args):
+	tests = {}
+	try: out = subprocess.check_output([exe] + args, timeout=hang_secs).decode()
+	except subprocess.TimeoutExpired as e:
+		out = (e.output or b'').decode()
+		out = out[:out.rfind('\n') + 1] + 'H\n'
+	for line in out.splitlines():
+		if line[0] == 'T':
+			cur = tests[int(line[2:])] = []
+			continue
+		if line[0] == 'H':
+			cur.append((None, 'hangs', [], False))
+			continue
+		insn = line[0] == 'I'
+		st, w = line[2 * insn:].split('|')
+		f = st.split()
+		cur.append((int(f[0]), ' '.join(f[1:]), w.split(), insn))
+	return tests
+
+fields = 'pc a x y s p cs zp+stack mpr writes:hash'
+insn_fields = 'pc a x y s p writes:hash'
+
+# the fields of a state of a that a line of an instruction of b has
+def insn_state(st):
+	f = st.split()
+	return ' '.join(f[:6] + f[-1:])
+
+# compares the runs of a test on a and b, returns None if they agree,
+# otherwise what differs. instructions taking no cycles, like WAI, leave
+# several states of a at the same cycle, b may be at any of them. a runs
+# for end cycles, after a long HuC6280 block transfer b may be past that.
+def compare(ra, rb, end):
+	for r, name in ((ra, 'a'), (rb, 'b')):
+		if r[-1][0] is None: return name + ' hangs'
+	i = 0
+	writes = []
+	start = rb[0][0]
+	for cyc, st, w, insn in rb:
+		key = insn_state if insn else lambda s: s
+		while i < len(ra) and ra[i][0] < cyc:
+			i += 1
+			if i < len(ra): writes += ra[i][2]
+		if i == len(ra):
+			if ra[-1][0] >= end: return None
+			return 'cycle %d: a ended at cycle %d'%(cyc, ra[-1][0])
+		# a slice running past its end doesn't wait in it, so b may
+		# start waiting after WAI a cycle before a does
+		wait = not insn and st.split()[6] == '3'
+		if ra[i][0] != cyc and not (wait and ra[i][1] == st):
+			return 'cycle %d: no instruction on a ends here, at %d'%(cyc, ra[i][0])
+		j = i
+		while key(ra[j][1]) != st:
+			if j + 1 == len(ra) or (ra[j + 1][0] != cyc and not (wait and ra[j + 1][1] == st)):
+				return 'cycle %d (%s%s)\na: %s |%s\nb: %s |%s\nb last agreed at cycle %d'%(cyc,
+					'state an instruction started in: ' if insn else '', insn_fields if insn else fields,
+					key(ra[i][1]), ''.join(' ' + x for x in writes[:32]), st, ''.join(' ' + x for x in w), start)
+			j += 1
+		i = j
+		writes = []
+		start = cyc
+	return None
+
+def check(exea, exeb, args, cycles):
+	group = [str(lanes)] if lanes else []
+	ta = run(exea, ['step', str(cycles + 256)] + args + (group if args[0] != '-f' else []))
+	tb = run(exeb, ['lanes' if lanes else 'slice', str(cycles)] + args + group)
+	return dict((s, compare(ta[s], tb[s], cycles + 256)) for s in tb if s in ta)
+
+# sets memory bytes to 0 in chunks of halving size, keeping each change
+# that still diverges. it only needs to run up to where it diverged.
+def minimize(exea, exeb, img, fn, cycles):
+	size = 65536
+	while size:
+		for a in range(0, 65536, size):
+			if not any(img[a:a + size]): continue
+			t = img[:a] + bytes(size) + img[a + size:]
+			with open(fn, 'wb') as f: f.write(t)
+			if check(exea, exeb, ['-f', fn], cycles)[0]: img = t
+		size //= 2
+	with open(fn, 'wb') as f: f.write(img)
+	return check(exea, exeb, ['-f', fn], cycles)[0]
+
+def report(fn, diff):
+	img = open(fn, 'rb').read()
+	out = open(fn[:-4] + '.txt', 'w')
+	out.write('%s\npc %04x a %02x x %02x y %02x s %02x p %02x\n'%(
+		(diff, img[65536] | img[65537] << 8) + tuple(img[65538:65543])))
+	for a in range(0, 65536, 16):
+		if any(img[a:a + 16]): out.write('%04x: %s\n'%(a, ' '.join('%02x'%b for b in img[a:a + 16])))
+	out.close()
+
+# minimizes and reports a diverging test
+def diverged(seed, diff):
+	global fails
+	fn = os.path.join(src, 'fuzz-%d-%d.bin'%(cpu, seed))
+	subprocess.check_call([exea, 'gen', str(seed), fn] + ([str(lanes)] if lanes else []))
+	if not 'hangs' in diff:
+		at = int(diff.split()[1].rstrip(':'))
+		diff = minimize(exea, exeb, open(fn, 'rb').read(), fn, at) or diff
+	report(fn, diff)
+	with lock:
+		fails += 1
+		sys.stdout.write('seed %d diverges, see %s\n%s\n'%(seed, fn, diff))
+
+def worker():
+	global next_seed
+	while 1:
+		with lock:
+			if next_seed >= end_seed: return
+			s = next_seed
+			e = min(s + batch, end_seed)
+			next_seed = e
+		while s < e:
+			res = check(exea, exeb, [str(s), str(e - s)], cycles)
+			# the tests after a hanging one weren't run
+			s = max(res) + 1 if res else e
+			for seed, diff in sorted(res.items()):
+				if diff: diverged(seed, diff)
+
+if __name__ == '__main__':
+	args = sys.argv[1:]
+	cpu = 2
+	tests = 1000
+	next_seed = 1
+	cycles = 5000
+	jobs = os.cpu_count() or 1
+	backend = { '-a': 'goto', '-b': 'goto' }
+	replay = None
+	lanes = 0
+	while args and args[0] in ('-t', '-n', '-s', '-c', '-j', '-a', '-b', '-f', '-l'):
+		o = args.pop(0)
+		if not args: usage()
+		v = args.pop(0)
+		if o in ('-a', '-b'): backend[o] = v
+		elif o == '-f': replay = os.path.abspath(v)
+		elif not v.isdigit(): usage()
+		elif o == '-t': cpu = int(v)
+		elif o == '-n': tests = int(v)
+		elif o == '-s': next_seed = int(v)
+		elif o == '-c': cycles = int(v)
+		elif o == '-l': lanes = int(v)
+		else: jobs = max(1, int(v))
+	if not cpu in tmap or not '--' in args: usage()
+	cfa = args[:args.index('--')] or ['-O2']
+	cfb = args[args.index('--') + 1:] or ['-O2']
+	# lanes don't run vectorized while tracing
+	if lanes:
+		cfb = cfb + ['-DCPU_LANES']
+		batch = max(batch, lanes)
+	else: cfb = cfb + ['-DCPU_TRACE']
+	src = os.path.dirname(os.path.abspath(__file__))
+	os.chdir(src)
+	tmp = tempfile.mkdtemp()
+	try:
+		exea = build(src, tmp, cpu, 'a', backend['-a'], cfa)
+		exeb = build(src, tmp, cpu, 'b', backend['-b'], cfb)
+		if replay:
+			diff = check(exea, exeb, ['-f', replay], cycles)[0]
+			sys.stdout.write((diff or 'no divergence') + '\n')
+			sys.exit(1 if diff else 0)
+		end_seed = next_seed + tests
+		fails = 0
+		lock = threading.Lock()
+		threads = [threading.Thread(target=worker) for i in range(jobs)]
+		for t in threads: t.start()
+		for t in threads: t.join()
+	finally:
+		shutil.rmtree(tmp)
+	sys.stdout.write('%s: %d tests, %d diverged\n'%(tmap[cpu], tests, fails))
+	sys.exit(1 if fails else 0)
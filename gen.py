@@ -4,14 +4,21 @@ from cycles import cycles
 
 tmap = { 0: '2A03', 1: '6502', 2: '65C02', 3: 'R65C02', 4: 'HUC6280' }
 
+# how handlers are dispatched: goto - computed goto to labels, switch - a
+# switch with a case per handler, fnptr - a table of handler functions
+# called in a loop, musttail - handler functions calling the next one.
+dispatch = os.environ['DISPATCH'] if 'DISPATCH' in os.environ else 'goto'
+if dispatch not in ('goto', 'switch', 'fnptr', 'musttail'):
+	sys.stderr.write('error: unknown DISPATCH %s\n'%dispatch)
+	sys.exit(1)
 
-if len(sys.argv) != 2:
-	sys.stderr.write('error: need to specify chip type\n')
-	sys.stderr.write('chip type: ')
-	for k in sorted(tmap.keys()):
-		sys.stderr.write('%d: %s, '%(k, tmap[k]))
-	sys.stderr.write('\n')
-	sys.stderr.write('example: %s 2 (generate table for 65c02)\n'%sys.argv[0])
+# pair profile to pick the instructions to fuse from, and how many.
+# fused handlers are only reached through the decode cache, which stores
+# their labels, so they need computed goto.
+fuse = os.environ['FUSE'] if 'FUSE' in os.environ else None
+fuse_top = int(os.environ['FUSE_TOP']) if 'FUSE_TOP' in os.environ else 16
+if fuse and dispatch != 'goto':
+	sys.stderr.write('error: FUSE needs DISPATCH goto\n')
 	sys.exit(1)
 
 # operations that read memory, when address modes indicates so
@@ -47,17 +54,47 @@ rw_ops = {
 	'dcp' : 1,
 }
 
+# operations that only write memory, their operand isn't read
 w_ops = {
 	'sta' : 1,
 	'stx': 1,
 	'sty' : 1,
 	'stz' : 1,
-	'sax' : 1,
-	'sha' : 1,
+	'axs' : 1,
+	'ahx' : 1,
+	'tas' : 1,
 	'shx' : 1,
 	'shy' : 1,
 }
 
+# address modes going through CPU_READ_N/CPU_WRITE_N, which may hit i/o.
+bus_modes = ('ind', 'izx', 'izy', 'abs', 'abx', 'aby', 'abi', 'abix', 'immab', 'immax', 'imp3')
+
+# operations only changing registers and flags, which may be part of an
+# idle loop. rw ops only with am acc. see CPU_IDLE_SKIP.
+idle_ops = {
+	'lda' : 1, 'ldx' : 1, 'ldy' : 1, 'lax' : 1,
+	'cmp' : 1, 'cpx' : 1, 'cpy' : 1, 'bit' : 1, 'tst' : 1,
+	'and' : 1, 'ora' : 1, 'eor' : 1, 'adc' : 1, 'sbc' : 1,
+	'asl' : 1, 'lsr' : 1, 'rol' : 1, 'ror' : 1, 'inc' : 1, 'dec' : 1,
+	'inx' : 1, 'iny' : 1, 'dex' : 1, 'dey' : 1,
+	'tax' : 1, 'tay' : 1, 'txa' : 1, 'tya' : 1, 'tsx' : 1, 'txs' : 1,
+	'sax' : 1, 'say' : 1, 'sxy' : 1, 'cla' : 1, 'clx' : 1, 'cly' : 1,
+	'clc' : 1, 'sec' : 1, 'clv' : 1, 'cld' : 1, 'sed' : 1,
+	'tma' : 1, 'nop' : 1,
+}
+# branches, with the displacement in their last byte
+idle_branches = {
+	'bcc' : 1, 'bcs' : 1, 'beq' : 1, 'bmi' : 1, 'bne' : 1, 'bpl' : 1,
+	'bvc' : 1, 'bvs' : 1, 'bra' : 1,
+}
+for i in range(8):
+	idle_branches['bbr%d'%i] = 1
+	idle_branches['bbs%d'%i] = 1
+# operations changing control flow. their handlers end in JUMP_DISPATCH(),
+# which runs the JIT block at the new pc, see JIT_RUN in exec.c
+jump_ops = dict(idle_branches, jmp=1, jsr=1, bsr=1, rts=1, rti=1, brk=1)
+
 pcbytes = {
 	'imp1' : 1,
 	'imp2' : 2,
@@ -136,12 +173,34 @@ addr_trace = {
 def calcaddr(addrmode):
 	return addr_code[addrmode]
 
-cpu = int(sys.argv[1])
-no_undocumented = os.environ['NOUNDOC'] if 'NOUNDOC' in os.environ else 0
-# 65c02 have no undocumented opcodes, all prev. undoc. are nops
-if no_undocumented and cpu > 1 and cpu != 4:
-	print ("disabling NOUNDOC setting due to selected cpu")
-	no_undocumented = 0
+# reads a pair profile: lines of opcode, next opcode and count, in hex,
+# hex and decimal. counts of the same pair are summed, so profiles of
+# several programs can be concatenated.
+def read_pairs(fn):
+	pairs = {}
+	for line in open(fn):
+		f = line.split()
+		if len(f) != 3 or f[0][0] == '#': continue
+		k = (int(f[0], 16), int(f[1], 16))
+		pairs[k] = pairs.get(k, 0) + int(f[2])
+	return pairs
+
+# whether an instruction can run first in a fused pair: it doesn't write
+# memory, change control flow or go through CPU_READ_N, so the bytes of
+# the second one cached with it stay valid and it can run without a
+# dispatch in between. it's at most 2 bytes long, see DC_SPAN.
+def fusable(target):
+	opname, mode = target.rsplit('_', 1)
+	return opname in idle_ops and (opname not in rw_ops or mode == 'acc') and \
+		mode not in bus_modes and pcbytes[mode] <= 2
+
+def get_no_undocumented(cpu):
+	no_undocumented = os.environ['NOUNDOC'] if 'NOUNDOC' in os.environ else 0
+	# 65c02 have no undocumented opcodes, all prev. undoc. are nops
+	if no_undocumented and cpu > 1 and cpu != 4:
+		print ("disabling NOUNDOC setting due to selected cpu")
+		no_undocumented = 0
+	return no_undocumented
 
 def return_all(row, ctx):
 	return 1
@@ -154,7 +213,10 @@ def return_undoc(row, ctx):
 	undocumented = ctx
 	return int(row['opcode'], 16) in undocumented
 
-def main():
+# the mnemonic and address mode of each opcode, for the cpu type in cpu,
+# and the handler it runs, e.g. lda_imm. opcodes the type doesn't have,
+# or undocumented ones with NOUNDOC, run kil_imp1.
+def optables():
 	db = CSVDB('opcodes.csv', ',')
 	rows = db.query(return_sel)
 
@@ -174,9 +236,7 @@ def main():
 		parent[opcode] = chip
 		addrmode[opcode] = row['address_mode']
 
-	undoc = {}
-
-	out = open('optbl.h', 'w')
+	optarget = {}
 	for x in range(256):
 		if not x in opmap or (no_undocumented and opmap[x][0] not in string.ascii_lowercase):
 			target = 'kil_imp1'
@@ -184,48 +244,120 @@ def main():
 			target = opmap[x] + '_' + addrmode[x]
 			if target[0] not in string.ascii_lowercase:
 				target = target[1:]
+		optarget[x] = target
+	return opmap, addrmode, optarget
+
+# the macros the handler of opcode x is compiled with and its code up to
+# the dispatch, as tuple of the two.
+def handler(x, opmap, addrmode, optarget):
+	target = optarget[x]
+	op = opmap[x] if x in opmap and target != 'kil_imp1' else 'kil'
+	if op[0] not in string.ascii_lowercase:
+		op = op[1:]
+	opname = op
+
+	op = 'OP_' + op.upper()
+	if op[-1:] in string.digits:
+		op = op[:-1] + '(%s)'%op[-1:]
+	else: op += '()'
+
+	mode = addrmode[x] if target != 'kil_imp1' else 'imp1'
+	# page cross penalty
+	pcp = 'u8 pcp = 0'
+	if cpu < 4 and mode in ('abx', 'aby', 'izy', 'rel'):
+		if (mode == 'rel') or (opname in r_ops) or \
+		(cpu > 1 and mode == 'abx' and opname in rw_ops):
+			pcp = 'u8 pcp = 1'
+
+	addr = calcaddr(mode) # address mode boilerplate
+	defs = '\t#undef am\n\t#define am am_%s\n'%mode
+	rmw = opname in rw_ops and mode != 'acc'
+	defs += '\t#undef opcyc\n\t#define opcyc %d\n'%cycles[cpu][x]
+	defs += '\t#undef oprmw\n\t#define oprmw %d\n'%rmw
+	defs += '\t#undef opst\n\t#define opst %d\n'%(opname in w_ops)
+	code = 'OPSTART(0x%02x, %s); unsigned tmp, tmp2;/*enum address_mode am = am_%s*/; %s; COV_EXEC(%d); TRACE("%s", am_%s); cpu->pc += %d; %s; %s; cyc += %d; CHKDONE();'% \
+	(x, target, mode, pcp, pcbytes[mode], opmap.get(x, 'kil'), mode, pcbytes[mode], addr, op, cycles[cpu][x])
+	return defs, code
+
+# the dispatch macro ending the handler of target
+def dispatcher(target):
+	return 'JUMP_DISPATCH' if target.rsplit('_', 1)[0] in jump_ops else 'DISPATCH'
+
+# writes the tables for the cpu type in cpu. sfx is appended to the
+# file names, e.g. optbl_65c02.h.
+def main(sfx):
+	opmap, addrmode, optarget = optables()
+
+	undoc = {}
 
+	out = open('optbl%s.h'%sfx, 'w')
+	for x in range(256):
 		comment = ''
-		out.write('\tOPDEF(0x%02x, %s),%s\n'%(x, target, comment))
+		out.write('\tOPDEF(0x%02x, %s),%s\n'%(x, optarget[x], comment))
 	out.close()
 
-	out = open('oplabels.h', 'w')
-	labels = {}
+	out = open('oplabels%s.h'%sfx, 'w')
+	cases = {}
+	first = {}
 	for x in range(256):
-		if not x in opmap or (no_undocumented and opmap[x][0] not in string.ascii_lowercase):
-			target = 'kil_imp1'
-		else:
-			target = opmap[x] + '_' + addrmode[x]
-			if target[0] not in string.ascii_lowercase:
-				target = target[1:]
-		if target in labels: continue
-		labels[target] = 1
-
-		op = opmap[x]
-		if op[0] not in string.ascii_lowercase:
-			op = op[1:]
-		opname = op
-
-		op = 'OP_' + op.upper()
-		if op[-1:] in string.digits:
-			op = op[:-1] + '(%s)'%op[-1:]
-		else: op += '()'
-
-		# page cross penalty
-		pcp = 'u8 pcp = 0'
-		if cpu < 4 and addrmode[x] in ('abx', 'aby', 'izy', 'rel'):
-			if (addrmode[x] == 'rel') or (opname in r_ops) or \
-			(cpu > 1 and addrmode[x] == 'abx' and opname in rw_ops):
-				pcp = 'u8 pcp = 1'
-
-		addr = calcaddr(addrmode[x]) # address mode boilerplate
-		out.write('\t#undef am\n\t#define am am_%s\n'%addrmode[x])
-		out.write('\tlab_%s: { OPSTART(0x%02x, %s); unsigned tmp, tmp2;/*enum address_mode am = am_%s*/; %s; TRACE("%s", am_%s); cpu->pc += %d; %s; %s; cyc += %d; CHKDONE(); DISPATCH(); }\n'% \
-		(target, x, target, addrmode[x], pcp, opmap[x], addrmode[x], pcbytes[addrmode[x]], addr, op, cycles[cpu][x]))
+		cases.setdefault(optarget[x], []).append('case 0x%02x:'%x)
+		first.setdefault(optarget[x], x)
+	labcyc = {}
+	for target in sorted(first, key=lambda t: first[t]):
+		labcyc[target] = cycles[cpu][first[target]]
+		defs, code = handler(first[target], opmap, addrmode, optarget)
+		if dispatch == 'goto': head = '\tlab_%s: '%target
+		elif dispatch == 'switch': head = '\t%s '%' '.join(cases[target])
+		else: head = 'static int CORE(h_%s)(struct cpu65 *cpu, struct exec_st *st) { EXEC_ENTER();\n\t'%target
+		out.write('%s%s{ %s %s(); }\n'%(defs, head, code, dispatcher(target)))
+		if dispatch in ('fnptr', 'musttail'): out.write('}\n')
+
+	# fused pairs, the handlers of both in one, the second getting its
+	# bytes from the decode cache entry with FUSE_NEXT()
+	fused = []
+	if fuse:
+		pairs = read_pairs(fuse)
+		for (a, b), n in sorted(pairs.items(), key=lambda p: (-p[1], p[0])):
+			if len(fused) == fuse_top: break
+			if fusable(optarget[a]): fused.append((a, b, n))
+		# grouped by the first opcode, see FUSEFIRST
+		fused.sort()
+		out.write('#ifdef CPU_DECODE_CACHE\n')
+		for i, (a, b, n) in enumerate(fused):
+			defs, code = handler(first[optarget[a]], opmap, addrmode, optarget)
+			out.write('%s\tlab_fuse_%d: { { %s } FUSE_NEXT(%d);\n'%(defs, i, code, pcbytes[optarget[a].rsplit('_', 1)[1]]))
+			defs, code = handler(first[optarget[b]], opmap, addrmode, optarget)
+			out.write('%s\t{ %s } %s(); }\n'%(defs, code, dispatcher(optarget[b])))
+		out.write('#endif\n')
 	out.close()
 
-	out = open('cpu65type.h', 'w')
-	out.write('#define CPU_TYPE CPU_TYPE_%s\n'%tmap[cpu])
+	# the fused pairs, and per first opcode the index of its first pair
+	if fuse:
+		out = open('opfuse%s.h'%sfx, 'w')
+		for i, (a, b, n) in enumerate(fused):
+			if not i or fused[i - 1][0] != a: out.write('\tFUSEFIRST(0x%02x, %d)\n'%(a, i))
+			out.write('\tFUSEDEF(%d, 0x%02x, %d, 0x%02x) /* %s %s, %d */\n'%(i, a,
+				pcbytes[optarget[a].rsplit('_', 1)[1]], b, optarget[a], optarget[b], n))
+		out.close()
+
+	# per opcode: length if it may be part of an idle loop, ORed with 0x10
+	# for relative branches and 0x20 for jmp abs. 0 for everything else.
+	out = open('opidle%s.h'%sfx, 'w')
+	for x in range(256):
+		opname, mode = optarget[x].rsplit('_', 1)
+		v = 0
+		if opname in idle_branches: v = 0x10 | pcbytes[mode]
+		elif opname == 'jmp' and mode == 'abs': v = 0x20 | pcbytes[mode]
+		elif opname in idle_ops and (opname not in rw_ops or mode == 'acc'):
+			v = pcbytes[mode]
+		out.write('	0x%02x, /* 0x%02x %s */\n'%(v, x, optarget[x]))
+	out.close()
+
+	# cycles as charged by the handler of each opcode. opcodes sharing a
+	# handler use the cycles of the first one.
+	out = open('opcycles%s.h'%sfx, 'w')
+	for x in range(256):
+		out.write('\t%d, /* 0x%02x */\n'%(labcyc[optarget[x]], x))
 	out.close()
 
 # cat oplabels.h | grep OP_ | sed -E 's/.*OP_/OP_/' | sed 's/;.*//' | awk '{print "#define " $0}' | sort -u
@@ -251,4 +383,31 @@ def main():
 
 
 if __name__ == '__main__':
-	main()
+	if len(sys.argv) != 2:
+		sys.stderr.write('error: need to specify chip type\n')
+		sys.stderr.write('chip type: ')
+		for k in sorted(tmap.keys()):
+			sys.stderr.write('%d: %s, '%(k, tmap[k]))
+		sys.stderr.write('\n')
+		sys.stderr.write('example: %s 2 (generate table for 65c02)\n'%sys.argv[0])
+		sys.stderr.write('use all to generate tables for all types, see CPU65_ALL_TYPES\n')
+		sys.stderr.write('set DISPATCH to goto (default), switch, fnptr or musttail to choose how\n')
+		sys.stderr.write('the handlers are dispatched, see CPU_DISPATCH_* in exec.c\n')
+		sys.stderr.write('set FUSE to a file written by cpu65_prof_pairs() to fuse the FUSE_TOP\n')
+		sys.stderr.write('(default 16) most frequent pairs of instructions, see CPU_FUSED in exec.c\n')
+		sys.exit(1)
+
+	out = open('cpu65type.h', 'w')
+	if sys.argv[1] == 'all':
+		for cpu in sorted(tmap.keys()):
+			no_undocumented = get_no_undocumented(cpu)
+			main('_' + tmap[cpu].lower())
+		out.write('#define CPU65_ALL_TYPES\n')
+	else:
+		cpu = int(sys.argv[1])
+		no_undocumented = get_no_undocumented(cpu)
+		main('')
+		out.write('#define CPU_TYPE CPU_TYPE_%s\n'%tmap[cpu])
+	out.write('#define CPU_DISPATCH_%s\n'%dispatch.upper())
+	if fuse: out.write('#define CPU_FUSED\n')
+	out.close()
@@ -0,0 +1,555 @@
+/* x86-64 translator for hot runs of code.
+   this file is included by cpu65.c when CPU_JIT is defined.
+
+   a block is a run of register, immediate and zeropage instructions, and
+   with CPU_MEMMAP absolute, indexed and (zp),y loads and stores, optionally
+   terminated by a conditional branch. everything else (read-modify-write,
+   the stack, BRK/KIL/STP/WAI, ...) ends the block and is run by the
+   regular lab_* handlers. blocks are only looked up where control flow
+   goes, see JUMP_DISPATCH() in exec.c.
+   the translated code works directly on struct cpu65, passed in rdi and
+   kept in rbx. it stores the pc it stopped at and returns the cycles it
+   took. those are static per exit, but for the page crossing penalties of
+   indexed loads, which are added up in ebp. so the interpreter can tell
+   in advance whether it would have run the whole block before mincycles
+   was reached, and return the exact same cycle count as without the JIT.
+   pages without host memory in rmap/wmap are i/o, the block stops before
+   an access to them and leaves it to the handler. it stops after a store
+   that dropped translated code, which may have been its own.
+*/
+#if !defined(__x86_64__)
+#error CPU_JIT is only implemented for x86-64
+#endif
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef CPU_JIT_THRESHOLD
+#define CPU_JIT_THRESHOLD 32
+#elif CPU_JIT_THRESHOLD > 255
+#error CPU_JIT_THRESHOLD needs to fit the 8 bit dispatch counters
+#endif
+#ifndef CPU_JIT_ARENA
+#define CPU_JIT_ARENA (1024*1024)
+#endif
+#define JIT_MAX_INSNS 64
+/* none of the translated instructions is longer than 3 bytes */
+#define JIT_MAX_BYTES (JIT_MAX_INSNS*3)
+/* upper bound of host code emitted per instruction, and per block */
+#define JIT_MAX_EMIT 256
+#define JIT_MAX_CODE ((JIT_MAX_INSNS + 1) * JIT_MAX_EMIT)
+#define JIT_MAX_BLOCKS 8192
+/* shorter blocks cost more to call than the handlers take to run them,
+   but for loops branching back to their start, which JIT_LOOP() keeps
+   running */
+#define JIT_MIN_INSNS 3
+
+struct jit_block {
+	unsigned (*fn)(struct cpu65 *);
+	unsigned guard; /* most cycles all but the last instruction can take */
+};
+
+struct cpu65_jit {
+	struct jit_block *blk[0x10000];
+	u8 cnt[0x10000];
+	u8 code[0x10000/8]; /* bytes covered by translated blocks */
+	u8 *buf;
+	size_t used, pgsize;
+	unsigned nblocks;
+	unsigned dropped; /* counts the times blocks were dropped */
+	struct jit_block blocks[JIT_MAX_BLOCKS];
+};
+
+#ifdef CPU_COVERAGE
+static int cov_written(struct cpu65 *cpu, u16 addr, unsigned n);
+/* code that was seen modified while coverage was recorded isn't
+   translated, see CPU_COVERAGE */
+#define JIT_MODIFIED(PC, N) (cpu->cov && cov_written(cpu, PC, N))
+#else
+#define JIT_MODIFIED(PC, N) 0
+#endif
+static int jit_written(struct cpu65 *cpu, unsigned addr);
+
+/* marks a pc whose first instruction can't be translated */
+static struct jit_block jit_none;
+
+/* enable the JIT for this cpu instance. like the decode cache, translated
+   code is dropped on stores through CPU_WRITE_N and to zeropage/stack,
+   other changes to memory need cpu65_jit_invalidate().
+   returns 0 on success, -1 if memory couldn't be allocated. */
+int cpu65_jit_init(struct cpu65 *cpu) {
+	struct cpu65_jit *j;
+	if(cpu->jit) return 0;
+	if(!(j = calloc(1, sizeof *j))) return -1;
+	j->buf = mmap(0, CPU_JIT_ARENA, PROT_READ|PROT_WRITE,
+	              MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(j->buf == MAP_FAILED) {
+		free(j);
+		return -1;
+	}
+	j->pgsize = sysconf(_SC_PAGESIZE);
+	cpu->jit = j;
+	return 0;
+}
+
+void cpu65_jit_free(struct cpu65 *cpu) {
+	if(!cpu->jit) return;
+	munmap(cpu->jit->buf, CPU_JIT_ARENA);
+	free(cpu->jit);
+	cpu->jit = 0;
+}
+
+static void jit_flush(struct cpu65_jit *j) {
+	memset(j->blk, 0, sizeof j->blk);
+	memset(j->code, 0, sizeof j->code);
+	j->used = 0;
+	j->nblocks = 0;
+	j->dropped++;
+}
+
+static void jit_inval(struct cpu65_jit *j, unsigned addr, unsigned len) {
+	unsigned a, end = (addr + len) & 0xffff;
+	for(a = (addr - (JIT_MAX_BYTES-1)) & 0xffff; a != end; a = (a + 1) & 0xffff)
+		if(j->blk[a]) {
+			j->blk[a] = 0;
+			j->cnt[a] = 0;
+		}
+	/* every block covering the range is gone, so JIT_INVAL can skip it
+	   until it's translated again. bits of the dropped blocks outside of
+	   it may be shared with blocks still there and stay set. */
+	for(a = addr & 0xffff; a != end; a = (a + 1) & 0xffff)
+		j->code[a >> 3] &= ~(1 << (a & 7));
+	j->dropped++;
+}
+
+void cpu65_jit_invalidate(struct cpu65 *cpu, u16 addr, unsigned len) {
+	if(!cpu->jit || !len) return;
+	/* the walk starts JIT_MAX_BYTES-1 before addr, longer ranges wrap */
+	if(len > 0x10000 - JIT_MAX_BYTES) jit_flush(cpu->jit);
+	else jit_inval(cpu->jit, addr, len);
+}
+
+#define JIT_INVAL(ADDR) do { if(cpu->jit && \
+	(cpu->jit->code[(u16)(ADDR) >> 3] & (1 << ((ADDR) & 7)))) \
+	jit_inval(cpu->jit, (ADDR), 1); } while(0)
+
+/* x86 emitters. all struct cpu65 accesses use [rbx+disp32]. */
+#define OFS(F) ((unsigned) offsetof(struct cpu65, F))
+static u8 *e_d32(u8 *p, unsigned d) {
+	*p++ = d; *p++ = d >> 8; *p++ = d >> 16; *p++ = d >> 24;
+	return p;
+}
+/* op byte(s) followed by a modrm for [rbx+disp32] with reg field R */
+static u8 *e_cpu(u8 *p, u8 opc, u8 r, unsigned ofs) {
+	*p++ = opc; *p++ = 0x83 | (r << 3);
+	return e_d32(p, ofs);
+}
+static u8 *e_ld_al(u8 *p, unsigned ofs) { return e_cpu(p, 0x8a, 0, ofs); }
+static u8 *e_st_al(u8 *p, unsigned ofs) { return e_cpu(p, 0x88, 0, ofs); }
+static u8 *e_st_imm(u8 *p, unsigned ofs, u8 v) {
+	p = e_cpu(p, 0xc6, 0, ofs); *p++ = v;
+	return p;
+}
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_S 0x8
+static u8 *e_setcc(u8 *p, u8 cc, unsigned ofs) {
+	*p++ = 0x0f;
+	return e_cpu(p, 0x90 | cc, 0, ofs);
+}
+/* stores the 8 bit result in al as the source of N and Z */
+static u8 *e_zn(u8 *p) {
+	p = e_st_al(p, OFS(f_z));
+	return e_st_al(p, OFS(f_n));
+}
+/* reg <- src, with N/Z from the value */
+static u8 *e_mov_zn(u8 *p, unsigned dst, unsigned src) {
+	p = e_ld_al(p, src);
+	p = e_st_al(p, dst);
+	return e_zn(p);
+}
+/* host CF <- emulated carry */
+static u8 *e_ld_cf(u8 *p) {
+	p = e_ld_al(p, OFS(f_c));
+	*p++ = 0xd0; *p++ = 0xe8; /* shr al, 1 */
+	return p;
+}
+
+/* the block starts by saving rbx and rbp, keeping the stack aligned */
+static u8 *e_enter(u8 *p) {
+	*p++ = 0x53; *p++ = 0x55; /* push rbx; push rbp */
+	*p++ = 0x48; *p++ = 0x83; *p++ = 0xec; *p++ = 0x08; /* sub rsp, 8 */
+	*p++ = 0x48; *p++ = 0x89; *p++ = 0xfb; /* mov rbx, rdi */
+	*p++ = 0x31; *p++ = 0xed; /* xor ebp, ebp */
+	return p;
+}
+/* stops the block at pc, after cyc cycles and the penalties */
+static u8 *e_exit(u8 *p, unsigned pc, unsigned cyc) {
+	*p++ = 0x66; p = e_cpu(p, 0xc7, 0, OFS(pc)); /* mov word [rbx+pc], imm16 */
+	*p++ = pc; *p++ = pc >> 8;
+	*p++ = 0x8d; *p++ = 0x85; p = e_d32(p, cyc); /* lea eax, [rbp+cyc] */
+	*p++ = 0x48; *p++ = 0x83; *p++ = 0xc4; *p++ = 0x08; /* add rsp, 8 */
+	*p++ = 0x5d; *p++ = 0x5b; *p++ = 0xc3; /* pop rbp; pop rbx; ret */
+	return p;
+}
+/* the same if condition cc holds */
+static u8 *e_exit_if(u8 *p, u8 cc, unsigned pc, unsigned cyc) {
+	u8 *q = p + 2;
+	p = e_exit(q, pc, cyc);
+	q[-2] = 0x70 | (cc ^ 1); q[-1] = p - q; /* jncc over the exit */
+	return p;
+}
+
+#ifdef CPU_MEMMAP
+/* ecx <- ecx indexed by the register at idx. with pcp, edx <- 1 if that
+   crosses a page, else 0. */
+static u8 *e_index(u8 *p, unsigned idx, int pcp) {
+	*p++ = 0x0f; p = e_cpu(p, 0xb6, 0, idx); /* movzx eax, byte [rbx+idx] */
+	*p++ = 0x89; *p++ = 0xce; /* mov esi, ecx */
+	*p++ = 0x01; *p++ = 0xc1; /* add ecx, eax */
+	if(pcp) {
+		*p++ = 0x89; *p++ = 0xc8; /* mov eax, ecx */
+		*p++ = 0x31; *p++ = 0xf0; /* xor eax, esi */
+		*p++ = 0xc1; *p++ = 0xe8; *p++ = 0x08; /* shr eax, 8 */
+		*p++ = 0x0f; *p++ = 0x95; *p++ = 0xc2; /* setnz dl */
+		*p++ = 0x0f; *p++ = 0xb6; *p++ = 0xd2; /* movzx edx, dl */
+	}
+	*p++ = 0x0f; *p++ = 0xb7; *p++ = 0xc9; /* movzx ecx, cx */
+	return p;
+}
+/* ecx <- the address the instruction at ob accesses, indexed by the
+   register at idx unless it's 0, see e_index(). */
+static u8 *e_addr(u8 *p, const u8 *ob, unsigned idx, int pcp) {
+	if((ob[0] & 0x1f) == 0x11) { /* (zp),y: the pointer wraps in zeropage */
+		*p++ = 0x48; p = e_cpu(p, 0x8b, 6, OFS(zp)); /* mov rsi, [rbx+zp] */
+		*p++ = 0x0f; *p++ = 0xb6; *p++ = 0x8e; /* movzx ecx, byte [rsi+d32] */
+		p = e_d32(p, ob[1]);
+		*p++ = 0x0f; *p++ = 0xb6; *p++ = 0x86; /* movzx eax, byte [rsi+d32] */
+		p = e_d32(p, (ob[1] + 1) & 0xff);
+		*p++ = 0xc1; *p++ = 0xe0; *p++ = 0x08; /* shl eax, 8 */
+		*p++ = 0x09; *p++ = 0xc1; /* or ecx, eax */
+	} else {
+		*p++ = 0xb9; /* mov ecx, imm32 */
+		p = e_d32(p, ob[1] | ob[2] << 8);
+	}
+	return idx ? e_index(p, idx, pcp) : p;
+}
+/* rsi <- host memory of the page of ecx in the map at ofs. if it's i/o,
+   the block stops at pc after cyc cycles. eax <- the offset in the page */
+static u8 *e_page(u8 *p, unsigned map, unsigned pc, unsigned cyc) {
+	*p++ = 0x89; *p++ = 0xc8; /* mov eax, ecx */
+	*p++ = 0xc1; *p++ = 0xe8; *p++ = 0x08; /* shr eax, 8 */
+	*p++ = 0x48; *p++ = 0x8b; *p++ = 0xb4; *p++ = 0xc3; /* mov rsi, [rbx+rax*8+map] */
+	p = e_d32(p, map);
+	*p++ = 0x48; *p++ = 0x85; *p++ = 0xf6; /* test rsi, rsi */
+	p = e_exit_if(p, CC_E, pc, cyc);
+	*p++ = 0x0f; *p++ = 0xb6; *p++ = 0xc1; /* movzx eax, cl */
+	return p;
+}
+#endif
+
+/* dl <- the register at r, 0 for none */
+static u8 *e_ld_dl(u8 *p, unsigned r) {
+	if(r) return e_cpu(p, 0x8a, 2, r);
+	*p++ = 0x31; *p++ = 0xd2; /* xor edx, edx */
+	return p;
+}
+/* calls jit_written() with the address in ecx. if it dropped code, the
+   block stops at pc after cyc cycles. */
+static u8 *e_written(u8 *p, unsigned pc, unsigned cyc) {
+	uintptr_t f = (uintptr_t) jit_written;
+	unsigned i;
+	*p++ = 0x48; *p++ = 0x89; *p++ = 0xdf; /* mov rdi, rbx */
+	*p++ = 0x89; *p++ = 0xce; /* mov esi, ecx */
+	*p++ = 0x48; *p++ = 0xb8; /* mov rax, imm64 */
+	for(i = 0; i < 8; ++i) *p++ = f >> (i * 8);
+	*p++ = 0xff; *p++ = 0xd0; /* call rax */
+	*p++ = 0x85; *p++ = 0xc0; /* test eax, eax */
+	return e_exit_if(p, CC_NE, pc, cyc);
+}
+
+/* the register loaded or stored by an absolute, (zp),y or zeropage
+   instruction, 0 for stz. *idx is the register it's indexed by, 0 for
+   none. returns -1 for anything else. */
+static int jit_mem_op(u8 opc, unsigned *idx) {
+	*idx = 0;
+	switch(opc) {
+	case 0xad: case 0x8d: case 0x85: return OFS(a); /* lda, sta abs; sta zp */
+	case 0xae: case 0x8e: case 0x86: return OFS(x); /* ldx, stx abs; stx zp */
+	case 0xac: case 0x8c: case 0x84: return OFS(y); /* ldy, sty abs; sty zp */
+	case 0xbd: case 0x9d: *idx = OFS(x); return OFS(a); /* lda, sta abx */
+	case 0xb9: case 0x99: /* lda, sta aby */
+	case 0xb1: case 0x91: *idx = OFS(y); return OFS(a); /* lda, sta izy */
+	case 0xbe: *idx = OFS(y); return OFS(x); /* ldx aby */
+	case 0xbc: *idx = OFS(x); return OFS(y); /* ldy abx */
+	case 0x64: case 0x9c: /* stz zp, abs */
+		return CPU_TYPE > CPU_TYPE_6502 ? 0 : -1;
+	case 0x9e: *idx = OFS(x); /* stz abx */
+		return CPU_TYPE > CPU_TYPE_6502 ? 0 : -1;
+	}
+	return -1;
+}
+
+/* whether a translated instruction may take a page crossing penalty */
+static int jit_pcp(u8 opc) {
+	if(CPU_TYPE >= CPU_TYPE_HUC6280) return 0;
+	switch(opc) {
+	case 0xbd: case 0xb9: case 0xbe: case 0xbc: case 0xb1: return 1;
+	}
+	return 0;
+}
+
+/* the length of a translated non-branch instruction */
+static unsigned jit_len(u8 opc) {
+	switch(opc) {
+	case 0xa9: case 0xa2: case 0xa0: case 0xa5: case 0xa6: case 0xa4:
+	case 0x85: case 0x86: case 0x84: case 0x64: case 0xb1: case 0x91:
+	case 0x29: case 0x09: case 0x49: case 0x25: case 0x05: case 0x45:
+	case 0xc9: case 0xe0: case 0xc0:
+		return 2;
+	case 0xad: case 0xae: case 0xac: case 0xbd: case 0xb9: case 0xbe: case 0xbc:
+	case 0x8d: case 0x8e: case 0x8c: case 0x9d: case 0x99: case 0x9c: case 0x9e:
+		return 3;
+	}
+	return 1;
+}
+
+/* translates one instruction at pc, which starts cyc cycles into the
+   block. returns the end of the emitted code or 0 if the instruction
+   isn't supported. */
+static u8 *jit_insn(u8 *p, const u8 *ob, unsigned pc, unsigned cyc) {
+	unsigned r, idx;
+	int m;
+	switch(ob[0]) {
+	case 0xa9: r = OFS(a); goto ld_imm;
+	case 0xa2: r = OFS(x); goto ld_imm;
+	case 0xa0: r = OFS(y);
+	ld_imm:
+		p = e_st_imm(p, r, ob[1]);
+		p = e_st_imm(p, OFS(f_z), ob[1]);
+		return e_st_imm(p, OFS(f_n), ob[1]);
+	case 0xa5: r = OFS(a); goto ld_zp;
+	case 0xa6: r = OFS(x); goto ld_zp;
+	case 0xa4: r = OFS(y);
+	ld_zp:
+		*p++ = 0x48; p = e_cpu(p, 0x8b, 0, OFS(zp)); /* mov rax, [rbx+zp] */
+		*p++ = 0x0f; *p++ = 0xb6; *p++ = 0x80; /* movzx eax, byte [rax+d32] */
+		p = e_d32(p, ob[1]);
+		p = e_st_al(p, r);
+		return e_zn(p);
+	case 0x85: case 0x86: case 0x84: case 0x64:
+		if((m = jit_mem_op(ob[0], &idx)) < 0) return 0;
+		*p++ = 0x48; p = e_cpu(p, 0x8b, 6, OFS(zp)); /* mov rsi, [rbx+zp] */
+		p = e_ld_dl(p, m);
+		*p++ = 0x88; *p++ = 0x96; p = e_d32(p, ob[1]); /* mov [rsi+d32], dl */
+		*p++ = 0xb9; p = e_d32(p, ZP_BASE + ob[1]); /* mov ecx, imm32 */
+		return e_written(p, pc + 2, cyc + opcycles[ob[0]]);
+#ifdef CPU_MEMMAP
+	case 0xad: case 0xae: case 0xac: case 0xbd: case 0xb9: case 0xbe: case 0xbc:
+	case 0xb1:
+		m = jit_mem_op(ob[0], &idx);
+		p = e_addr(p, ob, idx, jit_pcp(ob[0]));
+		p = e_page(p, OFS(rmap), pc, cyc);
+		if(jit_pcp(ob[0])) {
+			*p++ = 0x01; *p++ = 0xd5; /* add ebp, edx */
+		}
+		*p++ = 0x8a; *p++ = 0x04; *p++ = 0x06; /* mov al, [rsi+rax] */
+		p = e_st_al(p, m);
+		return e_zn(p);
+	case 0x8d: case 0x8e: case 0x8c: case 0x9d: case 0x99: case 0x9c: case 0x9e:
+	case 0x91:
+		if((m = jit_mem_op(ob[0], &idx)) < 0) return 0;
+		p = e_addr(p, ob, idx, 0);
+		/* the handler reads the operand before storing, on i/o that
+		   would go to io_read */
+		p = e_page(p, OFS(rmap), pc, cyc);
+		p = e_page(p, OFS(wmap), pc, cyc);
+		p = e_ld_dl(p, m);
+		*p++ = 0x88; *p++ = 0x14; *p++ = 0x06; /* mov [rsi+rax], dl */
+		return e_written(p, pc + jit_len(ob[0]), cyc + opcycles[ob[0]]);
+#endif
+	case 0xaa: return e_mov_zn(p, OFS(x), OFS(a)); /* tax */
+	case 0xa8: return e_mov_zn(p, OFS(y), OFS(a)); /* tay */
+	case 0x8a: return e_mov_zn(p, OFS(a), OFS(x)); /* txa */
+	case 0x98: return e_mov_zn(p, OFS(a), OFS(y)); /* tya */
+	case 0xba: return e_mov_zn(p, OFS(x), OFS(s)); /* tsx */
+	case 0x9a: p = e_ld_al(p, OFS(x)); return e_st_al(p, OFS(s)); /* txs */
+	case 0xe8: r = OFS(x); goto inc; /* inx */
+	case 0xc8: r = OFS(y); goto inc; /* iny */
+	case 0xca: r = OFS(x); goto dec; /* dex */
+	case 0x88: r = OFS(y); goto dec; /* dey */
+	case 0x1a: case 0x3a: /* inc a, dec a */
+		if(CPU_TYPE <= CPU_TYPE_6502) return 0;
+		r = OFS(a);
+		if(ob[0] == 0x3a) goto dec;
+	inc:
+		p = e_ld_al(p, r);
+		*p++ = 0xfe; *p++ = 0xc0; /* inc al */
+		p = e_st_al(p, r);
+		return e_zn(p);
+	dec:
+		p = e_ld_al(p, r);
+		*p++ = 0xfe; *p++ = 0xc8; /* dec al */
+		p = e_st_al(p, r);
+		return e_zn(p);
+	case 0x18: return e_st_imm(p, OFS(f_c), 0); /* clc */
+	case 0x38: return e_st_imm(p, OFS(f_c), 1); /* sec */
+	case 0xb8: return e_st_imm(p, OFS(f_v), 0); /* clv */
+	case 0xd8: return e_st_imm(p, OFS(f_d), 0); /* cld */
+	case 0xf8: return e_st_imm(p, OFS(f_d), 1); /* sed */
+	case 0x78: return e_st_imm(p, OFS(f_i), 1); /* sei */
+	case 0xea: return p; /* nop */
+	case 0x29: r = 0x24; goto alu_imm; /* and */
+	case 0x09: r = 0x0c; goto alu_imm; /* ora */
+	case 0x49: r = 0x34; /* eor */
+	alu_imm:
+		p = e_ld_al(p, OFS(a));
+		*p++ = r; *p++ = ob[1];
+		p = e_st_al(p, OFS(a));
+		return e_zn(p);
+	case 0x25: r = 0x22; goto alu_zp; /* and */
+	case 0x05: r = 0x0a; goto alu_zp; /* ora */
+	case 0x45: r = 0x32; /* eor */
+	alu_zp:
+		*p++ = 0x48; p = e_cpu(p, 0x8b, 6, OFS(zp)); /* mov rsi, [rbx+zp] */
+		p = e_ld_al(p, OFS(a));
+		*p++ = r; *p++ = 0x86; p = e_d32(p, ob[1]); /* op al, [rsi+d32] */
+		p = e_st_al(p, OFS(a));
+		return e_zn(p);
+	case 0xc9: r = OFS(a); goto cmp_imm;
+	case 0xe0: r = OFS(x); goto cmp_imm;
+	case 0xc0: r = OFS(y);
+	cmp_imm:
+		p = e_ld_al(p, r);
+		*p++ = 0x2c; *p++ = ob[1]; /* sub al, imm8 */
+		p = e_setcc(p, CC_AE, OFS(f_c));
+		return e_zn(p);
+	case 0x0a: r = 4; goto shift_a; /* asl: shl */
+	case 0x4a: r = 5; /* lsr: shr */
+	shift_a:
+		p = e_ld_al(p, OFS(a));
+		*p++ = 0xd0; *p++ = 0xc0 | (r << 3); /* shl/shr al, 1 */
+		p = e_setcc(p, CC_B, OFS(f_c));
+		p = e_st_al(p, OFS(a));
+		return e_zn(p);
+	case 0x2a: r = 2; goto rot_a; /* rol: rcl */
+	case 0x6a: r = 3; /* ror: rcr */
+	rot_a:
+		p = e_ld_cf(p);
+		p = e_cpu(p, 0xd0, r, OFS(a));
+		p = e_setcc(p, CC_B, OFS(f_c));
+		p = e_ld_al(p, OFS(a));
+		return e_zn(p);
+	}
+	return 0;
+}
+
+/* emits a conditional branch ending the block, or returns 0 if the
+   opcode isn't one. pc is where it ends up if not taken. */
+static u8 *jit_branch(u8 *p, const u8 *ob, unsigned pc, unsigned cyc) {
+	unsigned f, target = (pc + (signed char) ob[1]) & 0xffff, taken;
+	u8 cc, mask = 0xff;
+	switch(ob[0]) {
+	case 0x10: f = OFS(f_n); cc = CC_E; mask = 0x80; break;  /* bpl */
+	case 0x30: f = OFS(f_n); cc = CC_NE; mask = 0x80; break; /* bmi */
+	case 0x50: f = OFS(f_v); cc = CC_E; break;  /* bvc */
+	case 0x70: f = OFS(f_v); cc = CC_NE; break; /* bvs */
+	case 0x90: f = OFS(f_c); cc = CC_E; break;  /* bcc */
+	case 0xb0: f = OFS(f_c); cc = CC_NE; break; /* bcs */
+	case 0xd0: f = OFS(f_z); cc = CC_NE; break; /* bne */
+	case 0xf0: f = OFS(f_z); cc = CC_E; break;  /* beq */
+	default: return 0;
+	}
+	cyc += opcycles[ob[0]];
+	taken = cyc + BR_PENALTY;
+	if(CPU_TYPE < CPU_TYPE_HUC6280 && (target & 0xff00) != (pc & 0xff00))
+		taken++;
+	p = e_cpu(p, 0xf6, 0, f); *p++ = mask; /* test byte [rbx+f], mask */
+	p = e_exit_if(p, cc, target, taken);
+	return e_exit(p, pc, cyc);
+}
+
+/* the arena is never writable and executable at once: the pages a block
+   may be emitted to from ofs on are made writable for jit_emit(), and
+   executable again after it. */
+static int jit_protect(struct cpu65_jit *j, size_t ofs, int prot) {
+	size_t m = j->pgsize - 1, a = ofs & ~m, e = ofs + JIT_MAX_CODE;
+	if(e > CPU_JIT_ARENA) e = CPU_JIT_ARENA;
+	return mprotect(j->buf + a, ((e + m) & ~m) - a, prot);
+}
+
+static struct jit_block *jit_emit(struct cpu65 *cpu, unsigned pc) {
+	struct cpu65_jit *j = cpu->jit;
+	struct jit_block *b = &j->blocks[j->nblocks];
+	u8 ob[PC_MAX_FETCH], *start, *p, *q;
+	unsigned n, a, cyc = 0, max = 0, spc = pc;
+
+	start = j->buf + j->used;
+	p = e_enter(start);
+	b->guard = 0;
+	for(n = 0; n < JIT_MAX_INSNS && pc <= 0x10000 - PC_MAX_FETCH; ++n) {
+		CPU_READ_N(ob, pc, PC_MAX_FETCH);
+		b->guard = max;
+		/* the code emitted for an instruction only counts once p
+		   moves past it, so it's checked after being emitted */
+		if((q = jit_insn(p, ob, pc, cyc))) {
+			if(JIT_MODIFIED(pc, jit_len(ob[0]))) break;
+			cyc += opcycles[ob[0]];
+			max += opcycles[ob[0]] + jit_pcp(ob[0]);
+			pc += jit_len(ob[0]);
+			p = q;
+			continue;
+		}
+		if((q = jit_branch(p, ob, pc + 2, cyc))) {
+			if(JIT_MODIFIED(pc, 2)) break;
+			pc += 2;
+			if(n + 1 < JIT_MIN_INSNS &&
+			   ((pc + (signed char) ob[1]) & 0xffff) != spc)
+				return &jit_none;
+			p = q;
+			goto done;
+		}
+		break;
+	}
+	if(n < JIT_MIN_INSNS) return &jit_none;
+	p = e_exit(p, pc, cyc);
+done:
+	b->fn = (unsigned (*)(struct cpu65 *)) start;
+	j->used += p - start;
+	j->nblocks++;
+	for(a = spc; a != pc; ++a)
+		j->code[a >> 3] |= 1 << (a & 7);
+	return b;
+}
+
+static struct jit_block *jit_compile(struct cpu65 *cpu, unsigned pc) {
+	struct cpu65_jit *j = cpu->jit;
+	struct jit_block *b;
+	size_t ofs;
+	if(j->nblocks == JIT_MAX_BLOCKS || CPU_JIT_ARENA - j->used < JIT_MAX_CODE)
+		jit_flush(j);
+	ofs = j->used;
+	if(jit_protect(j, ofs, PROT_READ|PROT_WRITE)) b = 0;
+	else b = jit_emit(cpu, pc);
+	if(!b || jit_protect(j, ofs, PROT_READ|PROT_EXEC)) {
+		/* the blocks on those pages may not run any more, and pc is
+		   left to the interpreter */
+		jit_flush(j);
+		return &jit_none;
+	}
+	return b;
+}
+
+/* returns the block to run at pc, if there is one. pcs are translated
+   after they've been dispatched CPU_JIT_THRESHOLD times. */
+static inline struct jit_block *jit_lookup(struct cpu65 *cpu, unsigned pc) {
+	struct cpu65_jit *j = cpu->jit;
+	struct jit_block *b = j->blk[pc];
+	if(!b) {
+		if(++j->cnt[pc] < CPU_JIT_THRESHOLD) return 0;
+		b = j->blk[pc] = jit_compile(cpu, pc);
+	}
+	return b == &jit_none ? 0 : b;
+}
@@ -0,0 +1,385 @@
+/* lockstep execution of many cpu instances running the same program.
+   this file is included by cpu65.c when CPU_LANES is defined.
+
+   registers and flags of all lanes are kept in vectors (structure of
+   arrays), and instructions are run for all lanes sharing the pc of the
+   lane that is furthest behind, using the host's vector unit via gcc
+   vector extensions. CPU65_LANES defaults to the width of the widest
+   vector registers, i.e. 32 lanes with -mavx2, 16 otherwise.
+   only register, immediate and zeropage-load instructions and branches
+   are run vectorized, everything else is run by cpu65_exec() one
+   instruction at a time for each lane, so the results and cycle
+   counts are exactly those of the scalar core.
+   lanes with pending events or interrupts, a status other than
+   cs_normal, or anything watching single instructions, i.e. a
+   trace_print callback, breakpoints, coverage recording, a trace or
+   the profiler, are left out of the vector code and run entirely by
+   cpu65_exec() once they're the furthest behind. the vector code learns
+   about events and interrupts through the cpu65_schedule() and cpu65_irq()
+   family, the debug hooks are only looked at when cpu65_lanes_exec()
+   starts.
+   the code is fetched from every lane, until all lanes held the same
+   instruction at a pc. like with the decode cache, stores drop that, and
+   if memory changes behind the cpus' back while cpu65_lanes_exec() runs,
+   e.g. due to DMA from a callback, you need to call
+   cpu65_lanes_invalidate().
+*/
+#ifdef CPU_NO_COUNT_CYCLES
+#error CPU_LANES needs cycle counting
+#endif
+
+#ifndef CPU65_LANES
+#ifdef __AVX2__
+#define CPU65_LANES 32
+#else
+#define CPU65_LANES 16
+#endif
+#endif
+#if CPU65_LANES < 8 || CPU65_LANES > 64 || (CPU65_LANES & (CPU65_LANES - 1))
+#error CPU65_LANES needs to be a power of 2 between 8 and 64
+#endif
+
+typedef u8 lane_u8 __attribute__((vector_size(CPU65_LANES)));
+typedef int32_t lane_i32 __attribute__((vector_size(CPU65_LANES*4)));
+
+struct cpu65_lanes {
+	lane_u8 a, x, y, s;
+	lane_u8 f_n, f_v, f_d, f_i, f_z, f_c;
+	lane_u8 pcl, pch; /* split, so comparing them stays in byte lanes */
+	lane_u8 plain; /* lanes_plain() of each lane */
+	lane_i32 cyc; /* cycles run by each lane in the last cpu65_lanes_exec() */
+	struct cpu65 *cpu[CPU65_LANES];
+	uint64_t base[CPU65_LANES];
+	unsigned n;
+	u8 shared[256/8]; /* pages holding the same code in all lanes */
+	const u8 *zp[CPU65_LANES]; /* cpu->zp of each lane */
+	struct cpu65_lanes_hook hook;
+};
+
+/* zeropage of the unused lanes */
+static const u8 lanes_nozp[256];
+
+/* vectors are masked with lanes set to 0xff, comparisons yield 0xff too */
+#define LSEL(M, NEW, OLD) (((NEW) & (M)) | ((OLD) & ~(M)))
+#define LBOOL(V) ((lane_u8)(V) & 1)
+
+/* sets up l to run the n cpus in cpus in lockstep. the cpus need to be
+   initialized already, and are still used directly for everything the
+   vector code doesn't handle, and stay tied to l until cpu65_init().
+   returns -1 if n is larger than CPU65_LANES. */
+int cpu65_lanes_init(struct cpu65_lanes *l, struct cpu65 **cpus, unsigned n) {
+	unsigned i;
+	if(n > CPU65_LANES) return -1;
+	memset(l, 0, sizeof *l);
+	memcpy(l->cpu, cpus, n * sizeof *cpus);
+	l->n = n;
+	for(i = 0; i < CPU65_LANES; ++i) l->zp[i] = lanes_nozp;
+	for(i = 0; i < n; ++i) cpus[i]->lanes = &l->hook;
+	return 0;
+}
+
+void cpu65_lanes_invalidate(struct cpu65_lanes *l, u16 addr, unsigned len) {
+	if(len) lanes_inval(&l->hook, addr, len);
+}
+
+/* declare that the code in addr..addr+len is the same in all lanes and
+   isn't written to, e.g. because it's ROM, and fetching it has no side
+   effects. instructions there
+   are only fetched from the leading lane. elsewhere, every lane's copy
+   of the instruction is compared to the leader's. */
+void cpu65_lanes_shared(struct cpu65_lanes *l, unsigned addr, unsigned len) {
+	unsigned p;
+	if(!len) return;
+	for(p = addr >> 8; p <= (addr + len - 1) >> 8 && p < 256; ++p)
+		l->shared[p >> 3] |= 1 << (p & 7);
+}
+
+/* whether the vector code may run instructions of this cpu */
+static int lanes_plain(struct cpu65 *cpu) {
+#ifdef CPU_DEBUG
+	if(cpu->trace_print) return 0;
+#endif
+#ifdef CPU_TRACE
+	if(cpu->trace) return 0;
+#endif
+#ifdef CPU_PROFILE
+	if(cpu->prof) return 0;
+#endif
+	return cpu->cs == cs_normal && !cpu->nevents && !cpu->irq && !cpu->int_req &&
+		!BP_ON() && !COV_ON();
+}
+
+/* redoes plain for all lanes, after some got events or interrupts */
+static void lanes_replain(struct cpu65_lanes *l) {
+	unsigned i;
+	l->hook.dirty = 0;
+	for(i = 0; i < l->n; ++i) l->plain[i] = lanes_plain(l->cpu[i]) ? 0xff : 0;
+}
+
+static void lanes_get(struct cpu65_lanes *l, unsigned i) {
+	struct cpu65 *cpu = l->cpu[i];
+	l->a[i] = cpu->a; l->x[i] = cpu->x; l->y[i] = cpu->y; l->s[i] = cpu->s;
+	l->f_n[i] = cpu->f_n; l->f_v[i] = cpu->f_v; l->f_d[i] = cpu->f_d;
+	l->f_i[i] = cpu->f_i; l->f_z[i] = cpu->f_z; l->f_c[i] = cpu->f_c;
+	l->pcl[i] = cpu->pcl; l->pch[i] = cpu->pch;
+	l->cyc[i] = cpu->cycles - l->base[i];
+	l->plain[i] = lanes_plain(cpu) ? 0xff : 0;
+	l->zp[i] = cpu->zp;
+}
+
+static void lanes_put(struct cpu65_lanes *l, unsigned i) {
+	struct cpu65 *cpu = l->cpu[i];
+	cpu->a = l->a[i]; cpu->x = l->x[i]; cpu->y = l->y[i]; cpu->s = l->s[i];
+	cpu->f_n = l->f_n[i]; cpu->f_v = l->f_v[i]; cpu->f_d = l->f_d[i];
+	cpu->f_i = l->f_i[i]; cpu->f_z = l->f_z[i]; cpu->f_c = l->f_c[i];
+	cpu->pcl = l->pcl[i]; cpu->pch = l->pch[i];
+	cpu->cycles = l->base[i] + l->cyc[i];
+}
+
+/* length of the instructions the vector code handles, 0 for the rest */
+static unsigned lanes_len(u8 opc) {
+	switch(opc) {
+	case 0xaa: case 0xa8: case 0x8a: case 0x98: case 0xba: case 0x9a:
+	case 0xe8: case 0xc8: case 0xca: case 0x88:
+	case 0x18: case 0x38: case 0xb8: case 0xd8: case 0xf8: case 0x58:
+	case 0x78: case 0xea: case 0x0a: case 0x4a: case 0x2a: case 0x6a:
+		return 1;
+	case 0x1a: case 0x3a: /* inc a, dec a */
+		return CPU_TYPE > CPU_TYPE_6502;
+	case 0xa9: case 0xa2: case 0xa0: case 0xa5: case 0xa6: case 0xa4:
+	case 0x29: case 0x09: case 0x49: case 0xc9: case 0xe0: case 0xc0:
+	case 0x69: case 0xe9:
+	case 0x10: case 0x30: case 0x50: case 0x70:
+	case 0x90: case 0xb0: case 0xd0: case 0xf0:
+		return 2;
+	case 0x80: /* bra */
+		return CPU_TYPE > CPU_TYPE_6502 ? 2 : 0;
+	case 0x4c: /* jmp abs */
+		return 3;
+	}
+	return 0;
+}
+
+static void lanes_zn(struct cpu65_lanes *l, lane_u8 m, lane_u8 v) {
+	l->f_z = LSEL(m, v, l->f_z);
+	l->f_n = LSEL(m, v, l->f_n);
+}
+
+static void lanes_setpc(struct cpu65_lanes *l, lane_u8 m, u16 pc) {
+	l->pcl = LSEL(m, (u8) pc, l->pcl);
+	l->pch = LSEL(m, (u8) (pc >> 8), l->pch);
+}
+
+/* runs the instruction in ob at pc for all lanes in m, returns the most
+   cycles it took in any of them */
+static unsigned lanes_op(struct cpu65_lanes *l, lane_u8 m, u16 pc, const u8 *ob, unsigned len) {
+	lane_u8 *r, v, c, k = (lane_u8){0} + ob[1], t = m;
+	u16 npc = pc + len;
+	unsigned i, pen = 0;
+	switch(ob[0]) {
+	case 0xa9: r = &l->a; v = k; goto ld;
+	case 0xa2: r = &l->x; v = k; goto ld;
+	case 0xa0: r = &l->y; v = k; goto ld;
+	case 0xa5: r = &l->a; goto ld_zp;
+	case 0xa6: r = &l->x; goto ld_zp;
+	case 0xa4: r = &l->y;
+	ld_zp:
+		for(i = 0; i < CPU65_LANES; ++i) v[i] = l->zp[i][ob[1]];
+		goto ld;
+	case 0xaa: r = &l->x; v = l->a; goto ld; /* tax */
+	case 0xa8: r = &l->y; v = l->a; goto ld; /* tay */
+	case 0x8a: r = &l->a; v = l->x; goto ld; /* txa */
+	case 0x98: r = &l->a; v = l->y; goto ld; /* tya */
+	case 0xba: r = &l->x; v = l->s; goto ld; /* tsx */
+	case 0x9a: l->s = LSEL(m, l->x, l->s); break; /* txs */
+	case 0xe8: r = &l->x; v = l->x + 1; goto ld; /* inx */
+	case 0xc8: r = &l->y; v = l->y + 1; goto ld; /* iny */
+	case 0xca: r = &l->x; v = l->x - 1; goto ld; /* dex */
+	case 0x88: r = &l->y; v = l->y - 1; goto ld; /* dey */
+	case 0x1a: r = &l->a; v = l->a + 1; goto ld; /* inc a */
+	case 0x3a: r = &l->a; v = l->a - 1; goto ld; /* dec a */
+	case 0x29: r = &l->a; v = l->a & k; goto ld; /* and */
+	case 0x09: r = &l->a; v = l->a | k; goto ld; /* ora */
+	case 0x49: r = &l->a; v = l->a ^ k; /* eor */
+	ld:
+		*r = LSEL(m, v, *r);
+		lanes_zn(l, m, v);
+		break;
+	case 0x18: l->f_c &= ~m; break; /* clc */
+	case 0x38: l->f_c = LSEL(m, 1, l->f_c); break; /* sec */
+	case 0xb8: l->f_v &= ~m; break; /* clv */
+	case 0xd8: l->f_d &= ~m; break; /* cld */
+	case 0xf8: l->f_d = LSEL(m, 1, l->f_d); break; /* sed */
+	case 0x58: l->f_i &= ~m; break; /* cli, lanes never have an irq pending */
+	case 0x78: l->f_i = LSEL(m, 1, l->f_i); break; /* sei */
+	case 0xea: break; /* nop */
+	case 0xc9: r = &l->a; goto cmp;
+	case 0xe0: r = &l->x; goto cmp;
+	case 0xc0: r = &l->y;
+	cmp:
+		l->f_c = LSEL(m, LBOOL(*r >= k), l->f_c);
+		lanes_zn(l, m, *r - k);
+		break;
+	case 0x69: /* adc, binary mode only */
+		c = l->f_c;
+		v = l->a + k + c;
+		l->f_c = LSEL(m, LBOOL((v < l->a) | ((v == l->a) & (c != 0))), l->f_c);
+		l->f_v = LSEL(m, (~(l->a ^ k) & (l->a ^ v)) >> 7, l->f_v);
+		l->a = LSEL(m, v, l->a);
+		lanes_zn(l, m, v);
+		break;
+	case 0xe9: /* sbc, binary mode only */
+		c = l->f_c;
+		v = l->a - k - 1 + c;
+		l->f_c = LSEL(m, LBOOL((l->a > k) | ((l->a == k) & (c != 0))), l->f_c);
+		l->f_v = LSEL(m, ((l->a ^ v) & (l->a ^ k)) >> 7, l->f_v);
+		l->a = LSEL(m, v, l->a);
+		lanes_zn(l, m, v);
+		break;
+	case 0x0a: c = l->a >> 7; v = l->a << 1; goto shift; /* asl */
+	case 0x4a: c = l->a & 1; v = l->a >> 1; goto shift; /* lsr */
+	case 0x2a: c = l->a >> 7; v = (l->a << 1) | l->f_c; goto shift; /* rol */
+	case 0x6a: c = l->a & 1; v = (l->a >> 1) | (l->f_c << 7); /* ror */
+	shift:
+		l->f_c = LSEL(m, c, l->f_c);
+		r = &l->a;
+		goto ld;
+	case 0x10: t = m & ((l->f_n & 0x80) == 0); goto branch; /* bpl */
+	case 0x30: t = m & ((l->f_n & 0x80) != 0); goto branch; /* bmi */
+	case 0x50: t = m & (l->f_v == 0); goto branch; /* bvc */
+	case 0x70: t = m & (l->f_v != 0); goto branch; /* bvs */
+	case 0x90: t = m & (l->f_c == 0); goto branch; /* bcc */
+	case 0xb0: t = m & (l->f_c != 0); goto branch; /* bcs */
+	case 0xd0: t = m & (l->f_z != 0); goto branch; /* bne */
+	case 0xf0: t = m & (l->f_z == 0); goto branch; /* beq */
+	case 0x80: /* bra */
+		pen = 0 - BR_PENALTY;
+	branch:
+		pen += BR_PENALTY;
+		pc = npc + (signed char) ob[1];
+		if(CPU_TYPE < CPU_TYPE_HUC6280 && (pc & 0xff00) != (npc & 0xff00))
+			pen++;
+		lanes_setpc(l, t, pc);
+		l->cyc += __builtin_convertvector(t, lane_i32) & pen;
+		t = m & ~t;
+		break;
+	case 0x4c: /* jmp */
+		npc = ob[1] | ob[2] << 8;
+		break;
+	}
+	lanes_setpc(l, t, npc);
+	l->cyc += __builtin_convertvector(m, lane_i32) & opcycles[ob[0]];
+	return opcycles[ob[0]] + pen;
+}
+
+static int lanes_any(lane_u8 v) {
+	uint64_t w[CPU65_LANES/8], r = 0;
+	unsigned i;
+	memcpy(w, &v, sizeof w);
+	for(i = 0; i < CPU65_LANES/8; ++i) r |= w[i];
+	return r != 0;
+}
+
+/* runs one instruction of lane i by cpu65_exec(), hi is as below */
+static void lanes_step(struct cpu65_lanes *l, unsigned i, unsigned mincycles, lane_u8 *live, unsigned *hi) {
+	lanes_put(l, i);
+	cpu65_exec(l->cpu[i], 1);
+	lanes_get(l, i);
+	if(l->cyc[i] >= (int) mincycles) (*live)[i] = 0;
+	else if(l->cyc[i] > (int) *hi) *hi = l->cyc[i];
+}
+
+/* the live lane furthest behind, l->n if there is none */
+static unsigned lanes_lead(struct cpu65_lanes *l, lane_u8 live) {
+	lane_i32 on = (lane_i32)(__builtin_convertvector(live, lane_i32) != 0);
+	lane_i32 c = (l->cyc & on) | (INT32_MAX & ~on);
+	int32_t lo = INT32_MAX;
+	unsigned i;
+	for(i = 0; i < CPU65_LANES; ++i) lo = c[i] < lo ? c[i] : lo;
+	if(lo == INT32_MAX) return l->n;
+	for(i = 0; c[i] != lo; ++i);
+	return i;
+}
+
+static int lanes_same(struct cpu65_lanes *l, unsigned pc) {
+	return (l->hook.same[pc >> 3] & (1 << (pc & 7))) ||
+		((l->shared[pc >> 11] & (1 << ((pc >> 8) & 7))) &&
+		 (l->shared[(u16)(pc + 2) >> 11] & (1 << (((pc + 2) >> 8) & 7))));
+}
+
+/* runs every lane until at least mincycles have passed, like cpu65_exec().
+   the number of cycles each lane actually ran is left in l->cyc. */
+void cpu65_lanes_exec(struct cpu65_lanes *l, unsigned mincycles) {
+	struct cpu65 *cpu;
+	lane_u8 live = {0}, m;
+	unsigned i, j, lead, len, hi = 0;
+	u8 ob[8], lob[8];
+	u16 pc;
+
+	/* the host may have changed anything since the last call */
+	memset(l->hook.same, 0, sizeof l->hook.same);
+	l->hook.dirty = 0;
+	for(i = 0; i < l->n; ++i) {
+		l->base[i] = l->cpu[i]->cycles;
+		lanes_get(l, i);
+		live[i] = 0xff;
+	}
+	for(lead = l->n;;) {
+		if(l->hook.dirty) lanes_replain(l);
+		/* once lanes took different paths, the one furthest behind leads,
+		   which lets the others catch up and run together again. */
+		if(lead == l->n || !live[lead]) {
+			lead = lanes_lead(l, live);
+			if(lead == l->n) break;
+		}
+		cpu = l->cpu[lead];
+		if(!l->plain[lead]) {
+			lanes_put(l, lead);
+			cpu65_exec(cpu, mincycles - l->cyc[lead]);
+			lanes_get(l, lead);
+			live[lead] = 0;
+			continue;
+		}
+		pc = l->pcl[lead] | l->pch[lead] << 8;
+		CPU_READ_N(ob, pc, PC_MAX_FETCH);
+		len = lanes_len(ob[0]);
+		m = live & l->plain & (lane_u8)(l->pcl == l->pcl[lead]) & (lane_u8)(l->pch == l->pch[lead]);
+		if(BCD && (ob[0] == 0x69 || ob[0] == 0xe9)) m &= (lane_u8)(l->f_d == 0);
+		if(!len && !l->hook.dirty) {
+			/* the other lanes at pc likely run the same, they are all
+			   stepped before the next lead is picked */
+			for(i = 0; i < l->n; ++i) if(m[i]) lanes_step(l, i, mincycles, &live, &hi);
+			lead = l->n;
+			continue;
+		}
+		if(!len || !m[lead] || l->hook.dirty) {
+		step:
+			lanes_step(l, lead, mincycles, &live, &hi);
+			lead = l->n;
+			continue;
+		}
+		if(!lanes_same(l, pc)) {
+			for(i = j = 0; j < l->n; ++j) {
+				if(!m[j] || j == lead) continue;
+				cpu = l->cpu[j];
+				CPU_READ_N(lob, pc, PC_MAX_FETCH);
+				if(memcmp(lob, ob, len)) m[j] = 0;
+				else ++i;
+			}
+			/* fetches may have run callbacks */
+			if(l->hook.dirty) goto step;
+			if(i == l->n - 1) l->hook.same[pc >> 3] |= 1 << (pc & 7);
+		}
+		/* hi is an upper bound of the cycles run by any live lane, the
+		   exact check is only needed once it reaches mincycles. */
+		hi += lanes_op(l, m, pc, ob, len);
+		if(hi >= mincycles) {
+			for(hi = 0, i = 0; i < l->n; ++i) {
+				if(l->cyc[i] >= (int) mincycles) live[i] = 0;
+				else if(live[i] && l->cyc[i] > (int) hi) hi = l->cyc[i];
+			}
+		}
+		if(lanes_any(live & ~m)) lead = l->n;
+	}
+	for(i = 0; i < l->n; ++i) lanes_put(l, i);
+}
@@ -0,0 +1,261 @@
+/* profiler. this file is included by cpu65.c when CPU_PROFILE is defined.
+
+   once enabled with cpu65_prof_init(), the interpreter counts executions
+   and cycles per opcode, address mode and pc, and per opcode how often a
+   branch was taken and a page crossing cost an extra cycle, and how often
+   each opcode followed each other one within a slice. an instruction
+   is charged the cycles up to the next one, i.e. including those of
+   JIT blocks running after it and of idle loops skipped by it.
+   the cycles of interrupt sequences and those spent waiting for an
+   interrupt after WAI are counted separately.
+   a shadow call stack is kept from jsr, bsr, brk and interrupts on one
+   side and rts and rti on the other, giving the cycles per routine and
+   its callers. a reset empties it. code playing tricks with the stack,
+   like returning with jmp or dropping return addresses, confuses it: an
+   rts with nothing on it is ignored, calls nested deeper than
+   CPU_PROF_MAX_DEPTH or beyond CPU_PROF_MAX_NODES distinct call paths
+   are charged to the caller.
+   cpu65_prof_report() writes the counters as text,
+   cpu65_prof_folded() the call paths in the collapsed stack format read
+   by flamegraph.pl and similar tools, cpu65_prof_pairs() the opcode pairs
+   for gen.py to pick the ones to fuse, see FUSE there.
+   without CPU_PROFILE, none of this is compiled in. */
+
+#include <stdio.h>
+
+#ifndef CPU_PROF_MAX_DEPTH
+#define CPU_PROF_MAX_DEPTH 64
+#endif
+#ifndef CPU_PROF_MAX_NODES
+#define CPU_PROF_MAX_NODES 65536
+#endif
+
+/* a routine as called from one path. node 0 is the root, standing for
+   code not called from anywhere we know of. */
+struct prof_node {
+	uint64_t cycles; /* spent in the routine itself */
+	unsigned parent, child, next; /* 0 if there is none */
+	u16 fn; /* entry address */
+	u8 depth;
+};
+
+#define AM_COUNT (am_acc + 1)
+
+struct cpu65_prof {
+	uint64_t op_count[256], op_cycles[256];
+	uint64_t op_taken[256]; /* branches taken */
+	uint64_t op_pcross[256]; /* page crossing penalties */
+	uint64_t pair_count[256][256]; /* by opcode run before, opcode */
+	uint64_t am_count[AM_COUNT], am_cycles[AM_COUNT];
+	uint64_t pc_count[65536], pc_cycles[65536];
+	uint64_t int_count, int_cycles; /* interrupt sequences */
+	uint64_t wait_cycles; /* waiting for an interrupt */
+	/* the instruction running. flow is what it did to the call stack */
+	unsigned cyc;
+	u16 pc;
+	u8 op, am, busy, flow;
+	struct prof_node *node;
+	unsigned nnodes, cap, cur;
+	unsigned lost; /* calls not entered, returns to ignore */
+};
+
+enum { PF_NONE, PF_CALL, PF_RET };
+
+/* start profiling. returns 0 on success, -1 if out of memory. */
+int cpu65_prof_init(struct cpu65 *cpu) {
+	struct cpu65_prof *p;
+	if(cpu->prof) return 0;
+	if(!(p = calloc(1, sizeof *p))) return -1;
+	p->cap = 256;
+	if(!(p->node = calloc(p->cap, sizeof *p->node))) {
+		free(p);
+		return -1;
+	}
+	p->nnodes = 1;
+	cpu->prof = p;
+	return 0;
+}
+
+void cpu65_prof_free(struct cpu65 *cpu) {
+	if(!cpu->prof) return;
+	free(cpu->prof->node);
+	free(cpu->prof);
+	cpu->prof = 0;
+}
+
+/* enters the routine at fn, called from the current one */
+static void prof_enter(struct cpu65_prof *p, u16 fn) {
+	struct prof_node *n;
+	unsigned i;
+	if(p->node[p->cur].depth >= CPU_PROF_MAX_DEPTH) goto lost;
+	for(i = p->node[p->cur].child; i; i = p->node[i].next)
+		if(p->node[i].fn == fn) {
+			p->cur = i;
+			return;
+		}
+	if(p->nnodes == p->cap) {
+		if(p->cap >= CPU_PROF_MAX_NODES) goto lost;
+		if(!(n = realloc(p->node, p->cap * 2 * sizeof *n))) goto lost;
+		p->node = n;
+		p->cap *= 2;
+	}
+	i = p->nnodes++;
+	n = &p->node[i];
+	memset(n, 0, sizeof *n);
+	n->fn = fn;
+	n->parent = p->cur;
+	n->depth = p->node[p->cur].depth + 1;
+	n->next = p->node[p->cur].child;
+	p->node[p->cur].child = i;
+	p->cur = i;
+	return;
+lost:
+	p->lost++;
+}
+
+/* charges the instruction running with the cycles up to cyc. the call
+   stack is updated afterwards, so a jsr counts for the caller. */
+static void prof_flush(struct cpu65 *cpu, unsigned cyc) {
+	struct cpu65_prof *p = cpu->prof;
+	unsigned c = cyc - p->cyc;
+	if(!p->busy) return;
+	p->busy = 0;
+	p->op_count[p->op]++;
+	p->op_cycles[p->op] += c;
+	p->am_count[p->am]++;
+	p->am_cycles[p->am] += c;
+	p->pc_count[p->pc]++;
+	p->pc_cycles[p->pc] += c;
+	p->node[p->cur].cycles += c;
+	if(p->flow == PF_CALL) prof_enter(p, cpu->pc);
+	else if(p->flow == PF_RET) {
+		if(p->lost) p->lost--;
+		else if(p->cur) p->cur = p->node[p->cur].parent;
+	}
+}
+
+static inline void prof_insn(struct cpu65 *cpu, enum address_mode am, u8 op, unsigned cyc) {
+	struct cpu65_prof *p = cpu->prof;
+	if(p->busy) p->pair_count[p->op][op]++;
+	prof_flush(cpu, cyc);
+	p->busy = 1;
+	p->cyc = cyc;
+	p->pc = cpu->pc;
+	p->op = op;
+	p->am = am;
+	p->flow = PF_NONE;
+}
+
+/* the interrupt sequence just run took c cycles. it enters the handler,
+   unless it was a reset, which leaves whatever was on the call stack
+   for good and starts over at the root. */
+static unsigned prof_int(struct cpu65 *cpu, unsigned c, int rst) {
+	struct cpu65_prof *p = cpu->prof;
+	if(!p || !c) return c;
+	p->int_count++;
+	p->int_cycles += c;
+	if(rst) {
+		p->cur = 0;
+		p->lost = 0;
+	} else prof_enter(p, cpu->pc);
+	p->node[p->cur].cycles += c;
+	return c;
+}
+
+/* c cycles passed waiting for an interrupt */
+static void prof_wait(struct cpu65 *cpu, unsigned c) {
+	struct cpu65_prof *p = cpu->prof;
+	p->wait_cycles += c;
+	p->node[p->cur].cycles += c;
+}
+
+static const char *prof_am_names[AM_COUNT] = {
+	[am_imp1] = "imp1", [am_imp2] = "imp2", [am_imp3] = "imp3",
+	[am_imm] = "imm", [am_zp] = "zp", [am_zpx] = "zpx", [am_zpy] = "zpy",
+	[am_zprel] = "zprel", [am_ind] = "ind", [am_izx] = "izx",
+	[am_izy] = "izy", [am_abs] = "abs", [am_abx] = "abx",
+	[am_aby] = "aby", [am_abi] = "abi", [am_abix] = "abix",
+	[am_rel] = "rel", [am_immzp] = "immzp", [am_immzx] = "immzx",
+	[am_immab] = "immab", [am_immax] = "immax", [am_acc] = "acc",
+};
+
+static const uint64_t *prof_sort_by;
+static int prof_cmp(const void *a, const void *b) {
+	uint64_t x = prof_sort_by[*(const u16 *) a], y = prof_sort_by[*(const u16 *) b];
+	return x < y ? 1 : x > y ? -1 : (int) *(const u16 *) a - *(const u16 *) b;
+}
+
+/* writes the counters as text: per opcode, address mode, and the top
+   pcs by cycles, all of them if top is 0. returns 0 on success, -1 if
+   profiling is off or out of memory. */
+int cpu65_prof_report(struct cpu65 *cpu, FILE *f, unsigned top) {
+	struct cpu65_prof *p = cpu->prof;
+	uint64_t cycles = 0;
+	unsigned i, n;
+	u16 *pcs;
+	if(!p) return -1;
+	if(!(pcs = malloc(65536 * sizeof *pcs))) return -1;
+	for(i = 0; i < 256; ++i) cycles += p->op_cycles[i];
+	fprintf(f, "cycles %llu, interrupts %llu taking %llu cycles, waiting %llu cycles\n\n",
+		(unsigned long long) cycles, (unsigned long long) p->int_count,
+		(unsigned long long) p->int_cycles, (unsigned long long) p->wait_cycles);
+	fprintf(f, "opcode        count       cycles        taken   page cross\n");
+	for(i = 0; i < 256; ++i) if(p->op_count[i])
+		fprintf(f, "    %02x %12llu %12llu %12llu %12llu\n", i,
+			(unsigned long long) p->op_count[i], (unsigned long long) p->op_cycles[i],
+			(unsigned long long) p->op_taken[i], (unsigned long long) p->op_pcross[i]);
+	fprintf(f, "\nmode          count       cycles\n");
+	for(i = 0; i < AM_COUNT; ++i) if(p->am_count[i])
+		fprintf(f, "%-6s %12llu %12llu\n", prof_am_names[i],
+			(unsigned long long) p->am_count[i], (unsigned long long) p->am_cycles[i]);
+	for(i = n = 0; i < 65536; ++i) if(p->pc_count[i]) pcs[n++] = i;
+	prof_sort_by = p->pc_cycles;
+	qsort(pcs, n, sizeof *pcs, prof_cmp);
+	if(top && n > top) n = top;
+	fprintf(f, "\npc            count       cycles\n");
+	for(i = 0; i < n; ++i)
+		fprintf(f, "%04x   %12llu %12llu\n", pcs[i],
+			(unsigned long long) p->pc_count[pcs[i]], (unsigned long long) p->pc_cycles[pcs[i]]);
+	free(pcs);
+	return 0;
+}
+
+/* writes one line per call path with the cycles spent in its innermost
+   routine, like "cpu;$c000;$c123 1234". the root frame "cpu" holds the
+   code not called from anywhere we know of. returns 0 on success, -1 if
+   profiling is off. */
+int cpu65_prof_folded(struct cpu65 *cpu, FILE *f) {
+	struct cpu65_prof *p = cpu->prof;
+	u16 path[CPU_PROF_MAX_DEPTH + 1];
+	unsigned i, j, d;
+	if(!p) return -1;
+	for(i = 0; i < p->nnodes; ++i) {
+		if(!p->node[i].cycles) continue;
+		for(d = 0, j = i; j; j = p->node[j].parent) path[d++] = p->node[j].fn;
+		fprintf(f, "cpu");
+		while(d) fprintf(f, ";$%04x", path[--d]);
+		fprintf(f, " %llu\n", (unsigned long long) p->node[i].cycles);
+	}
+	return 0;
+}
+
+/* writes a line "op1 op2 count" in hex, hex and decimal per pair of
+   opcodes run one after the other. returns 0 on success, -1 if profiling
+   is off. */
+int cpu65_prof_pairs(struct cpu65 *cpu, FILE *f) {
+	struct cpu65_prof *p = cpu->prof;
+	unsigned i, j;
+	if(!p) return -1;
+	for(i = 0; i < 256; ++i) for(j = 0; j < 256; ++j) if(p->pair_count[i][j])
+		fprintf(f, "%02x %02x %llu\n", i, j, (unsigned long long) p->pair_count[i][j]);
+	return 0;
+}
+
+#define PROF_INSN(AM) if(cpu->prof) prof_insn(cpu, AM, op.op, cyc);
+#define PROF_FLUSH() do { if(cpu->prof) prof_flush(cpu, cyc); } while(0)
+#define PROF_INT(C, RST) prof_int(cpu, C, RST)
+#define PROF_WAIT(C) do { if(cpu->prof) prof_wait(cpu, C); } while(0)
+#define PROF_CALL() do { if(cpu->prof) cpu->prof->flow = PF_CALL; } while(0)
+#define PROF_RET() do { if(cpu->prof) cpu->prof->flow = PF_RET; } while(0)
+#define PROF_TAKEN() do { if(cpu->prof) cpu->prof->op_taken[op.op]++; } while(0)
+#define PROF_PCROSS() do { if(cpu->prof) cpu->prof->op_pcross[op.op]++; } while(0)
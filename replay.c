@@ -0,0 +1,307 @@
+/* i/o record and replay. this file is included by cpu65.c when
+   CPU_REPLAY is defined, which needs CPU_MEMMAP and implies
+   CPU_BUS_CYCLES.
+
+   the cpu is deterministic but for what comes from the devices: the
+   values read from i/o pages, and the interrupts they raise. recording
+   logs both to a stdio stream, each with the cycle it happened at.
+   replaying feeds them back in place of the devices, so the same code
+   runs into the same states with nothing but the memory map, a lot
+   faster than the whole system and the same every time.
+   writes to i/o pages are hashed along with their cycle, the hash is
+   logged with each interrupt and at the end. a replay that reads other
+   addresses, at other cycles, or writes differently has diverged.
+   the replay needs to start from the state recording started from, with
+   the same memory mapped and the same options, e.g. no JIT in one but
+   not the other, as these can change what's read from i/o. idle loops
+   aren't skipped meanwhile, as that depends on when device events come.
+   the slice has to end where an interrupt was taken, so its event is
+   scheduled before the slice starts: replay reads ahead to the next
+   interrupt, and keeps the reads up to there in memory.
+   changes the devices make to memory directly, or to the mapping, aren't
+   recorded. for the latter, writes are still passed to io_write during
+   replay if the host sets one, so that can keep e.g. bank switching.
+
+   the stream is a header, "C65L", the version, the cpu type and cycles
+   at the start (8 bytes), followed by records. a record starts with a
+   tag, RP_* in the low 2 bits, and the cycles since the previous record
+   as LEB128. a read has the address unless RP_SAME is set in the tag,
+   the length - 1 unless RP_ONE is set, then the data. an interrupt has
+   what was taken, INT_RST, INT_NMI or the irq lines << 2, and the hash
+   of the writes so far. the end record has the hash. numbers are little
+   endian. */
+#include <stdio.h>
+
+#ifndef CPU_MEMMAP
+#error CPU_REPLAY needs CPU_MEMMAP
+#endif
+
+#define RP_VERSION 1
+#define RP_READ 0
+#define RP_INT 1
+#define RP_END 2
+#define RP_ONE 4 /* a single byte was read */
+#define RP_SAME 8 /* from the same address as the previous read */
+
+struct cpu65_replay {
+	FILE *f;
+	int play; /* replaying rather than recording */
+	/* the host's callbacks, restored by cpu65_replay_stop() */
+	void (*io_read) (struct cpu65*, u8 *dest, u16 addr, unsigned n);
+	void (*io_write) (struct cpu65*, const u8 *src, u16 addr, unsigned n);
+	uint64_t when; /* cycle of the previous record */
+	uint32_t hash; /* of the writes so far */
+	u16 addr; /* of the previous read */
+	/* when replaying, the reads up to the next interrupt or the end,
+	   with their data in data, then that record */
+	struct rp_read {
+		uint64_t when;
+		size_t ofs;
+		u16 addr, n;
+	} *rd;
+	size_t nrd, ird, rdcap;
+	u8 *data;
+	size_t ndata, datacap;
+	u8 tag, what;
+	uint64_t next;
+	uint32_t rhash;
+	int done; /* the replay reached the end of the recording */
+	int error; /* the stream couldn't be written, or was cut short */
+	uint64_t diverged; /* cycle the replay first differed at, -1 if not */
+};
+
+static void rp_num(FILE *f, uint64_t v, unsigned n) {
+	for(; n; --n, v >>= 8) putc(v & 0xff, f);
+}
+
+static uint64_t rp_get(struct cpu65_replay *rp, unsigned n) {
+	uint64_t v = 0;
+	unsigned i;
+	int c;
+	for(i = 0; i < n; ++i) {
+		if((c = getc(rp->f)) == EOF) rp->error = 1;
+		v |= (uint64_t) (c & 0xff) << (i * 8);
+	}
+	return v;
+}
+
+/* writes the tag and the cycles since the previous record */
+static void rp_tag(struct cpu65_replay *rp, unsigned tag, uint64_t when) {
+	uint64_t d = when - rp->when;
+	putc(tag, rp->f);
+	for(; d > 0x7f; d >>= 7) putc(0x80 | (d & 0x7f), rp->f);
+	putc(d, rp->f);
+	rp->when = when;
+}
+
+static void rp_hash(struct cpu65_replay *rp, const u8 *p, unsigned n) {
+	uint32_t h = rp->hash;
+	while(n--) {
+		h ^= *p++;
+		h *= 16777619u;
+	}
+	rp->hash = h;
+}
+
+static void rp_diverged(struct cpu65 *cpu, uint64_t when) {
+	if(cpu->replay->diverged == (uint64_t) -1) cpu->replay->diverged = when;
+}
+
+static void rp_write(struct cpu65 *cpu, const u8 *src, u16 addr, unsigned n) {
+	struct cpu65_replay *rp = cpu->replay;
+	u8 h[10];
+	unsigned i;
+	for(i = 0; i < 8; ++i) h[i] = cpu->bus_cycle >> (i * 8);
+	h[8] = addr;
+	h[9] = addr >> 8;
+	rp_hash(rp, h, sizeof h);
+	rp_hash(rp, src, n);
+	if(rp->io_write) rp->io_write(cpu, src, addr, n);
+}
+
+static void rp_record_read(struct cpu65 *cpu, u8 *dest, u16 addr, unsigned n) {
+	struct cpu65_replay *rp = cpu->replay;
+	unsigned tag = RP_READ | (n == 1 ? RP_ONE : 0) | (addr == rp->addr ? RP_SAME : 0);
+	if(rp->io_read) rp->io_read(cpu, dest, addr, n);
+	else memset(dest, 0xff, n);
+	rp_tag(rp, tag, cpu->bus_cycle);
+	if(!(tag & RP_SAME)) rp_num(rp->f, addr, 2);
+	if(!(tag & RP_ONE)) putc(n - 1, rp->f);
+	fwrite(dest, 1, n, rp->f);
+	rp->addr = addr;
+}
+
+static void rp_event(struct cpu65 *cpu, void *ctx);
+
+/* makes room for one more read of len bytes */
+static int rp_grow(struct cpu65_replay *rp, size_t len) {
+	void *p;
+	if(rp->nrd == rp->rdcap) {
+		if(!(p = realloc(rp->rd, (rp->rdcap * 2 + 64) * sizeof *rp->rd))) return -1;
+		rp->rd = p;
+		rp->rdcap = rp->rdcap * 2 + 64;
+	}
+	if(rp->datacap - rp->ndata < len) {
+		if(!(p = realloc(rp->data, rp->datacap * 2 + len))) return -1;
+		rp->data = p;
+		rp->datacap = rp->datacap * 2 + len;
+	}
+	return 0;
+}
+
+/* while replaying, reads the records up to the next interrupt or the
+   end, and schedules that */
+static void rp_fill(struct cpu65 *cpu) {
+	struct cpu65_replay *rp = cpu->replay;
+	struct rp_read *r;
+	uint64_t d;
+	unsigned s;
+	int c;
+	rp->nrd = rp->ird = rp->ndata = 0;
+	while(!rp->error) {
+		if((c = getc(rp->f)) == EOF) break;
+		rp->tag = c;
+		d = s = 0;
+		do {
+			if((c = getc(rp->f)) == EOF) rp->error = 1;
+			d |= (uint64_t) (c & 0x7f) << s;
+			s += 7;
+		} while((c & 0x80) && s < 64);
+		rp->when += d;
+		if((rp->tag & 3) != RP_READ) {
+			rp->next = rp->when;
+			if((rp->tag & 3) == RP_INT) rp->what = rp_get(rp, 1);
+			rp->rhash = rp_get(rp, 4);
+			if(rp->error || cpu65_schedule(cpu, rp->next, rp_event, rp)) break;
+			return;
+		}
+		if(!(rp->tag & RP_SAME)) rp->addr = rp_get(rp, 2);
+		s = rp->tag & RP_ONE ? 1 : rp_get(rp, 1) + 1;
+		if(rp_grow(rp, s)) break;
+		r = &rp->rd[rp->nrd++];
+		r->when = rp->when;
+		r->addr = rp->addr;
+		r->n = s;
+		r->ofs = rp->ndata;
+		if(fread(rp->data + rp->ndata, 1, s, rp->f) != s) rp->error = 1;
+		rp->ndata += s;
+	}
+	/* cut short. what was read is still replayed, up to where it ends */
+	rp->error = 1;
+	rp->tag = RP_END;
+	rp->next = (uint64_t) -1;
+}
+
+/* the interrupt is raised, or the end reached, at the cycle recorded */
+static void rp_event(struct cpu65 *cpu, void *ctx) {
+	struct cpu65_replay *rp = ctx;
+	if((rp->tag & 3) == RP_INT) {
+		if(rp->what & (INT_RST | INT_NMI)) cpu->int_req |= rp->what;
+		else cpu65_irq(cpu, rp->what >> 2, 1);
+		return;
+	}
+	if(rp->ird != rp->nrd || rp->rhash != rp->hash) rp_diverged(cpu, cpu->cycles);
+	rp->done = 1;
+}
+
+/* past the end, reads give 0xff and interrupts aren't checked */
+static void rp_play_read(struct cpu65 *cpu, u8 *dest, u16 addr, unsigned n) {
+	struct cpu65_replay *rp = cpu->replay;
+	struct rp_read *r = &rp->rd[rp->ird];
+	if(rp->done || rp->ird == rp->nrd || r->when != cpu->bus_cycle ||
+	   r->addr != addr || r->n != n) {
+		if(!rp->done) rp_diverged(cpu, cpu->bus_cycle);
+		memset(dest, 0xff, n);
+		return;
+	}
+	memcpy(dest, rp->data + r->ofs, n);
+	rp->ird++;
+}
+
+/* called by int_service() when it takes the interrupt what */
+static void replay_int(struct cpu65 *cpu, unsigned what) {
+	struct cpu65_replay *rp = cpu->replay;
+	if(!rp->play) {
+		rp_tag(rp, RP_INT, cpu->cycles);
+		putc(what, rp->f);
+		rp_num(rp->f, rp->hash, 4);
+		return;
+	}
+	if(rp->done) return;
+	if((rp->tag & 3) != RP_INT || rp->next != cpu->cycles || rp->what != what ||
+	   rp->ird != rp->nrd || rp->rhash != rp->hash) {
+		rp_diverged(cpu, cpu->cycles);
+		return;
+	}
+	cpu65_irq(cpu, what >> 2, 0);
+	rp_fill(cpu);
+}
+
+/* starts recording to f, or replaying from it if play is set. for
+   recording, set io_read and io_write to the devices first, they're
+   called through the recorder. when replaying, io_read isn't called,
+   io_write is, if set. run until cpu->replay->done is set to replay the
+   whole recording.
+   returns 0 on success, -1 if out of memory, or the stream can't be
+   replayed from the current state. */
+int cpu65_replay_start(struct cpu65 *cpu, FILE *f, int play) {
+	struct cpu65_replay *rp;
+	u8 h[6];
+	if(cpu->replay || !(rp = calloc(1, sizeof *rp))) return -1;
+	rp->f = f;
+	rp->play = play;
+	rp->io_read = cpu->io_read;
+	rp->io_write = cpu->io_write;
+	rp->when = cpu->cycles;
+	rp->hash = 2166136261u;
+	rp->diverged = (uint64_t) -1;
+	cpu->replay = rp;
+	if(!play) {
+		fwrite("C65L", 1, 4, f);
+		putc(RP_VERSION, f);
+		putc(CPU_TYPE, f);
+		rp_num(f, cpu->cycles, 8);
+		cpu->io_read = rp_record_read;
+	} else {
+		if(fread(h, 1, 6, f) != 6 || memcmp(h, "C65L", 4) || h[4] != RP_VERSION ||
+		   h[5] != CPU_TYPE || rp_get(rp, 8) != cpu->cycles || rp->error) {
+			cpu->replay = 0;
+			free(rp);
+			return -1;
+		}
+		cpu->io_read = rp_play_read;
+		rp_fill(cpu);
+	}
+	cpu->io_write = rp_write;
+	return 0;
+}
+
+/* stops recording or replaying and restores the callbacks. the stream
+   is left open. when recording, the end is written at the current cycle.
+   returns 0 on success, -1 if the stream couldn't be written or read,
+   the replay diverged or didn't reach the end. */
+int cpu65_replay_stop(struct cpu65 *cpu) {
+	struct cpu65_replay *rp = cpu->replay;
+	int r;
+	if(!rp) return -1;
+	if(!rp->play) {
+		rp_tag(rp, RP_END, cpu->cycles);
+		rp_num(rp->f, rp->hash, 4);
+		if(fflush(rp->f) || ferror(rp->f)) rp->error = 1;
+	}
+	/* the end is due where cpu65_exec() returned, its event didn't fire */
+	if(rp->play && !rp->done && (rp->tag & 3) == RP_END && rp->next == cpu->cycles)
+		rp_event(cpu, rp);
+	r = rp->error || (rp->play && (!rp->done || rp->diverged != (uint64_t) -1)) ? -1 : 0;
+	cpu65_unschedule(cpu, rp_event, rp);
+	cpu->io_read = rp->io_read;
+	cpu->io_write = rp->io_write;
+	cpu->replay = 0;
+	free(rp->rd);
+	free(rp->data);
+	free(rp);
+	return r;
+}
+
+#define REPLAY_INT(WHAT) do { if(cpu->replay) replay_int(cpu, WHAT); } while(0)
+#define REPLAY_ON() cpu->replay
@@ -0,0 +1,249 @@
+/* rewind history. this file is included by cpu65.c when CPU_REWIND is
+   defined, which implies CPU_SNAPSHOT.
+
+   cpu65_rewind_push() records a frame: the register and event state, and
+   for every page written since the previous frame the XOR of its old and
+   new contents, run-length encoded. frames are kept in a ring of fixed
+   size, the oldest ones are dropped when it's full. going back applies
+   the deltas of the newer frames to a shadow copy of the memory, which
+   always holds the contents as of the latest frame.
+   which memory is covered is the same as for snapshots.
+*/
+
+struct cpu65_rewind {
+	u8 *ring;
+	size_t size, head, tail, used;
+	unsigned frames;
+	u8 shadow[256][256];
+};
+
+/* a frame is stored as its length, the registers, cs up to events,
+   nevents events, the page deltas and the length again, so the ring
+   can be walked in both directions. a page delta is the page number,
+   the 16 bit length of the encoded data and the data itself. */
+#define RW_REGS offsetof(struct cpu65, zp)
+#define RW_STATE (offsetof(struct cpu65, events) - offsetof(struct cpu65, cs))
+#define RW_NEV (offsetof(struct cpu65, nevents) - offsetof(struct cpu65, cs))
+/* upper bound of an encoded page */
+#define RW_RLE_MAX (256 + (256/3 + 2) * 2)
+
+static void rw_put(struct cpu65_rewind *rw, size_t *ofs, const void *src, size_t n) {
+	size_t c = rw->size - *ofs;
+	if(c > n) c = n;
+	memcpy(rw->ring + *ofs, src, c);
+	memcpy(rw->ring, (const u8 *) src + c, n - c);
+	*ofs = (*ofs + n) % rw->size;
+}
+
+static void rw_get(struct cpu65_rewind *rw, size_t *ofs, void *dst, size_t n) {
+	size_t c = rw->size - *ofs;
+	if(c > n) c = n;
+	memcpy(dst, rw->ring + *ofs, c);
+	memcpy((u8 *) dst + c, rw->ring, n - c);
+	*ofs = (*ofs + n) % rw->size;
+}
+
+/* drops frames from the tail until n more bytes fit. */
+static int rw_reserve(struct cpu65_rewind *rw, size_t n) {
+	uint32_t len;
+	size_t o;
+	while(rw->used + n > rw->size) {
+		if(!rw->frames) return -1;
+		o = rw->tail;
+		rw_get(rw, &o, &len, 4);
+		rw->tail = (rw->tail + len) % rw->size;
+		rw->used -= len;
+		rw->frames--;
+	}
+	return 0;
+}
+
+static int rw_append(struct cpu65_rewind *rw, const void *src, size_t n) {
+	if(rw_reserve(rw, n)) return -1;
+	rw_put(rw, &rw->head, src, n);
+	rw->used += n;
+	return 0;
+}
+
+/* encodes the nonzero bytes of d as pairs of (zeros to skip, literal
+   count) followed by the literals. returns the encoded length. */
+static unsigned rw_rle(u8 *out, const u8 *d) {
+	unsigned i = 0, n = 0, z, l;
+	while(i < 256) {
+		for(z = 0; i < 256 && !d[i] && z < 255; ++i, ++z);
+		for(l = 0; i + l < 256 && l < 255 &&
+		    (d[i + l] || (i + l + 1 < 256 && d[i + l + 1])); ++l);
+		out[n++] = z;
+		out[n++] = l;
+		memcpy(out + n, d + i, l);
+		n += l;
+		i += l;
+	}
+	return n;
+}
+
+static void rw_unrle(u8 *page, const u8 *in, unsigned n) {
+	unsigned i = 0, j = 0, l;
+	while(j < n) {
+		i += in[j++];
+		l = in[j++];
+		for(; l; --l) page[i++] ^= in[j++];
+	}
+}
+
+/* appends a frame with the current state. */
+static int rw_frame(struct cpu65 *cpu) {
+	struct cpu65_rewind *rw = cpu->rw;
+	size_t start = rw->head;
+	unsigned p, i, x;
+	uint32_t len = 0;
+	u8 hdr[3], d[256], enc[RW_RLE_MAX], *m;
+	int err = 0;
+	err |= rw_append(rw, &len, 4);
+	err |= rw_append(rw, cpu, RW_REGS);
+	err |= rw_append(rw, &cpu->cs, RW_STATE);
+	err |= rw_append(rw, cpu->events, cpu->nevents * sizeof *cpu->events);
+	for(p = 0; p < 256; ++p) {
+		if(!(cpu->rw_dirty[p >> 3] & (1 << (p & 7)))) {
+			if(!cpu->rw_dirty[p >> 3]) p |= 7;
+			continue;
+		}
+		if(!(m = snap_page(cpu, p))) continue;
+		for(x = i = 0; i < 256; ++i) x |= d[i] = m[i] ^ rw->shadow[p][i];
+		if(!x) continue;
+		memcpy(rw->shadow[p], m, 256);
+		i = rw_rle(enc, d);
+		hdr[0] = p;
+		hdr[1] = i;
+		hdr[2] = i >> 8;
+		err |= rw_append(rw, hdr, 3);
+		err |= rw_append(rw, enc, i);
+	}
+	memset(cpu->rw_dirty, 0, sizeof cpu->rw_dirty);
+	err |= rw_append(rw, &len, 4);
+	if(err) {
+		/* the frame doesn't fit even into the empty ring. the shadow is
+		   up to date nevertheless, so start over with a frame without
+		   deltas. */
+		rw->head = rw->tail = rw->used = 0;
+		rw->frames = 0;
+		if(rw->size >= 8 + RW_REGS + RW_STATE + cpu->nevents * sizeof *cpu->events)
+			rw_frame(cpu);
+		return -1;
+	}
+	len = (rw->head + rw->size - start) % rw->size;
+	if(!len) len = rw->size;
+	rw_put(rw, &start, &len, 4);
+	start = (rw->head + rw->size - 4) % rw->size;
+	rw_put(rw, &start, &len, 4);
+	rw->frames++;
+	return 0;
+}
+
+void cpu65_rewind_free(struct cpu65 *cpu) {
+	if(!cpu->rw) return;
+	free(cpu->rw->ring);
+	free(cpu->rw);
+	cpu->rw = 0;
+}
+
+/* start recording frames, using a ring of size bytes. the shadow copy of
+   the memory takes another 64K. the current state becomes the first frame.
+   returns 0 on success, -1 if out of memory or size is too small for it. */
+int cpu65_rewind_init(struct cpu65 *cpu, size_t size) {
+	struct cpu65_rewind *rw;
+	unsigned p;
+	u8 *m;
+	if(cpu->rw) return 0;
+	if(!(rw = calloc(1, sizeof *rw))) return -1;
+	if(!(rw->ring = malloc(size))) {
+		free(rw);
+		return -1;
+	}
+	rw->size = size;
+	for(p = 0; p < 256; ++p) if((m = snap_page(cpu, p))) memcpy(rw->shadow[p], m, 256);
+	memset(cpu->rw_dirty, 0, sizeof cpu->rw_dirty);
+	cpu->rw = rw;
+	if(rw_frame(cpu)) {
+		cpu65_rewind_free(cpu);
+		return -1;
+	}
+	return 0;
+}
+
+/* record a frame, e.g. once per emulated video frame. this takes time
+   proportional to the pages written since the previous one. returns -1 if
+   the frame was too large for the ring, in which case all older frames
+   are gone. */
+int cpu65_rewind_push(struct cpu65 *cpu) {
+	if(!cpu->rw) return -1;
+	return rw_frame(cpu);
+}
+
+/* number of frames one can go back */
+unsigned cpu65_rewind_frames(struct cpu65 *cpu) {
+	return cpu->rw && cpu->rw->frames ? cpu->rw->frames - 1 : 0;
+}
+
+/* start offset of the newest frame */
+static size_t rw_last(struct cpu65_rewind *rw) {
+	size_t o = (rw->head + rw->size - 4) % rw->size;
+	uint32_t len;
+	rw_get(rw, &o, &len, 4);
+	return (rw->head + rw->size - len) % rw->size;
+}
+
+/* undoes the deltas of the newest frame on the shadow and drops it. the
+   pages are marked in rw_dirty to be copied to memory. */
+static void rw_pop(struct cpu65 *cpu) {
+	struct cpu65_rewind *rw = cpu->rw;
+	size_t o = rw_last(rw);
+	uint32_t len, n;
+	unsigned nev;
+	u8 st[RW_STATE], hdr[3], enc[RW_RLE_MAX];
+	rw_get(rw, &o, &len, 4);
+	o = (o + RW_REGS) % rw->size;
+	rw_get(rw, &o, st, RW_STATE);
+	memcpy(&nev, st + RW_NEV, sizeof nev);
+	o = (o + nev * sizeof *cpu->events) % rw->size;
+	n = len - 8 - RW_REGS - RW_STATE - nev * sizeof *cpu->events;
+	while(n) {
+		rw_get(rw, &o, hdr, 3);
+		rw_get(rw, &o, enc, hdr[1] | hdr[2] << 8);
+		rw_unrle(rw->shadow[hdr[0]], enc, hdr[1] | hdr[2] << 8);
+		RW_DIRTY(hdr[0]);
+		n -= 3 + (hdr[1] | hdr[2] << 8);
+	}
+	rw->head = (rw->head + rw->size - len) % rw->size;
+	rw->used -= len;
+	rw->frames--;
+}
+
+/* go back to the state of n frames ago. n = 0 just undoes everything
+   since the latest frame. the frames newer than the target are dropped.
+   returns 0 on success, -1 if there aren't that many frames. */
+int cpu65_rewind(struct cpu65 *cpu, unsigned n) {
+	struct cpu65_rewind *rw = cpu->rw;
+	unsigned p;
+	size_t o;
+	u8 *m, mpr[8];
+	if(!rw || n >= rw->frames) return -1;
+	for(; n; --n) rw_pop(cpu);
+	o = (rw_last(rw) + 4) % rw->size;
+	memcpy(mpr, cpu->mpr, sizeof mpr);
+	rw_get(rw, &o, cpu, RW_REGS);
+	MPR_RESTORED(mpr);
+	rw_get(rw, &o, &cpu->cs, RW_STATE);
+	rw_get(rw, &o, cpu->events, cpu->nevents * sizeof *cpu->events);
+	/* the pages written since the latest frame and those of the frames
+	   dropped. this comes last, so on HuC6280 they go to the banks
+	   mapped as of the frame. */
+	for(p = 0; p < 256; ++p) {
+		if(!(cpu->rw_dirty[p >> 3] & (1 << (p & 7))) || !(m = snap_page(cpu, p))) continue;
+		memcpy(m, rw->shadow[p], 256);
+		code_inval(cpu, p << 8, 256);
+		cpu->dirty[p >> 3] |= 1 << (p & 7);
+	}
+	memset(cpu->rw_dirty, 0, sizeof cpu->rw_dirty);
+	return 0;
+}
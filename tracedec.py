@@ -0,0 +1,99 @@
+from csvdb import CSVDB
+import sys, struct, os, string
+
+# decodes a file of struct cpu65_trace_rec, as fetched with
+# cpu65_trace_read(), into the text CPU_DEBUG prints. the type is the one
+# passed to gen.py, or the type of the instance for CPU65_ALL_TYPES.
+# records are expected in little endian byte order.
+
+tmap = { 0: '2A03', 1: '6502', 2: '65C02', 3: 'R65C02', 4: 'HUC6280' }
+
+# cycle, pc, ea, opcode and operand bytes, a, x, y, s, p
+rec = struct.Struct('<QHH7s5B')
+
+def usage():
+	sys.stderr.write('usage: %s [-c] type tracefile\n'%sys.argv[0])
+	sys.stderr.write('chip type: ')
+	for k in sorted(tmap.keys()):
+		sys.stderr.write('%d: %s, '%(k, tmap[k]))
+	sys.stderr.write('\n')
+	sys.stderr.write('-c: append the cycle and effective address\n')
+	sys.exit(1)
+
+# the mnemonic and address mode per opcode, as gen.py picks them. opcodes
+# sharing a handler are printed like the first of them.
+def optable(cpu):
+	db = CSVDB('opcodes.csv', ',')
+	opmap = {}
+	parent = {}
+	addrmode = {}
+	for row in db.query(lambda row, ctx: int(row['chiptype']) <= cpu):
+		opcode = int(row['opcode'], 16)
+		chip = int(row['chiptype'])
+		if opcode in parent and parent[opcode] > chip: continue
+		opmap[opcode] = row['mnemonic']
+		parent[opcode] = chip
+		addrmode[opcode] = row['address_mode']
+	noundoc = os.environ['NOUNDOC'] if 'NOUNDOC' in os.environ else 0
+	if noundoc and cpu > 1 and cpu != 4: noundoc = 0
+	first = {}
+	tbl = []
+	for x in range(256):
+		if not x in opmap or (noundoc and opmap[x][0] not in string.ascii_lowercase):
+			target = 'kil_imp1'
+		else:
+			target = opmap[x] + '_' + addrmode[x]
+			if target[0] not in string.ascii_lowercase: target = target[1:]
+		if not target in first: first[target] = (opmap[x], addrmode[x])
+		tbl.append(first[target])
+	return tbl
+
+def operands(am, p):
+	sb = lambda v: v - 256 if v > 127 else v
+	if am == 'abs': return ' $%02x%02x'%(p[1], p[0])
+	if am == 'abx': return ' $%02x%02x, x'%(p[1], p[0])
+	if am == 'aby': return ' $%02x%02x, y'%(p[1], p[0])
+	if am == 'acc': return ' A'
+	if am in ('imp2', 'zp'): return ' $%02x'%p[0]
+	if am == 'zpx': return ' $%02x, x'%p[0]
+	if am == 'zpy': return ' $%02x, y'%p[0]
+	if am == 'imp1': return ''
+	if am == 'imp3': return ' $%02x%02x, $%02x%02x, $%02x%02x'%(p[1], p[0], p[3], p[2], p[5], p[4])
+	if am == 'imm': return ' #$%02x'%p[0]
+	if am == 'zprel': return ' $%02x, %d'%(p[0], sb(p[1]))
+	if am == 'ind': return ' ($%02x)'%p[0]
+	if am == 'izx': return ' ($%02x, x)'%p[0]
+	if am == 'izy': return ' ($%02x), y'%p[0]
+	if am == 'abi': return ' ($%02x%02x)'%(p[1], p[0])
+	if am == 'abix': return ' ($%02x%02x, x)'%(p[1], p[0])
+	if am == 'rel': return ' %d'%sb(p[0])
+	if am == 'immzp': return ' #$%02x, $%02x'%(p[0], p[1])
+	if am == 'immzx': return ' #$%02x, $%02x, x'%(p[0], p[1])
+	if am == 'immab': return ' #$%02x, $%02x%02x'%(p[0], p[2], p[1])
+	if am == 'immax': return ' #$%02x, $%02x%02x, x'%(p[0], p[2], p[1])
+	return ''
+
+def flags(p):
+	s = ''
+	for i, c in enumerate('NVTBDIZC'):
+		s += c if p & (0x80 >> i) else c.lower()
+	return s
+
+if __name__ == '__main__':
+	args = sys.argv[1:]
+	cyc = len(args) and args[0] == '-c'
+	if cyc: args = args[1:]
+	if len(args) != 2 or not args[0].isdigit() or int(args[0]) not in tmap: usage()
+	tbl = optable(int(args[0]))
+	out = sys.stdout
+	with open(args[1], 'rb') as f:
+		while 1:
+			b = f.read(rec.size)
+			if len(b) < rec.size: break
+			cycle, pc, ea, ob, a, x, y, s, p = rec.unpack(b)
+			ob = bytearray(ob)
+			insn, am = tbl[ob[0]]
+			out.write('PC:%04x S:%02x A:%02x X:%02x Y:%02x %s O:%02x %s%s'%(
+				pc, s, a, x, y, flags(p), ob[0], insn, operands(am, ob[1:])))
+			if cyc: out.write(' C:%d EA:%04x'%(cycle, ea))
+			out.write('\n')